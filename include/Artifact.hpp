@@ -0,0 +1,40 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_ARTIFACT_H
+#define REVERSE_IMAGE_SEARCH_ARTIFACT_H
+
+#include <map>
+#include <string>
+
+/**
+ * Describes what an artifact on disk (vocabulary, histograms, trained SVM, ...) was built from. Every input is stored
+ * as a hash of its contents and every parameter as its string value, so comparing two manifests tells whether the
+ * artifact is still valid.
+ */
+struct ArtifactManifest {
+  std::map<std::string, std::string> inputs;
+  std::map<std::string, std::string> params;
+
+  bool operator==(const ArtifactManifest &other) const {
+    return inputs == other.inputs && params == other.params;
+  }
+
+  bool operator!=(const ArtifactManifest &other) const {
+    return !(*this == other);
+  }
+};
+
+std::string HashString(const std::string &value);
+
+std::string HashFile(const std::string &file_path);
+
+std::string HashDirectory(const std::string &dir_path);
+
+std::string ManifestPath(const std::string &artifact_path);
+
+void WriteArtifactManifest(const std::string &artifact_path, const ArtifactManifest &manifest);
+
+bool ReadArtifactManifest(const std::string &artifact_path, ArtifactManifest &out_manifest);
+
+bool ArtifactIsFresh(const std::string &artifact_path, const ArtifactManifest &expected);
+
+#endif //REVERSE_IMAGE_SEARCH_ARTIFACT_H
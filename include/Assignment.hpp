@@ -0,0 +1,22 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_ASSIGNMENT_H
+#define REVERSE_IMAGE_SEARCH_ASSIGNMENT_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+cv::Mat ComputeCentroidNorms(const cv::Mat &centroids);
+
+void AssignToNearestCentroids(const cv::Mat &descriptors, const cv::Mat &centroids, const cv::Mat &centroid_norms,
+                              std::vector<int> &out_labels, std::vector<float> *out_distances=nullptr,
+                              int block_rows=256);
+
+cv::Mat ComputeBowHistogram(const cv::Mat &descriptors, const cv::Mat &vocabulary, const cv::Mat &centroid_norms);
+
+cv::Mat ComputeBowHistogram(const std::vector<int> &labels, int word_count);
+
+cv::Mat SeedCenters(const cv::Mat &descriptors, int cluster_count, cv::RNG &rng);
+
+cv::Mat ClusterDescriptors(const cv::Mat &descriptors, int cluster_count, const cv::TermCriteria &term_criteria);
+
+#endif //REVERSE_IMAGE_SEARCH_ASSIGNMENT_H
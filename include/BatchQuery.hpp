@@ -0,0 +1,22 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_BATCHQUERY_H
+#define REVERSE_IMAGE_SEARCH_BATCHQUERY_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+/**
+ * A database row matched by a query, along with its cross-correlation score against the query
+ */
+struct ScoredMatch {
+  int row;
+  float score;
+};
+
+cv::Mat NormalizeForCorrelation(const cv::Mat &histograms);
+
+void ScoreTopK(const cv::Mat &queries, const cv::Mat &database, int k,
+               std::vector<std::vector<ScoredMatch> > &out_matches, int query_block_rows=256,
+               int database_block_rows=4096);
+
+#endif //REVERSE_IMAGE_SEARCH_BATCHQUERY_H
@@ -0,0 +1,113 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_BOUNDEDQUEUE_H
+#define REVERSE_IMAGE_SEARCH_BOUNDEDQUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+/**
+ * A blocking FIFO queue with a fixed capacity, used to connect the stages of a pipeline. Push() blocks while the queue
+ * is full, which applies backpressure to the producing stage and caps the number of items held in memory. Pop() blocks
+ * while the queue is empty. Once Close() is called, producers are rejected and consumers drain the remaining items.
+ *
+ * The time producers spend blocked on a full queue, and consumers on an empty one, is accumulated so that a pipeline
+ * can report which stage it is waiting on.
+ */
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity) : capacity_(capacity), closed_(false), push_wait_(0), pop_wait_(0) {}
+
+  /**
+   * Appends an item, blocking while the queue is full
+   * @param item T the item to append
+   * @return bool false if the queue was closed and the item was dropped
+   */
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (items_.size() >= capacity_ && !closed_) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      not_full_.wait(lock, [this] { return items_.size() < capacity_ || closed_; });
+      push_wait_ += std::chrono::steady_clock::now() - start;
+    }
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Removes the oldest item, blocking while the queue is empty and still open
+   * @param out_item T the removed item
+   * @return bool false once the queue is closed and fully drained
+   */
+  bool Pop(T &out_item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (items_.empty() && !closed_) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+      pop_wait_ += std::chrono::steady_clock::now() - start;
+    }
+    if (items_.empty()) {
+      return false;
+    }
+    out_item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  /**
+   * Removes the oldest item if one is available without blocking
+   * @param out_item T the removed item
+   * @return bool true|false on whether or not an item was removed
+   */
+  bool TryPop(T &out_item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (items_.empty()) {
+      return false;
+    }
+    out_item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  /**
+   * Stops accepting new items and wakes every blocked producer and consumer
+   */
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+  double push_wait_seconds() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::chrono::duration<double>(push_wait_).count();
+  }
+
+  double pop_wait_seconds() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::chrono::duration<double>(pop_wait_).count();
+  }
+
+ private:
+  size_t capacity_;
+  bool closed_;
+  std::deque<T> items_;
+  mutable std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::chrono::steady_clock::duration push_wait_;
+  std::chrono::steady_clock::duration pop_wait_;
+};
+
+#endif //REVERSE_IMAGE_SEARCH_BOUNDEDQUEUE_H
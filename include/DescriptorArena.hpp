@@ -0,0 +1,69 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_DESCRIPTORARENA_H
+#define REVERSE_IMAGE_SEARCH_DESCRIPTORARENA_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "GeometricIndex.hpp"
+
+/**
+ * Holds the descriptors of every image in the data set in a single contiguous buffer, along with the range of rows
+ * belonging to each image. Extraction appends each image as it finishes (see ExtractDescriptorsPipelined()) and
+ * consumers such as the vocabulary clustering take cv::Mat views of it, so the descriptors of the data set are only
+ * ever held once.
+ *
+ * Each image also records the path it was extracted from and, if its key points were given, the quantized key point of
+ * every descriptor (see QuantizeKeyPoints()), so the data set can be encoded without extracting it again.
+ */
+class DescriptorArena {
+ public:
+  explicit DescriptorArena(int cols=64, int type=CV_32F);
+
+  void Reserve(int rows);
+
+  cv::Mat BeginImage(int rows);
+
+  void EndImage(int rows, const std::string &image_path=std::string(),
+                const std::vector<cv::KeyPoint> &key_points=std::vector<cv::KeyPoint>());
+
+  void Append(const cv::Mat &descriptors, const std::string &image_path=std::string(),
+              const std::vector<cv::KeyPoint> &key_points=std::vector<cv::KeyPoint>());
+
+  cv::Mat Descriptors() const;
+
+  cv::Mat ImageDescriptors(size_t image) const;
+
+  const std::string &ImagePath(size_t image) const;
+
+  const GeometricFeature *ImageFeatures(size_t image, size_t &out_count) const;
+
+  // Only when the key points of every image were given
+  bool has_features() const {
+    return rows_ > 0 && features_.size() == (size_t) rows_;
+  }
+
+  size_t image_count() const {
+    return image_offsets_.size();
+  }
+
+  int rows() const {
+    return rows_;
+  }
+
+  bool WriteToDisk(const std::string &file_path) const;
+
+  bool ReadFromDisk(const std::string &file_path);
+
+ private:
+  cv::Mat buffer_;
+  int rows_;
+  std::vector<int> image_offsets_;
+  std::vector<int> image_rows_;
+  std::vector<std::string> image_paths_;
+  // One per row, with word 0. Cleared as soon as an image is added without its key points
+  std::vector<GeometricFeature> features_;
+};
+
+#endif //REVERSE_IMAGE_SEARCH_DESCRIPTORARENA_H
@@ -0,0 +1,89 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_GEOMETRICINDEX_H
+#define REVERSE_IMAGE_SEARCH_GEOMETRICINDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+/**
+ * A key point reduced to what spatial verification needs: its position, scale and orientation, quantized, and the
+ * visual word its descriptor was assigned to. 8 bytes instead of the 64 float descriptor.
+ */
+struct GeometricFeature {
+  // Position in quarter pixels
+  uint16_t x;
+  uint16_t y;
+  uint16_t word;
+  // log2 of the key point size in sixteenths of an octave, and the orientation in 1/256ths of a turn
+  uint8_t log_scale;
+  uint8_t angle;
+};
+
+/**
+ * Tolerances of the spatial verification. A correspondence is an inlier of a hypothesis when its position lands within
+ * inlier_pixels of where the hypothesis predicts, and its scale change and rotation agree with the hypothesis'.
+ */
+struct GeometricVerificationParams {
+  float inlier_pixels = 16;
+  float scale_tolerance_octaves = 1;
+  float angle_tolerance_degrees = 30;
+  // Words occurring so often in both images that they would produce more pairs than this are skipped
+  int max_word_pairs = 4;
+  // Pairs beyond this are subsampled evenly. 0 keeps every pair
+  int max_correspondences = 256;
+  int max_hypotheses = 64;
+};
+
+/**
+ * A pair of features with the same visual word, one from each image
+ */
+struct Correspondence {
+  int query;
+  int candidate;
+};
+
+void QuantizeFeatures(const std::vector<cv::KeyPoint> &key_points, const std::vector<int> &labels,
+                      std::vector<GeometricFeature> &out_features);
+
+void QuantizeKeyPoints(const std::vector<cv::KeyPoint> &key_points, std::vector<GeometricFeature> &out_features);
+
+void AssignFeatureWords(const int *labels, std::vector<GeometricFeature> &features);
+
+int VerifyGeometry(const GeometricFeature *query, size_t query_count, const GeometricFeature *candidate,
+                   size_t candidate_count, const GeometricVerificationParams &params,
+                   std::vector<Correspondence> &scratch);
+
+/**
+ * The quantized features of every image in the data set, in one contiguous buffer in the same order as the rows of the
+ * image index. Lets the query path verify candidates geometrically without reading or extracting the database images.
+ */
+class GeometricIndex {
+ public:
+  void Reserve(size_t images, size_t features);
+
+  void Add(const std::vector<GeometricFeature> &features);
+
+  const GeometricFeature *ImageFeatures(size_t image, size_t &out_count) const;
+
+  size_t image_count() const {
+    return image_offsets_.empty() ? 0 : image_offsets_.size() - 1;
+  }
+
+  size_t feature_count() const {
+    return features_.size();
+  }
+
+  bool WriteToDisk(const std::string &file_path) const;
+
+  bool ReadFromDisk(const std::string &file_path);
+
+ private:
+  std::vector<GeometricFeature> features_;
+  // image i owns features_[image_offsets_[i], image_offsets_[i + 1])
+  std::vector<uint64_t> image_offsets_;
+};
+
+#endif //REVERSE_IMAGE_SEARCH_GEOMETRICINDEX_H
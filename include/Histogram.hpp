@@ -7,14 +7,26 @@
 #include <string>
 #include <vector>
 
+#include "DescriptorArena.hpp"
+#include "Keypoints.hpp"
+
 cv::Mat ReadClassHistogramsFromDisk(const std::string &dir_path, std::string &class_type);
 
 void WriteHistogramToDisk(std::string &file_path, cv::Mat &histogram);
 
-cv::Mat ComputeHistogram(std::string &file_path, cv::Mat &vocabulary);
+cv::Mat ComputeHistogram(std::string &file_path, cv::Mat &vocabulary,
+                         const KeypointPolicy &keypoint_policy=KeypointPolicy());
+
+cv::Mat ComputeHistogram(cv::Mat &image, cv::Mat &vocabulary, const KeypointPolicy &keypoint_policy=KeypointPolicy());
+
+void ComputeHistogram(std::string &file_path, cv::Mat &training_data, cv::Mat &vocabulary,
+                      const KeypointPolicy &keypoint_policy=KeypointPolicy());
+
+bool ComputeHistograms(const DescriptorArena &arena, cv::Mat &out_training_data, std::string &vocabulary_name,
+                       const std::string &geometry_path="", bool quantized_assignment=false);
 
-void ComputeHistogram(std::string &file_path, cv::Mat &training_data, cv::Mat &vocabulary);
+void WriteImageIndexToDisk(const std::string &file_path, const std::vector<std::string> &image_paths);
 
-void ComputeHistograms(std::vector<std::string> &images, cv::Mat &out_training_data, std::string &vocabulary_name);
+std::vector<std::string> ReadImageIndexFromDisk(const std::string &file_path);
 
 #endif //REVERSE_IMAGE_SEARCH_HISTOGRAM_H
@@ -0,0 +1,66 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_INDEXINGPIPELINE_H
+#define REVERSE_IMAGE_SEARCH_INDEXINGPIPELINE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "DescriptorArena.hpp"
+#include "Keypoints.hpp"
+
+/**
+ * Thread and memory settings for the indexing pipeline. A thread count of 0 picks a default based on the number of
+ * cores. queue_capacity bounds the number of items waiting between two stages, which caps the memory held by the
+ * pipeline at roughly (queue_capacity + threads) decoded images per stage. The writer also holds the results of images
+ * which finish ahead of an earlier, slower one, as it hands them over in order.
+ */
+struct IndexingPipelineConfig {
+  int read_threads = 0;
+  int decode_threads = 0;
+  int extract_threads = 0;
+  int encode_threads = 0;
+  size_t queue_capacity = 16;
+  size_t write_batch_size = 32;
+  // Replaces the Bag of Visual Words histogram with another encoding of an image's descriptors (i.e, VLAD). Must be
+  // safe to call from several threads at once, and return an empty matrix to drop the image
+  std::function<cv::Mat(const cv::Mat &descriptors)> encoder;
+  // Assign descriptors to words with the int8 vocabulary (see QuantizedVocabulary.cpp) instead of in floating point.
+  // Index and query histograms must be built with the same assignment
+  bool quantized_assignment = false;
+};
+
+/**
+ * How one stage of the pipeline spent its time. Utilization is the fraction of the stage's thread time spent doing
+ * work rather than waiting on its input (starved) or on a full output queue (blocked).
+ */
+struct IndexingStageStats {
+  std::string name;
+  int threads;
+  size_t items;
+  double busy_seconds;
+  double starved_seconds;
+  double blocked_seconds;
+  double utilization;
+};
+
+struct IndexingPipelineStats {
+  double wall_seconds;
+  size_t failed_images;
+  std::vector<IndexingStageStats> stages;
+  KeypointStats keypoints;
+};
+
+void ExtractDescriptorsPipelined(std::vector<std::string> &images, const KeypointPolicy &keypoint_policy,
+                                 const IndexingPipelineConfig &config, DescriptorArena &out_arena,
+                                 IndexingPipelineStats &out_stats);
+
+void ComputeHistogramsPipelined(std::vector<std::string> &images, cv::Mat &out_training_data,
+                                std::vector<std::string> &out_indexed_images, cv::Mat &vocabulary,
+                                const KeypointPolicy &keypoint_policy, const IndexingPipelineConfig &config,
+                                IndexingPipelineStats &out_stats);
+
+void PrintIndexingPipelineStats(const IndexingPipelineStats &stats);
+
+#endif //REVERSE_IMAGE_SEARCH_INDEXINGPIPELINE_H
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_KEYPOINTS_H
+#define REVERSE_IMAGE_SEARCH_KEYPOINTS_H
+
+#include <cstddef>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/xfeatures2d.hpp>
+
+/**
+ * Controls how many SURF key points are taken from an image. Detection starts at min_hessian. An image with fewer than
+ * min_keypoints key points is detected again at half the threshold, down to min_hessian_floor, and an image with more
+ * than max_keypoints keeps only the strongest responses. 0 disables either end of the range. Index and query images
+ * must be detected with the same policy.
+ */
+struct KeypointPolicy {
+  int min_hessian = 400;
+  int max_keypoints = 0;
+  int min_keypoints = 0;
+  int min_hessian_floor = 50;
+};
+
+/**
+ * What happened when the key points of one image were detected
+ */
+struct KeypointDetection {
+  // The number of key points found at the final threshold, and the number kept after the cap
+  int detected = 0;
+  int kept = 0;
+  double hessian_threshold = 0;
+  int passes = 0;
+};
+
+/**
+ * The distribution of key point counts over many images, and an estimate of the descriptor computation time the cap
+ * saved. Each thread should record into its own stats and Merge() them once it is done.
+ */
+struct KeypointStats {
+  std::vector<int> detected;
+  std::vector<int> kept;
+  size_t capped_images = 0;
+  size_t lowered_images = 0;
+  double compute_seconds = 0;
+
+  void Record(const KeypointDetection &detection, double descriptor_seconds);
+
+  void Merge(const KeypointStats &other);
+
+  double EstimatedSecondsSaved() const;
+};
+
+std::vector<cv::KeyPoint> DetectKeyPoints(const cv::Mat &image, const KeypointPolicy &policy,
+                                          cv::Ptr<cv::xfeatures2d::SURF> &surf,
+                                          KeypointDetection *out_detection=nullptr);
+
+void ExtractDescriptors(const cv::Mat &image, const KeypointPolicy &policy, cv::Ptr<cv::xfeatures2d::SURF> &surf,
+                        std::vector<cv::KeyPoint> &out_key_points, cv::Mat &out_descriptors,
+                        KeypointStats *stats=nullptr);
+
+void PrintKeypointStats(const KeypointStats &stats);
+
+#endif //REVERSE_IMAGE_SEARCH_KEYPOINTS_H
@@ -0,0 +1,68 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_QUANTIZEDVOCABULARY_H
+#define REVERSE_IMAGE_SEARCH_QUANTIZEDVOCABULARY_H
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/core.hpp>
+
+/**
+ * The int8 dot product kernel used for the assignment. kAuto picks the fastest one the CPU supports
+ */
+enum class Int8Kernel {
+  kAuto,
+  kScalar,
+  kAvx2,
+  kVnni
+};
+
+const char *Int8KernelName(Int8Kernel kernel);
+
+bool Int8KernelSupported(Int8Kernel kernel);
+
+/**
+ * The vocabulary stored as int8 codes with a scale per dimension, for assigning descriptors to words with integer dot
+ * products. A quarter of the size of the CV_32F vocabulary, so the whole of it stays in cache while it is scanned. The
+ * assignment approximates AssignToNearestCentroids(), see QuantizedVocabulary.cpp for how closely.
+ */
+class QuantizedVocabulary {
+ public:
+  QuantizedVocabulary() : words_(0), padded_words_(0), dims_(0), padded_dims_(0), kernel_(Int8Kernel::kScalar) {}
+
+  explicit QuantizedVocabulary(const cv::Mat &vocabulary, Int8Kernel kernel=Int8Kernel::kAuto);
+
+  void Assign(const cv::Mat &descriptors, std::vector<int> &out_labels, int block_rows=256) const;
+
+  bool empty() const {
+    return words_ == 0;
+  }
+
+  int words() const {
+    return words_;
+  }
+
+  Int8Kernel kernel() const {
+    return kernel_;
+  }
+
+ private:
+  // Assigns a range of descriptor blocks, see AssignToNearestCentroids()
+  class AssignBlocks;
+
+  int words_;
+  // Rounded up to a multiple of 32 words and 4 dimensions for the SIMD kernels. The padding is zero
+  int padded_words_;
+  int dims_;
+  int padded_dims_;
+  Int8Kernel kernel_;
+  // Word w, dimension d is approximately code(w, d) * scales_[d]. The codes are interleaved in groups of 8 words x 4
+  // dimensions, so one 32 byte load holds the same 4 dimensions of 8 words (see QuantizedVocabulary.cpp)
+  std::vector<float> scales_;
+  std::vector<int8_t> codes_;
+  // The sum of each word's codes, which the VNNI kernel needs to undo the offset of its unsigned operand
+  std::vector<int32_t> code_sums_;
+  // ||c||^2 of each dequantized word. The padding words have the largest float norm so are never nearest
+  std::vector<float> norms_;
+};
+
+#endif //REVERSE_IMAGE_SEARCH_QUANTIZEDVOCABULARY_H
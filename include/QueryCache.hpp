@@ -0,0 +1,67 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_QUERYCACHE_H
+#define REVERSE_IMAGE_SEARCH_QUERYCACHE_H
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <opencv2/core.hpp>
+
+/**
+ * Hit-rate counters of a QueryCache
+ */
+struct QueryCacheStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+  uint64_t invalidations = 0;
+
+  double HitRate() const {
+    return hits + misses == 0 ? 0 : (double) hits / (hits + misses);
+  }
+};
+
+uint64_t ComputeDHash(const cv::Mat &image);
+
+/**
+ * A bounded, least recently used cache of query results keyed by the perceptual hash of the decoded query image, so
+ * re-uploads and resized copies of an image are answered without extracting or encoding it again. Every entry belongs
+ * to an index generation (a fingerprint of the vocabulary, classifier or index the result came from), and the cache is
+ * emptied whenever the generation changes. Safe to share between threads.
+ */
+class QueryCache {
+ public:
+  explicit QueryCache(size_t capacity=1024, const std::string &generation="");
+
+  bool Lookup(uint64_t key, std::string &out_match);
+
+  void Insert(uint64_t key, const std::string &match);
+
+  void SetGeneration(const std::string &generation);
+
+  QueryCacheStats stats() const;
+
+  size_t size() const;
+
+  bool WriteToDisk(const std::string &file_path) const;
+
+  bool ReadFromDisk(const std::string &file_path);
+
+ private:
+  typedef std::list<std::pair<uint64_t, std::string> > EntryList;
+
+  void InsertLocked(uint64_t key, const std::string &match);
+
+  size_t capacity_;
+  std::string generation_;
+  // Most recently used first
+  EntryList entries_;
+  std::unordered_map<uint64_t, EntryList::iterator> index_;
+  QueryCacheStats stats_;
+  mutable std::mutex mutex_;
+};
+
+#endif //REVERSE_IMAGE_SEARCH_QUERYCACHE_H
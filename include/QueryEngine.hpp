@@ -0,0 +1,172 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_QUERYENGINE_H
+#define REVERSE_IMAGE_SEARCH_QUERYENGINE_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+#include <opencv2/xfeatures2d.hpp>
+
+#include "GeometricIndex.hpp"
+#include "Keypoints.hpp"
+#include "QuantizedVocabulary.hpp"
+
+/**
+ * Where a QueryEngine loads its models from. The defaults are the artifacts the train stage writes in the working
+ * directory.
+ */
+struct QueryEngineConfig {
+  std::string vocabulary_path = "vocabulary.yml";
+  std::string predictor_path = "predictor.yml";
+  std::string training_data_path = "data/classifier/svm_training.yml";
+  std::string image_index_path = "data/classifier/image_index.yml";
+  // The SVM's class labels are positions in the listing of this directory, see TrainSVM()
+  std::string histograms_dir = "data/histograms/";
+  // Must match the policy and the word assignment the data set was encoded with
+  KeypointPolicy keypoint_policy;
+  bool quantized_assignment = false;
+
+  // Multi-class probing. The classes are searched in decreasing SVM confidence, stopping after probe_classes classes or
+  // once probe_time_ms or probe_rows is spent. The first class is always searched. With probe_safe_score set, a class
+  // is skipped once the margin is safe: when no image in it can score more than probe_safe_score above the best match
+  // so far (see QueryEngine::ClassScoreBound()). 0 disables a budget. The default searches only the predicted class
+  int probe_classes = 1;
+  double probe_time_ms = 0;
+  int probe_rows = 0;
+  double probe_safe_score = 0;
+
+  // Geometric re-ranking. With rerank_top_n > 0 the best scoring images are verified against their key points in the
+  // geometric index (see GeometricIndex.cpp), in score order until rerank_time_ms is spent (0 disables the time cap).
+  // The candidate with the most inliers, if it has at least rerank_min_inliers, becomes the match
+  std::string geometry_path = "data/classifier/geometry.bin";
+  int rerank_top_n = 0;
+  double rerank_time_ms = 5;
+  int rerank_min_inliers = 6;
+  GeometricVerificationParams verification;
+};
+
+/**
+ * The answer to a single query. match is empty if the image could not be encoded
+ */
+struct QueryResult {
+  std::string match;
+  int predicted_class = -1;
+  float score = 0;
+  // The class the match was found in, and how much of the database was searched
+  int matched_class = -1;
+  int classes_probed = 0;
+  int classes_skipped = 0;
+  int rows_scored = 0;
+  // How the query's key points were found, and the time taken to compute their descriptors
+  KeypointDetection keypoints;
+  double descriptor_seconds = 0;
+  // The inliers of the match if it was chosen by geometric re-ranking, and how many candidates were verified
+  int inliers = 0;
+  int candidates_verified = 0;
+  bool rerank_timed_out = false;
+};
+
+/**
+ * A database image scored against a query, kept for geometric re-ranking
+ */
+struct QueryCandidate {
+  int row;
+  int class_label;
+  float score;
+  int inliers;
+};
+
+/**
+ * Working memory for a query. Holding one per thread lets a thread answer query after query without allocating, and
+ * keeps everything a query writes to out of the shared QueryEngine.
+ */
+struct QueryScratch {
+  cv::Ptr<cv::xfeatures2d::SURF> surf;
+  std::vector<cv::KeyPoint> key_points;
+  cv::Mat descriptors;
+  std::vector<int> labels;
+  cv::Mat histogram;
+  cv::Mat normalized_histogram;
+  cv::Mat scores;
+  cv::Mat kernel_values;
+  std::vector<int> votes;
+  std::vector<double> confidence;
+  std::vector<int> class_order;
+  std::vector<QueryCandidate> candidates;
+  std::vector<GeometricFeature> features;
+  std::vector<Correspondence> correspondences;
+};
+
+/**
+ * Answers queries against a trained Bag of Visual Words index. Loads the vocabulary, SVM and database histograms once
+ * and never modifies them afterwards, so a single engine can be queried from any number of threads at once. Writes
+ * nothing to stdout.
+ */
+class QueryEngine {
+ public:
+  static cv::Ptr<QueryEngine> Create(const QueryEngineConfig &config, std::string *out_error=nullptr);
+
+  void Query(const cv::Mat &image, QueryScratch &scratch, QueryResult &out_result) const;
+
+  QueryResult Query(const cv::Mat &image) const;
+
+  QueryResult QueryFile(const std::string &image_path) const;
+
+  void RankClasses(const cv::Mat &histogram, QueryScratch &scratch) const;
+
+  const QueryEngineConfig &config() const {
+    return config_;
+  }
+
+  size_t image_count() const {
+    return images_.size();
+  }
+
+ private:
+  QueryEngine() {}
+
+  /**
+   * One of the one-vs-one decision functions of the SVM, separating first_class (positive) from second_class
+   */
+  struct DecisionFunction {
+    int first_class;
+    int second_class;
+    double rho;
+    cv::Mat alpha;
+    cv::Mat support_vector_index;
+  };
+
+  bool Load(const QueryEngineConfig &config, std::string &out_error);
+
+  bool LoadDecisionFunctions();
+
+  float ClassScoreBound(int label, const cv::Mat &normalized_histogram) const;
+
+  void Rerank(QueryScratch &scratch, QueryResult &out_result) const;
+
+  QueryEngineConfig config_;
+  cv::Mat vocabulary_;
+  cv::Mat centroid_norms_;
+  // Only built with quantized_assignment
+  QuantizedVocabulary quantized_vocabulary_;
+  cv::Ptr<cv::ml::SVM> svm_;
+  // Used to rank every class for multi-class probing. Empty if the kernel is not supported, in which case only the
+  // predicted class is probed
+  cv::Mat support_vectors_;
+  cv::Mat support_vector_norms_;
+  std::vector<DecisionFunction> decision_functions_;
+  // The SVM label of each class, in the order the decision functions number them
+  std::vector<int> class_labels_;
+  // The histograms of each class, normalized with NormalizeForCorrelation(), and the row of images_ each came from
+  std::vector<cv::Mat> class_histograms_;
+  std::vector<std::vector<int> > class_rows_;
+  // The mean of each class's normalized histograms, one per row, and the largest distance of one of them to the mean
+  cv::Mat class_centroids_;
+  std::vector<float> class_radii_;
+  std::vector<std::string> images_;
+  // Only loaded when re-ranking. Holds one entry per row of images_
+  GeometricIndex geometry_;
+};
+
+#endif //REVERSE_IMAGE_SEARCH_QUERYENGINE_H
@@ -9,6 +9,9 @@ cv::Mat ReadSVMTrainingDataFromDisk(std::string &file_path);
 
 void WriteSVMTrainingDataToDisk(std::string &file_path, cv::Mat &training_data);
 
+void ReadSVMTrainingSet(const std::string &class_file_path, int response_cols, int response_type, cv::Mat &out_samples,
+                        cv::Mat &out_labels);
+
 void TrainSVM(const std::string &class_file_path, int response_cols, int response_type, cv::Ptr<cv::ml::SVM> &svm);
 
 std::string TestSVM(cv::Mat &test_img, cv::Ptr<cv::ml::SVM> &svm);
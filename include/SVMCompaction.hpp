@@ -0,0 +1,45 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_SVMCOMPACTION_H
+#define REVERSE_IMAGE_SEARCH_SVMCOMPACTION_H
+
+#include <string>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+
+/**
+ * How far a trained SVM is compacted. The number of support vectors grows from two per class until the reduced model
+ * loses at most max_accuracy_loss of the original's accuracy, or until it reaches max_support_vectors
+ */
+struct SVMCompactionParams {
+  // 0 allows up to as many support vectors as the original model has
+  int max_support_vectors = 0;
+  // A fraction, i.e, 0.01 allows one percentage point of accuracy to be lost
+  double max_accuracy_loss = 0.01;
+  // The training rows the accuracy is measured on, and the rows predict() is timed on one at a time
+  int validation_rows = 2000;
+  int latency_rows = 200;
+};
+
+/**
+ * The original and reduced models compared on the validation rows
+ */
+struct SVMCompactionReport {
+  int original_support_vectors = 0;
+  int reduced_support_vectors = 0;
+  int validation_rows = 0;
+  double original_accuracy = 0;
+  double reduced_accuracy = 0;
+  // How often the reduced model predicts the same class as the original
+  double agreement = 0;
+  // The mean time of a single predict() call
+  double original_predict_ms = 0;
+  double reduced_predict_ms = 0;
+  // The model could not be reduced, and was written unchanged
+  bool copied = false;
+};
+
+bool CompactSVM(const std::string &predictor_path, const cv::Mat &samples, const cv::Mat &labels,
+                const SVMCompactionParams &params, const std::string &out_path, SVMCompactionReport &out_report,
+                std::string *out_error=nullptr);
+
+#endif //REVERSE_IMAGE_SEARCH_SVMCOMPACTION_H
@@ -0,0 +1,72 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_STAGES_H
+#define REVERSE_IMAGE_SEARCH_STAGES_H
+
+#include <string>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+
+#include "Artifact.hpp"
+
+/**
+ * The parameters shared by every stage of the pipeline. Anything that changes the contents of an artifact belongs in
+ * here so that it is recorded in the artifact's manifest.
+ */
+struct PipelineParams {
+  std::string db_dir = "data/images/";
+  int min_hessian = 400;
+  // The range of SURF key points per image, see KeypointPolicy. 0 leaves that end of the range open
+  int min_keypoints = 0;
+  int max_keypoints = 0;
+  int dictionary_size = 2500;
+  double svm_gamma = 0.50625;
+  double svm_c = 34389;
+  // Compacts the SVM into a reduced set model of at most svm_vectors support vectors, stopping sooner once it loses at
+  // most svm_max_loss of the training accuracy (see SVMCompaction.cpp). 0 queries with the full SVM
+  int svm_vectors = 0;
+  double svm_max_loss = 0.01;
+  // "bow" for the Bag of Visual Words histogram and SVM, or "vlad" for the compact VLAD vectors (see Vlad.cpp)
+  std::string encoding = "bow";
+  int vlad_words = 64;
+  int vlad_dims = 128;
+  // "float" or "int8" for assigning descriptors to words with the quantized vocabulary (see QuantizedVocabulary.cpp)
+  std::string assignment = "float";
+  // Store each image's quantized key points and words alongside the histograms, for geometric re-ranking
+  bool store_geometry = false;
+  // Rebuild the requested stage even if its artifact is up to date
+  bool force = false;
+
+  // Query options. These do not change any artifact so are not recorded in manifests
+  int top_k = 10;
+  // The number of query results kept by the serve command's cache (see QueryCache.cpp). 0 disables the cache
+  size_t cache_size = 1024;
+  // If set, the query cache is loaded from and saved to this file so it survives between runs
+  std::string cache_path;
+  // Multi-class probing of the Bag of Visual Words query path, see QueryEngineConfig
+  int probe_classes = 1;
+  double probe_time_ms = 0;
+  int probe_rows = 0;
+  double probe_safe_score = 0;
+  // Geometric re-ranking of the top candidates, see QueryEngineConfig. Requires store_geometry
+  int rerank_top_n = 0;
+  double rerank_time_ms = 5;
+  int rerank_min_inliers = 6;
+};
+
+bool RunExtractStage(const PipelineParams &params);
+
+bool RunBuildVocabularyStage(const PipelineParams &params);
+
+bool RunEncodeStage(const PipelineParams &params);
+
+bool RunTrainStage(const PipelineParams &params, cv::Ptr<cv::ml::SVM> &out_svm);
+
+bool RunCompactStage(const PipelineParams &params);
+
+bool RunQuery(std::string &query_path, const PipelineParams &params, std::string &out_match);
+
+bool RunServe(const PipelineParams &params);
+
+bool RunBatchQuery(const std::string &query_list_path, const PipelineParams &params);
+
+#endif //REVERSE_IMAGE_SEARCH_STAGES_H
@@ -7,11 +7,15 @@
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 
-std::vector<cv::KeyPoint> get_key_points(cv::Mat &input_image);
+std::vector<cv::KeyPoint> get_key_points(cv::Mat &input_image, int min_hessian=400);
 
-cv::Mat get_single_feature_vector(cv::Mat &image, std::vector<cv::KeyPoint> &key_points);
+cv::Mat get_single_feature_vector(cv::Mat &image, std::vector<cv::KeyPoint> &key_points, int min_hessian=400);
 
-std::vector<cv::Mat> get_multiple_feature_vectors(std::vector<std::string> &file_names);
+std::vector<cv::Mat> get_multiple_feature_vectors(std::vector<std::string> &file_names, int min_hessian=400);
 
 cv::Mat ConcatenateDescriptors(std::vector<cv::Mat> &descriptors);
+
+void WriteDescriptorsToDisk(const cv::Mat &descriptors, const std::string &file_path);
+
+cv::Mat ReadDescriptorsFromDisk(const std::string &file_path);
 #endif //REVERSE_IMAGE_SEARCH_SURF_H
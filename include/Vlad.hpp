@@ -0,0 +1,35 @@
+#pragma once
+#ifndef REVERSE_IMAGE_SEARCH_VLAD_H
+#define REVERSE_IMAGE_SEARCH_VLAD_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "DescriptorArena.hpp"
+
+/**
+ * A data set encoded as compact VLAD vectors. Holds the small vocabulary the residuals are computed against, the PCA
+ * projection fitted on a sample of the data set, and one projected, L2 normalized vector per image.
+ */
+struct VladIndex {
+  cv::Mat vocabulary;
+  cv::Mat centroid_norms;
+  cv::PCA pca;
+  cv::Mat vectors;
+  std::vector<std::string> images;
+};
+
+cv::Mat ComputeVlad(const cv::Mat &descriptors, const cv::Mat &vocabulary, const cv::Mat &centroid_norms);
+
+cv::Mat ProjectVlad(const cv::Mat &vlad, const cv::PCA &pca);
+
+cv::Mat EncodeVlad(const cv::Mat &descriptors, const VladIndex &index);
+
+void BuildVladIndex(const DescriptorArena &arena, int words, int dims, VladIndex &out_index);
+
+void WriteVladIndexToDisk(const std::string &file_path, const VladIndex &index);
+
+bool ReadVladIndexFromDisk(const std::string &file_path, VladIndex &out_index);
+
+#endif //REVERSE_IMAGE_SEARCH_VLAD_H
@@ -10,6 +10,7 @@ bool VocabularyExists(const std::string &file_name);
 
 cv::Mat ReadVocabularyFromDisk(const std::string &file_name);
 
-cv::Mat ConstructVocabulary(cv::Mat &training_descriptors, const std::string &file_name, bool write_to_disk=true);
+cv::Mat ConstructVocabulary(cv::Mat &training_descriptors, const std::string &file_name, bool write_to_disk=true,
+                            int dictionary_size=2500);
 
 #endif //REVERSE_IMAGE_SEARCH_VOCABULARYBUILDER_H
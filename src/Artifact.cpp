@@ -0,0 +1,192 @@
+/**
+ * Artifact.cpp
+ *
+ * Provides the freshness tracking used by the pipeline stages. Each artifact written to disk gets a sidecar manifest
+ * (<artifact>.manifest.yml) recording hashes of the inputs and the parameters it was built with. A stage compares the
+ * manifest it would write against the one on disk to decide whether its output can be reused or must be rebuilt.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <boost/filesystem.hpp>
+
+#include "Artifact.hpp"
+
+using namespace std;
+using namespace boost::filesystem;
+
+namespace {
+const uint64_t kFnvOffsetBasis = 14695981039346656037ULL;
+const uint64_t kFnvPrime = 1099511628211ULL;
+
+/**
+ * Folds a block of bytes into a running 64-bit FNV-1a hash
+ * @param data const char* the bytes to hash
+ * @param size size_t the number of bytes in data
+ * @param hash uint64_t the running hash value
+ * @return uint64_t the updated hash value
+ */
+uint64_t FnvUpdate(const char *data, size_t size, uint64_t hash) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+string ToHex(uint64_t hash) {
+  ostringstream out;
+  out << hex;
+  out.width(16);
+  out.fill('0');
+  out << hash;
+  return out.str();
+}
+
+void WriteSection(cv::FileStorage &fs, const string &name, const map<string, string> &values) {
+  fs << name << "{";
+  for (map<string, string>::const_iterator itr = values.begin(); itr != values.end(); ++itr) {
+    fs << itr->first << itr->second;
+  }
+  fs << "}";
+}
+
+void ReadSection(const cv::FileNode &node, map<string, string> &out_values) {
+  for (cv::FileNodeConstIterator itr = node.begin(); itr != node.end(); ++itr) {
+    out_values[(*itr).name()] = (string) *itr;
+  }
+}
+}
+
+/**
+ * Hashes a string value, typically a parameter or a list of file names
+ * @param value std::string the value to hash
+ * @return std::string the hex encoded 64-bit hash
+ */
+string HashString(const string &value) {
+  return ToHex(FnvUpdate(value.data(), value.size(), kFnvOffsetBasis));
+}
+
+/**
+ * Hashes the full contents of a file. Used for artifacts that are small enough to read on every run such as the
+ * vocabulary or the SVM training data.
+ * @param file_path std::string the relative path to the file to hash
+ * @return std::string the hex encoded 64-bit hash, or an empty string if the file does not exist
+ */
+string HashFile(const string &file_path) {
+  std::ifstream file(file_path.c_str(), ios::binary);
+  if (!file) {
+    return "";
+  }
+
+  vector<char> buffer(1 << 16);
+  uint64_t hash = kFnvOffsetBasis;
+  while (file) {
+    file.read(buffer.data(), buffer.size());
+    hash = FnvUpdate(buffer.data(), static_cast<size_t>(file.gcount()), hash);
+  }
+  return ToHex(hash);
+}
+
+/**
+ * Fingerprints a directory tree such as data/images/. Reading every image would take longer than some of the stages
+ * themselves, so each file contributes its relative path, size and modification time instead of its contents.
+ * @param dir_path std::string the relative path to the directory to hash
+ * @return std::string the hex encoded 64-bit hash, or an empty string if the directory does not exist
+ */
+string HashDirectory(const string &dir_path) {
+  path root(dir_path);
+  if (!exists(root) || !is_directory(root)) {
+    return "";
+  }
+
+  // Sort the entries so the fingerprint does not depend on the order the file system returns them in
+  vector<string> entries;
+  recursive_directory_iterator end;
+  for (recursive_directory_iterator itr(root); itr != end; ++itr) {
+    if (is_directory(itr->path())) {
+      continue;
+    }
+    ostringstream entry;
+    entry << itr->path().string() << '|' << file_size(itr->path()) << '|' << last_write_time(itr->path());
+    entries.push_back(entry.str());
+  }
+  sort(entries.begin(), entries.end());
+
+  uint64_t hash = kFnvOffsetBasis;
+  for (string &entry : entries) {
+    hash = FnvUpdate(entry.data(), entry.size() + 1, hash);
+  }
+  return ToHex(hash);
+}
+
+/**
+ * Gets the path of the manifest file belonging to an artifact (i.e, vocabulary.yml => vocabulary.yml.manifest.yml)
+ * @param artifact_path std::string the relative path to the artifact
+ * @return std::string the relative path to the artifact's manifest
+ */
+string ManifestPath(const string &artifact_path) {
+  string manifest_path = artifact_path;
+  // Directory artifacts such as data/histograms/ keep their manifest next to the directory rather than inside of it
+  while (!manifest_path.empty() && (manifest_path.back() == '/' || manifest_path.back() == '\\')) {
+    manifest_path.pop_back();
+  }
+  return manifest_path + ".manifest.yml";
+}
+
+/**
+ * Writes the manifest for an artifact. Should only be called once the artifact itself has been completely written so
+ * an interrupted stage is never considered fresh.
+ * @param artifact_path std::string the relative path to the artifact the manifest describes
+ * @param manifest ArtifactManifest the inputs and parameters the artifact was built from
+ */
+void WriteArtifactManifest(const string &artifact_path, const ArtifactManifest &manifest) {
+  cv::FileStorage fs(ManifestPath(artifact_path), cv::FileStorage::WRITE);
+  WriteSection(fs, "inputs", manifest.inputs);
+  WriteSection(fs, "params", manifest.params);
+  fs.release();
+}
+
+/**
+ * Reads the manifest of an artifact from disk
+ * @param artifact_path std::string the relative path to the artifact the manifest describes
+ * @param out_manifest ArtifactManifest the manifest read from disk
+ * @return bool true|false on whether or not a manifest was found
+ */
+bool ReadArtifactManifest(const string &artifact_path, ArtifactManifest &out_manifest) {
+  string manifest_path = ManifestPath(artifact_path);
+  if (!exists(manifest_path)) {
+    return false;
+  }
+
+  cv::FileStorage fs(manifest_path, cv::FileStorage::READ);
+  if (!fs.isOpened()) {
+    return false;
+  }
+  ReadSection(fs["inputs"], out_manifest.inputs);
+  ReadSection(fs["params"], out_manifest.params);
+  fs.release();
+  return true;
+}
+
+/**
+ * Determines whether an artifact can be reused. It must exist on disk, and the manifest stored alongside it must match
+ * the inputs and parameters the caller would build it from now.
+ * @param artifact_path std::string the relative path to the artifact
+ * @param expected ArtifactManifest the manifest the artifact would be built with if it were rebuilt now
+ * @return bool true|false on whether or not the artifact is up to date
+ */
+bool ArtifactIsFresh(const string &artifact_path, const ArtifactManifest &expected) {
+  if (!exists(artifact_path)) {
+    return false;
+  }
+
+  ArtifactManifest stored;
+  if (!ReadArtifactManifest(artifact_path, stored)) {
+    return false;
+  }
+  return stored == expected;
+}
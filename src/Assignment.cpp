@@ -0,0 +1,285 @@
+/**
+ * Assignment.cpp
+ *
+ * Maps descriptors to their nearest vocabulary word. Instead of comparing every descriptor against every word one pair
+ * at a time (as cv::BFMatcher does inside cv::BOWImgDescriptorExtractor), the squared distance is expanded as
+ *
+ *   ||x - c||^2 = ||x||^2 - 2 x.c + ||c||^2
+ *
+ * ||x||^2 is the same for every word so it does not change which word is nearest, and ||c||^2 is computed once per
+ * vocabulary. That leaves x.c, which for a block of descriptors against the whole vocabulary is a single matrix product
+ * handed to cv::gemm. The argmin is taken directly over each row of the product while it is still in cache.
+ *
+ * The same kernel is used to encode images into Bag of Visual Words histograms, and for the assignment step of the
+ * k-means clustering that builds the vocabulary.
+ */
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "Assignment.hpp"
+
+using namespace std;
+
+namespace {
+/**
+ * Assigns one range of descriptor blocks. Each block of block_rows descriptors is multiplied against the whole
+ * vocabulary with one cv::gemm call.
+ */
+class AssignBlocks : public cv::ParallelLoopBody {
+ public:
+  AssignBlocks(const cv::Mat &descriptors, const cv::Mat &centroids, const cv::Mat &centroid_norms, int block_rows,
+               int *out_labels, float *out_distances)
+      : descriptors_(descriptors), centroids_(centroids), centroid_norms_(centroid_norms), block_rows_(block_rows),
+        out_labels_(out_labels), out_distances_(out_distances) {}
+
+  void operator()(const cv::Range &blocks) const {
+    cv::Mat dots;
+    const float *norms = centroid_norms_.ptr<float>(0);
+    for (int block = blocks.start; block < blocks.end; block++) {
+      int start = block * block_rows_;
+      int end = min(start + block_rows_, descriptors_.rows);
+      cv::Mat block_descriptors = descriptors_.rowRange(start, end);
+
+      // dots(i, j) = x_i . c_j for every descriptor in the block against every word
+      cv::gemm(block_descriptors, centroids_, 1.0, cv::noArray(), 0.0, dots, cv::GEMM_2_T);
+
+      for (int i = 0; i < dots.rows; i++) {
+        const float *row = dots.ptr<float>(i);
+        int best = 0;
+        float best_distance = numeric_limits<float>::max();
+        for (int j = 0; j < dots.cols; j++) {
+          float distance = norms[j] - 2 * row[j];
+          if (distance < best_distance) {
+            best_distance = distance;
+            best = j;
+          }
+        }
+
+        out_labels_[start + i] = best;
+        if (out_distances_ != nullptr) {
+          const float *x = block_descriptors.ptr<float>(i);
+          float x_norm = 0;
+          for (int d = 0; d < block_descriptors.cols; d++) {
+            x_norm += x[d] * x[d];
+          }
+          // Rounding can push the expanded form slightly below zero for a descriptor sitting on a word
+          out_distances_[start + i] = max(0.0f, best_distance + x_norm);
+        }
+      }
+    }
+  }
+
+ private:
+  const cv::Mat &descriptors_;
+  const cv::Mat &centroids_;
+  const cv::Mat &centroid_norms_;
+  int block_rows_;
+  int *out_labels_;
+  float *out_distances_;
+};
+}
+
+/**
+ * Computes the squared L2 norm of every centroid. Should be computed once per vocabulary and reused for every call to
+ * AssignToNearestCentroids()
+ * @param centroids cv::Mat the CV_32F vocabulary, one word per row
+ * @return cv::Mat a 1xK CV_32F matrix holding ||c||^2 for each word
+ */
+cv::Mat ComputeCentroidNorms(const cv::Mat &centroids) {
+  assert(centroids.type() == CV_32F);
+  cv::Mat norms(1, centroids.rows, CV_32F);
+  for (int i = 0; i < centroids.rows; i++) {
+    norms.at<float>(0, i) = (float) centroids.row(i).dot(centroids.row(i));
+  }
+  return norms;
+}
+
+/**
+ * Finds the nearest centroid (in squared L2 distance) of every descriptor. Gives the same assignment as a brute force
+ * search, up to floating point ties.
+ * @param descriptors cv::Mat the CV_32F descriptors to assign, one per row
+ * @param centroids cv::Mat the CV_32F vocabulary, one word per row
+ * @param centroid_norms cv::Mat the output of ComputeCentroidNorms() for centroids
+ * @param out_labels vector<int> the index of the nearest centroid of each descriptor
+ * @param out_distances vector<float> if not null, the squared distance of each descriptor to its nearest centroid
+ * @param block_rows int the number of descriptors multiplied against the vocabulary at once. Default is 256
+ */
+void AssignToNearestCentroids(const cv::Mat &descriptors, const cv::Mat &centroids, const cv::Mat &centroid_norms,
+                              vector<int> &out_labels, vector<float> *out_distances, int block_rows) {
+  assert(descriptors.type() == CV_32F && centroids.type() == CV_32F);
+  assert(descriptors.cols == centroids.cols);
+  assert(centroid_norms.cols == centroids.rows);
+
+  out_labels.resize(descriptors.rows);
+  if (out_distances != nullptr) {
+    out_distances->resize(descriptors.rows);
+  }
+  if (descriptors.rows == 0) {
+    return;
+  }
+
+  int blocks = (descriptors.rows + block_rows - 1) / block_rows;
+  AssignBlocks body(descriptors, centroids, centroid_norms, block_rows, out_labels.data(),
+                    out_distances == nullptr ? nullptr : out_distances->data());
+  // A typical image fits in a single block, which is not worth handing off to other threads
+  if (blocks == 1) {
+    body(cv::Range(0, 1));
+  } else {
+    cv::parallel_for_(cv::Range(0, blocks), body);
+  }
+}
+
+/**
+ * Computes the Bag of Visual Words histogram of an image from its descriptors. Normalized by the number of
+ * descriptors, as cv::BOWImgDescriptorExtractor does.
+ * @param descriptors cv::Mat the CV_32F SURF descriptors of the image
+ * @param vocabulary cv::Mat the CV_32F Bag of Visual Words dictionary
+ * @param centroid_norms cv::Mat the output of ComputeCentroidNorms() for vocabulary
+ * @return cv::Mat the 1xK normalized histogram, or an empty matrix if the image has no descriptors
+ */
+cv::Mat ComputeBowHistogram(const cv::Mat &descriptors, const cv::Mat &vocabulary, const cv::Mat &centroid_norms) {
+  if (descriptors.rows == 0) {
+    return cv::Mat();
+  }
+
+  vector<int> labels;
+  AssignToNearestCentroids(descriptors, vocabulary, centroid_norms, labels);
+  return ComputeBowHistogram(labels, vocabulary.rows);
+}
+
+/**
+ * Computes the Bag of Visual Words histogram of an image from the words its descriptors were already assigned to
+ * @param labels vector<int> the word of each descriptor, see AssignToNearestCentroids()
+ * @param word_count int the number of words in the vocabulary
+ * @return cv::Mat the 1xK normalized histogram, or an empty matrix if there are no labels
+ */
+cv::Mat ComputeBowHistogram(const vector<int> &labels, int word_count) {
+  if (labels.empty()) {
+    return cv::Mat();
+  }
+
+  cv::Mat histogram = cv::Mat::zeros(1, word_count, CV_32F);
+  float *bins = histogram.ptr<float>(0);
+  for (int label : labels) {
+    bins[label] += 1;
+  }
+  histogram /= (double) labels.size();
+  return histogram;
+}
+
+/**
+ * Picks the initial cluster centers with k-means++: the first uniformly at random, and each further one with
+ * probability proportional to its squared distance from the nearest center picked so far. The distances are kept up to
+ * date by running AssignToNearestCentroids() against each new center alone, so seeding costs about as much as one
+ * assignment step.
+ * @param descriptors cv::Mat the CV_32F descriptors to cluster, one per row
+ * @param cluster_count int the number of centers to pick
+ * @param rng cv::RNG the random number generator to sample with
+ * @return cv::Mat the CV_32F centers, one per row
+ */
+cv::Mat SeedCenters(const cv::Mat &descriptors, int cluster_count, cv::RNG &rng) {
+  cv::Mat centers(cluster_count, descriptors.cols, CV_32F);
+  descriptors.row(rng.uniform(0, descriptors.rows)).copyTo(centers.row(0));
+
+  vector<int> labels;
+  vector<float> nearest;
+  vector<float> distances;
+  cv::Mat first = centers.row(0);
+  AssignToNearestCentroids(descriptors, first, ComputeCentroidNorms(first), labels, &nearest);
+  for (int k = 1; k < cluster_count; k++) {
+    double total = 0;
+    for (float distance : nearest) {
+      total += distance;
+    }
+
+    // Only duplicates of the picked centers are left, so any of them will do
+    int picked = rng.uniform(0, descriptors.rows);
+    if (total > 0) {
+      double target = rng.uniform(0.0, total);
+      double sum = 0;
+      for (int i = 0; i < descriptors.rows; i++) {
+        sum += nearest[i];
+        if (sum > target) {
+          picked = i;
+          break;
+        }
+      }
+    }
+
+    cv::Mat center = centers.row(k);
+    descriptors.row(picked).copyTo(center);
+    AssignToNearestCentroids(descriptors, center, ComputeCentroidNorms(center), labels, &distances);
+    for (int i = 0; i < descriptors.rows; i++) {
+      nearest[i] = min(nearest[i], distances[i]);
+    }
+  }
+  return centers;
+}
+
+/**
+ * Clusters descriptors with k-means, using AssignToNearestCentroids() for the assignment step. The centers are seeded
+ * with k-means++ (see SeedCenters()) and then refined until term_criteria is met.
+ * @param descriptors cv::Mat the CV_32F descriptors to cluster, one per row
+ * @param cluster_count int the number of clusters, i.e, the size of the vocabulary
+ * @param term_criteria cv::TermCriteria the maximum number of iterations and/or the center movement to stop at
+ * @return cv::Mat the CV_32F cluster centers, one per row
+ */
+cv::Mat ClusterDescriptors(const cv::Mat &descriptors, int cluster_count, const cv::TermCriteria &term_criteria) {
+  assert(descriptors.type() == CV_32F);
+  assert(descriptors.rows >= cluster_count);
+
+  cv::Mat centers = SeedCenters(descriptors, cluster_count, cv::theRNG());
+
+  int max_iterations = (term_criteria.type & cv::TermCriteria::COUNT) ? term_criteria.maxCount : 100;
+  double epsilon = (term_criteria.type & cv::TermCriteria::EPS) ? term_criteria.epsilon : 0;
+
+  vector<int> labels;
+  vector<float> distances;
+  cv::Mat sums(cluster_count, descriptors.cols, CV_64F);
+  vector<int> counts(cluster_count);
+  for (int iteration = 0; iteration < max_iterations; iteration++) {
+    AssignToNearestCentroids(descriptors, centers, ComputeCentroidNorms(centers), labels, &distances);
+
+    sums.setTo(0);
+    fill(counts.begin(), counts.end(), 0);
+    for (int i = 0; i < descriptors.rows; i++) {
+      const float *x = descriptors.ptr<float>(i);
+      double *sum = sums.ptr<double>(labels[i]);
+      for (int d = 0; d < descriptors.cols; d++) {
+        sum[d] += x[d];
+      }
+      counts[labels[i]]++;
+    }
+
+    double max_shift = 0;
+    for (int k = 0; k < cluster_count; k++) {
+      float *center = centers.ptr<float>(k);
+      if (counts[k] == 0) {
+        // Re-seed an empty cluster with the descriptor furthest from its center, as cv::kmeans does
+        int furthest = (int) (max_element(distances.begin(), distances.end()) - distances.begin());
+        descriptors.row(furthest).copyTo(centers.row(k));
+        distances[furthest] = 0;
+        max_shift = numeric_limits<double>::max();
+        continue;
+      }
+
+      const double *sum = sums.ptr<double>(k);
+      double shift = 0;
+      for (int d = 0; d < descriptors.cols; d++) {
+        float updated = (float) (sum[d] / counts[k]);
+        shift += (updated - center[d]) * (updated - center[d]);
+        center[d] = updated;
+      }
+      max_shift = max(max_shift, shift);
+    }
+
+    if (max_shift <= epsilon * epsilon) {
+      break;
+    }
+  }
+
+  return centers;
+}
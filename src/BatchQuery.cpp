@@ -0,0 +1,141 @@
+/**
+ * BatchQuery.cpp
+ *
+ * Scores many query histograms against every histogram in the database at once. Rather than calling
+ * cv::compareHist() for every (query, database) pair, both sides are normalized so that a dot product equals the
+ * CV_COMP_CORREL score, and the scores for a block of queries against a block of database rows are computed as a single
+ * matrix-matrix product. Blocks of queries are scored in parallel, and each block keeps only the top-K matches per query.
+ */
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <queue>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "BatchQuery.hpp"
+
+using namespace std;
+
+namespace {
+// Orders matches best first: by score, then by the lower row among equal scores
+struct ScoreGreater {
+  bool operator()(const ScoredMatch &a, const ScoredMatch &b) const {
+    return a.score != b.score ? a.score > b.score : a.row < b.row;
+  }
+};
+
+// Min-heap on score, so the weakest of the current top-K is the one replaced. Rows are visited in increasing order, so
+// a row scoring the same as the weakest never replaces it and ties keep the lower rows
+typedef priority_queue<ScoredMatch, vector<ScoredMatch>, ScoreGreater> TopKHeap;
+
+/**
+ * Scores one block of queries against the whole database, one database block at a time
+ */
+class ScoreQueryBlocks : public cv::ParallelLoopBody {
+ public:
+  ScoreQueryBlocks(const cv::Mat &queries, const cv::Mat &database, int k, int query_block_rows,
+                   int database_block_rows, vector<vector<ScoredMatch> > &out_matches)
+      : queries_(queries), database_(database), k_(k), query_block_rows_(query_block_rows),
+        database_block_rows_(database_block_rows), out_matches_(out_matches) {}
+
+  void operator()(const cv::Range &blocks) const {
+    cv::Mat scores;
+    for (int block = blocks.start; block < blocks.end; block++) {
+      int query_start = block * query_block_rows_;
+      int query_end = min(query_start + query_block_rows_, queries_.rows);
+      cv::Mat query_block = queries_.rowRange(query_start, query_end);
+      vector<TopKHeap> heaps(query_end - query_start);
+
+      for (int db_start = 0; db_start < database_.rows; db_start += database_block_rows_) {
+        int db_end = min(db_start + database_block_rows_, database_.rows);
+
+        // scores(i, j) = query_i . database_j, which is the correlation as both sides are normalized
+        cv::gemm(query_block, database_.rowRange(db_start, db_end), 1.0, cv::noArray(), 0.0, scores, cv::GEMM_2_T);
+
+        for (int i = 0; i < scores.rows; i++) {
+          const float *row = scores.ptr<float>(i);
+          TopKHeap &heap = heaps[i];
+          for (int j = 0; j < scores.cols; j++) {
+            if ((int) heap.size() < k_) {
+              heap.push(ScoredMatch{db_start + j, row[j]});
+            } else if (row[j] > heap.top().score) {
+              heap.pop();
+              heap.push(ScoredMatch{db_start + j, row[j]});
+            }
+          }
+        }
+      }
+
+      // Drain each heap into descending score order
+      for (size_t i = 0; i < heaps.size(); i++) {
+        vector<ScoredMatch> &matches = out_matches_[query_start + i];
+        matches.resize(heaps[i].size());
+        for (int j = (int) matches.size() - 1; j >= 0; j--) {
+          matches[j] = heaps[i].top();
+          heaps[i].pop();
+        }
+      }
+    }
+  }
+
+ private:
+  const cv::Mat &queries_;
+  const cv::Mat &database_;
+  int k_;
+  int query_block_rows_;
+  int database_block_rows_;
+  vector<vector<ScoredMatch> > &out_matches_;
+};
+}
+
+/**
+ * Normalizes histograms so that the dot product of two rows equals their CV_COMP_CORREL score. Each row has its mean
+ * subtracted and is then scaled to unit length.
+ * @param histograms cv::Mat Bag of Visual Words histograms, one per row
+ * @return cv::Mat the normalized CV_32F histograms
+ */
+cv::Mat NormalizeForCorrelation(const cv::Mat &histograms) {
+  cv::Mat normalized;
+  histograms.convertTo(normalized, CV_32F);
+
+  for (int i = 0; i < normalized.rows; i++) {
+    cv::Mat row = normalized.row(i);
+    row -= cv::mean(row)[0];
+    double norm = cv::norm(row, cv::NORM_L2);
+    if (norm > 0) {
+      row /= norm;
+    }
+  }
+  return normalized;
+}
+
+/**
+ * Finds the k highest scoring database rows for every query. Queries are split into blocks which are scored in
+ * parallel, and within a block the database is visited in blocks so the score matrix stays small and the database
+ * block is reused from cache by every query in the query block.
+ * @param queries cv::Mat the query histograms, normalized with NormalizeForCorrelation()
+ * @param database cv::Mat the database histograms, normalized with NormalizeForCorrelation()
+ * @param k int the number of matches to keep per query
+ * @param out_matches vector<vector<ScoredMatch>> the matches for each query, highest score first and lower rows first
+ * among equal scores. Holds every database row if there are no more than k
+ * @param query_block_rows int the number of queries scored together. Default is 256
+ * @param database_block_rows int the number of database rows scored per matrix product. Default is 4096
+ */
+void ScoreTopK(const cv::Mat &queries, const cv::Mat &database, int k, vector<vector<ScoredMatch> > &out_matches,
+               int query_block_rows, int database_block_rows) {
+  assert(queries.type() == CV_32F && database.type() == CV_32F);
+  assert(queries.cols == database.cols);
+
+  out_matches.assign(queries.rows, vector<ScoredMatch>());
+  if (queries.rows == 0 || database.rows == 0 || k <= 0) {
+    return;
+  }
+
+  // Shrink the query blocks when there are too few queries to give every thread a full block
+  int threads = max(1, cv::getNumThreads());
+  int block_rows = max(1, min(query_block_rows, (queries.rows + threads - 1) / threads));
+  int blocks = (queries.rows + block_rows - 1) / block_rows;
+  cv::parallel_for_(cv::Range(0, blocks),
+                    ScoreQueryBlocks(queries, database, k, block_rows, database_block_rows, out_matches));
+}
@@ -0,0 +1,217 @@
+/**
+ * DescriptorArena.cpp
+ *
+ * A single, growable buffer holding the descriptors of every image in the data set. Previously each image's
+ * descriptors were kept in their own cv::Mat and then copied again into one concatenated matrix for the vocabulary,
+ * which held the whole descriptor set in memory twice. The extraction appends each image to the arena as soon as it is
+ * extracted, and the arena is handed out as zero-copy views.
+ *
+ * On disk the arena uses the same layout as WriteDescriptorsToDisk() (rows, cols, type followed by the data), followed
+ * by the number of images, the number of rows of each image, the path of each image (its length, then its
+ * characters), and the number of features followed by the features, so ReadDescriptorsFromDisk() can still read it.
+ */
+#include <algorithm>
+#include <cassert>
+#include <fstream>
+
+#include "DescriptorArena.hpp"
+
+using namespace std;
+
+DescriptorArena::DescriptorArena(int cols, int type) : buffer_(0, cols, type), rows_(0) {}
+
+/**
+ * Grows the buffer so it can hold at least rows descriptors without reallocating. Reserving close to the final size
+ * up front avoids both the copies made while growing and the unused capacity left by doubling.
+ * @param rows int the total number of descriptors to make room for
+ */
+void DescriptorArena::Reserve(int rows) {
+  if (rows <= buffer_.rows) {
+    return;
+  }
+
+  cv::Mat grown(rows, buffer_.cols, buffer_.type());
+  if (rows_ > 0) {
+    buffer_.rowRange(0, rows_).copyTo(grown.rowRange(0, rows_));
+  }
+  buffer_ = grown;
+  if (features_.size() == (size_t) rows_) {
+    features_.reserve(rows);
+  }
+}
+
+/**
+ * Makes room for the descriptors of the next image and returns a view of it to write them into. The view is only
+ * valid until the next call that can grow the arena.
+ * @param rows int the number of descriptors the image is expected to have
+ * @return cv::Mat a rows x cols view into the arena
+ */
+cv::Mat DescriptorArena::BeginImage(int rows) {
+  if (rows_ + rows > buffer_.rows) {
+    // Grow by half again rather than doubling, as the arena is usually the largest allocation of the build. Growing
+    // copies the arena, so callers which know their size up front should Reserve() it instead
+    Reserve(max(rows_ + rows, buffer_.rows + buffer_.rows / 2));
+  }
+  return buffer_.rowRange(rows_, rows_ + rows);
+}
+
+/**
+ * Commits the descriptors written into the view returned by BeginImage() as the next image
+ * @param rows int the number of descriptors actually written. May be fewer than were requested
+ * @param image_path std::string the path of the image the descriptors were extracted from
+ * @param key_points vector<cv::KeyPoint> the key point of each descriptor. The features are only kept while every
+ * image gives them
+ */
+void DescriptorArena::EndImage(int rows, const string &image_path, const vector<cv::KeyPoint> &key_points) {
+  assert(rows_ + rows <= buffer_.rows);
+  if (features_.size() == (size_t) rows_ && key_points.size() == (size_t) rows) {
+    vector<GeometricFeature> features;
+    QuantizeKeyPoints(key_points, features);
+    features_.insert(features_.end(), features.begin(), features.end());
+  } else {
+    vector<GeometricFeature>().swap(features_);
+  }
+
+  image_offsets_.push_back(rows_);
+  image_rows_.push_back(rows);
+  image_paths_.push_back(image_path);
+  rows_ += rows;
+}
+
+/**
+ * Copies the descriptors of an image into the arena. Used when the descriptors were not extracted into BeginImage()
+ * @param descriptors cv::Mat the descriptors of the image
+ * @param image_path std::string the path of the image the descriptors were extracted from
+ * @param key_points vector<cv::KeyPoint> the key point of each descriptor, see EndImage()
+ */
+void DescriptorArena::Append(const cv::Mat &descriptors, const string &image_path,
+                             const vector<cv::KeyPoint> &key_points) {
+  assert(descriptors.cols == buffer_.cols && descriptors.type() == buffer_.type());
+  cv::Mat view = BeginImage(descriptors.rows);
+  descriptors.copyTo(view);
+  EndImage(descriptors.rows, image_path, key_points);
+}
+
+/**
+ * @return cv::Mat a view of every descriptor in the arena, one per row. Shares memory with the arena
+ */
+cv::Mat DescriptorArena::Descriptors() const {
+  return buffer_.rowRange(0, rows_);
+}
+
+/**
+ * @param image size_t the index of the image, in the order the images were added
+ * @return cv::Mat a view of the descriptors of a single image. Shares memory with the arena
+ */
+cv::Mat DescriptorArena::ImageDescriptors(size_t image) const {
+  assert(image < image_offsets_.size());
+  return buffer_.rowRange(image_offsets_[image], image_offsets_[image] + image_rows_[image]);
+}
+
+/**
+ * @param image size_t the index of the image, in the order the images were added
+ * @return std::string the path the image's descriptors were extracted from. Empty if it was not given
+ */
+const string &DescriptorArena::ImagePath(size_t image) const {
+  assert(image < image_paths_.size());
+  return image_paths_[image];
+}
+
+/**
+ * @param image size_t the index of the image, in the order the images were added. Requires has_features()
+ * @param out_count size_t the number of features of the image, one per descriptor
+ * @return GeometricFeature the quantized key points of the image, in the order of its descriptors and with word 0
+ */
+const GeometricFeature *DescriptorArena::ImageFeatures(size_t image, size_t &out_count) const {
+  assert(has_features() && image < image_offsets_.size());
+  out_count = (size_t) image_rows_[image];
+  return features_.data() + image_offsets_[image];
+}
+
+/**
+ * Writes the arena to disk
+ * @param file_path std::string the relative path to write the arena to
+ * @return bool true|false on whether or not the arena was completely written
+ */
+bool DescriptorArena::WriteToDisk(const string &file_path) const {
+  ofstream file(file_path.c_str(), ios::binary);
+  int header[3] = {rows_, buffer_.cols, buffer_.type()};
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  // rows_ rows of a continuous buffer are themselves continuous
+  file.write(reinterpret_cast<const char *>(buffer_.data), (size_t) rows_ * buffer_.cols * buffer_.elemSize());
+
+  int image_count = (int) image_rows_.size();
+  file.write(reinterpret_cast<const char *>(&image_count), sizeof(image_count));
+  file.write(reinterpret_cast<const char *>(image_rows_.data()), image_rows_.size() * sizeof(int));
+  for (const string &image_path : image_paths_) {
+    int length = (int) image_path.size();
+    file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    file.write(image_path.data(), length);
+  }
+
+  int feature_count = has_features() ? rows_ : 0;
+  file.write(reinterpret_cast<const char *>(&feature_count), sizeof(feature_count));
+  file.write(reinterpret_cast<const char *>(features_.data()), (size_t) feature_count * sizeof(GeometricFeature));
+  return (bool) file;
+}
+
+/**
+ * Replaces the contents of the arena with one written by WriteToDisk(). The buffer is allocated once at its exact
+ * size. Files written by WriteDescriptorsToDisk() are read as a single image without a path.
+ * @param file_path std::string the relative path to the arena
+ * @return bool true|false on whether or not the arena could be read
+ */
+bool DescriptorArena::ReadFromDisk(const string &file_path) {
+  ifstream file(file_path.c_str(), ios::binary);
+  int header[3] = {0, 0, 0};
+  if (!file.read(reinterpret_cast<char *>(header), sizeof(header)) || header[0] < 0 || header[1] <= 0) {
+    return false;
+  }
+
+  buffer_.create(header[0], header[1], header[2]);
+  rows_ = header[0];
+  image_offsets_.clear();
+  image_rows_.clear();
+  image_paths_.clear();
+  features_.clear();
+  if (!file.read(reinterpret_cast<char *>(buffer_.data), (size_t) rows_ * buffer_.cols * buffer_.elemSize())) {
+    rows_ = 0;
+    return false;
+  }
+
+  int image_count = 0;
+  if (file.read(reinterpret_cast<char *>(&image_count), sizeof(image_count))) {
+    image_rows_.resize(image_count);
+    file.read(reinterpret_cast<char *>(image_rows_.data()), image_count * sizeof(int));
+  } else {
+    image_rows_.assign(1, rows_);
+  }
+
+  int offset = 0;
+  for (int rows : image_rows_) {
+    image_offsets_.push_back(offset);
+    offset += rows;
+  }
+  if (offset != rows_) {
+    return false;
+  }
+
+  image_paths_.resize(image_rows_.size());
+  for (string &image_path : image_paths_) {
+    int length = 0;
+    if (!file.read(reinterpret_cast<char *>(&length), sizeof(length))) {
+      break;
+    }
+    image_path.resize(length);
+    file.read(&image_path[0], length);
+  }
+
+  int feature_count = 0;
+  if (file.read(reinterpret_cast<char *>(&feature_count), sizeof(feature_count)) && feature_count == rows_) {
+    features_.resize(feature_count);
+    if (!file.read(reinterpret_cast<char *>(features_.data()), (size_t) feature_count * sizeof(GeometricFeature))) {
+      features_.clear();
+    }
+  }
+  return true;
+}
@@ -0,0 +1,288 @@
+/**
+ * GeometricIndex.cpp
+ *
+ * Spatial verification of Bag of Visual Words matches. Scoring histograms ignores where in the image each word was
+ * found, so two images sharing many common words score well even when nothing in them lines up. Re-ranking the top
+ * candidates by how many of their shared words agree on a single similarity transform (translation, scale and
+ * rotation) separates true matches from those.
+ *
+ * The database side of the verification needs only each key point's position, scale, orientation and word, which the
+ * index stores quantized into 8 bytes per key point (see GeometricFeature). The features of each image are sorted by
+ * word so the correspondences between two images are found with a single merge of the two lists.
+ *
+ * A SURF key point carries its own scale and orientation, so a single correspondence is enough to hypothesise the
+ * transform between the images. Rather than sampling randomly as RANSAC would, a fixed number of correspondences are
+ * each tried as the hypothesis and the one with the most inliers wins. This keeps the cost of verifying a candidate
+ * bounded and the result deterministic.
+ *
+ * On disk the index is the number of images and features, the offset of each image's features, then the features.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+
+#include "GeometricIndex.hpp"
+
+using namespace std;
+
+namespace {
+const float kPositionScale = 4;
+const float kScaleSteps = 16;
+const float kAngleSteps = 256;
+const float kPi = 3.14159265358979f;
+
+uint16_t QuantizeTo16(float value) {
+  return (uint16_t) min(65535.0f, max(0.0f, value + 0.5f));
+}
+
+/**
+ * The difference between two quantized orientations, folded into [0, 128]
+ */
+int AngleDistance(int difference) {
+  int wrapped = difference & 255;
+  return min(wrapped, 256 - wrapped);
+}
+}
+
+/**
+ * Reduces the key points of an image to the features stored in the geometric index, sorted by word. Key points whose
+ * word does not fit in 16 bits are dropped.
+ * @param key_points vector<cv::KeyPoint> the key points of the image
+ * @param labels vector<int> the visual word each key point's descriptor was assigned to, see AssignToNearestCentroids()
+ * @param out_features vector<GeometricFeature> the quantized features
+ */
+void QuantizeFeatures(const vector<cv::KeyPoint> &key_points, const vector<int> &labels,
+                      vector<GeometricFeature> &out_features) {
+  QuantizeKeyPoints(key_points, out_features);
+  out_features.resize(min(out_features.size(), labels.size()));
+  AssignFeatureWords(labels.data(), out_features);
+}
+
+/**
+ * Quantizes the position, scale and orientation of each key point, before its descriptor has been assigned a word. The
+ * features are in the order of the key points and their words are 0 until AssignFeatureWords() sets them.
+ * @param key_points vector<cv::KeyPoint> the key points of the image
+ * @param out_features vector<GeometricFeature> one feature per key point
+ */
+void QuantizeKeyPoints(const vector<cv::KeyPoint> &key_points, vector<GeometricFeature> &out_features) {
+  out_features.clear();
+  out_features.reserve(key_points.size());
+  for (const cv::KeyPoint &key_point : key_points) {
+    GeometricFeature feature;
+    feature.x = QuantizeTo16(key_point.pt.x * kPositionScale);
+    feature.y = QuantizeTo16(key_point.pt.y * kPositionScale);
+    feature.word = 0;
+    feature.log_scale = (uint8_t) min(255.0f, max(0.0f, log2(max(1.0f, key_point.size)) * kScaleSteps + 0.5f));
+    // Upright key points have an angle of -1
+    float angle = key_point.angle < 0 ? 0 : key_point.angle;
+    feature.angle = (uint8_t) ((int) (angle / 360 * kAngleSteps + 0.5f) & 255);
+    out_features.push_back(feature);
+  }
+}
+
+/**
+ * Sets the word of features made by QuantizeKeyPoints() and sorts them by word, as the index stores them. Features
+ * whose word does not fit in 16 bits are dropped.
+ * @param labels int the word of each feature, one per feature
+ * @param features vector<GeometricFeature> the features of one image, in the order of their key points
+ */
+void AssignFeatureWords(const int *labels, vector<GeometricFeature> &features) {
+  size_t kept = 0;
+  for (size_t i = 0; i < features.size(); i++) {
+    if (labels[i] < 0 || labels[i] > 65535) {
+      continue;
+    }
+    features[kept] = features[i];
+    features[kept].word = (uint16_t) labels[i];
+    kept++;
+  }
+  features.resize(kept);
+
+  stable_sort(features.begin(), features.end(), [](const GeometricFeature &a, const GeometricFeature &b) {
+    return a.word < b.word;
+  });
+}
+
+/**
+ * Counts the correspondences between two images that agree on a single similarity transform
+ * @param query GeometricFeature the features of the query image, sorted by word
+ * @param query_count size_t the number of query features
+ * @param candidate GeometricFeature the features of the candidate image, sorted by word
+ * @param candidate_count size_t the number of candidate features
+ * @param params GeometricVerificationParams the tolerances and work limits of the verification
+ * @param scratch vector<Correspondence> working memory, reused between calls
+ * @return int the number of inliers of the best hypothesis. 0 or 1 if the images share at most one usable word
+ */
+int VerifyGeometry(const GeometricFeature *query, size_t query_count, const GeometricFeature *candidate,
+                   size_t candidate_count, const GeometricVerificationParams &params,
+                   vector<Correspondence> &scratch) {
+  // Merge the two word sorted lists, pairing every feature of a shared word unless the word is too frequent to be
+  // informative
+  scratch.clear();
+  size_t q = 0;
+  size_t c = 0;
+  while (q < query_count && c < candidate_count) {
+    if (query[q].word < candidate[c].word) {
+      q++;
+      continue;
+    }
+    if (query[q].word > candidate[c].word) {
+      c++;
+      continue;
+    }
+    uint16_t word = query[q].word;
+    size_t q_end = q;
+    size_t c_end = c;
+    while (q_end < query_count && query[q_end].word == word) {
+      q_end++;
+    }
+    while (c_end < candidate_count && candidate[c_end].word == word) {
+      c_end++;
+    }
+    if ((int) ((q_end - q) * (c_end - c)) <= params.max_word_pairs) {
+      for (size_t i = q; i < q_end; i++) {
+        for (size_t j = c; j < c_end; j++) {
+          Correspondence correspondence = {(int) i, (int) j};
+          scratch.push_back(correspondence);
+        }
+      }
+    }
+    q = q_end;
+    c = c_end;
+  }
+
+  // Keep an even spread of the pairs when there are too many, as hypotheses are chosen. Keeping the first pairs of the
+  // merge would keep those of the lowest word ids, which say nothing about where in the image the match is
+  size_t pairs = scratch.size();
+  if (params.max_correspondences > 0 && pairs > (size_t) params.max_correspondences) {
+    size_t kept = (size_t) params.max_correspondences;
+    for (size_t i = 0; i < kept; i++) {
+      scratch[i] = scratch[i * pairs / kept];
+    }
+    scratch.resize(kept);
+  }
+
+  int count = (int) scratch.size();
+  if (count < 2) {
+    return count;
+  }
+
+  float tolerance = params.inlier_pixels * kPositionScale;
+  float squared_tolerance = tolerance * tolerance;
+  float scale_tolerance = params.scale_tolerance_octaves * kScaleSteps;
+  int angle_tolerance = (int) (params.angle_tolerance_degrees / 360 * kAngleSteps);
+  int stride = max(1, count / max(1, params.max_hypotheses));
+
+  int best = 1;
+  for (int h = 0; h < count && best < count; h += stride) {
+    const GeometricFeature &hypothesis_query = query[scratch[h].query];
+    const GeometricFeature &hypothesis_candidate = candidate[scratch[h].candidate];
+    int scale_change = hypothesis_candidate.log_scale - hypothesis_query.log_scale;
+    int rotation = hypothesis_candidate.angle - hypothesis_query.angle;
+
+    // candidate = s * R(theta) * query + t, fixed by the hypothesis' own pair
+    float s = exp2(scale_change / kScaleSteps);
+    float theta = rotation * 2 * kPi / kAngleSteps;
+    float a = s * cos(theta);
+    float b = s * sin(theta);
+    float tx = hypothesis_candidate.x - (a * hypothesis_query.x - b * hypothesis_query.y);
+    float ty = hypothesis_candidate.y - (b * hypothesis_query.x + a * hypothesis_query.y);
+
+    int inliers = 0;
+    for (const Correspondence &correspondence : scratch) {
+      const GeometricFeature &from = query[correspondence.query];
+      const GeometricFeature &to = candidate[correspondence.candidate];
+      if (abs(to.log_scale - from.log_scale - scale_change) > scale_tolerance ||
+          AngleDistance(to.angle - from.angle - rotation) > angle_tolerance) {
+        continue;
+      }
+      float dx = a * from.x - b * from.y + tx - to.x;
+      float dy = b * from.x + a * from.y + ty - to.y;
+      if (dx * dx + dy * dy <= squared_tolerance) {
+        inliers++;
+      }
+    }
+    best = max(best, inliers);
+  }
+  return best;
+}
+
+/**
+ * Makes room for the features of a data set up front
+ * @param images size_t the number of images to make room for
+ * @param features size_t the total number of features to make room for
+ */
+void GeometricIndex::Reserve(size_t images, size_t features) {
+  image_offsets_.reserve(images + 1);
+  features_.reserve(features);
+}
+
+/**
+ * Appends the features of the next image
+ * @param features vector<GeometricFeature> the image's features, as returned by QuantizeFeatures(). May be empty
+ */
+void GeometricIndex::Add(const vector<GeometricFeature> &features) {
+  if (image_offsets_.empty()) {
+    image_offsets_.push_back(0);
+  }
+  features_.insert(features_.end(), features.begin(), features.end());
+  image_offsets_.push_back(features_.size());
+}
+
+/**
+ * @param image size_t the index of the image, in the order the images were added
+ * @param out_count size_t the number of features of the image
+ * @return GeometricFeature the image's features, sorted by word. Valid until the index is modified
+ */
+const GeometricFeature *GeometricIndex::ImageFeatures(size_t image, size_t &out_count) const {
+  out_count = (size_t) (image_offsets_[image + 1] - image_offsets_[image]);
+  return features_.data() + image_offsets_[image];
+}
+
+/**
+ * Writes the index to disk
+ * @param file_path std::string the relative path to write the index to
+ * @return bool true|false on whether or not the index was completely written
+ */
+bool GeometricIndex::WriteToDisk(const string &file_path) const {
+  ofstream file(file_path.c_str(), ios::binary);
+  uint64_t header[2] = {image_count(), features_.size()};
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  if (header[0] > 0) {
+    file.write(reinterpret_cast<const char *>(image_offsets_.data()), image_offsets_.size() * sizeof(uint64_t));
+  }
+  file.write(reinterpret_cast<const char *>(features_.data()), features_.size() * sizeof(GeometricFeature));
+  return (bool) file;
+}
+
+/**
+ * Replaces the contents of the index with one written by WriteToDisk()
+ * @param file_path std::string the relative path to the index
+ * @return bool true|false on whether or not the index could be read and is consistent
+ */
+bool GeometricIndex::ReadFromDisk(const string &file_path) {
+  features_.clear();
+  image_offsets_.clear();
+  ifstream file(file_path.c_str(), ios::binary);
+  uint64_t header[2] = {0, 0};
+  if (!file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    return false;
+  }
+  if (header[0] == 0) {
+    return header[1] == 0;
+  }
+
+  image_offsets_.resize(header[0] + 1);
+  features_.resize(header[1]);
+  bool complete =
+      file.read(reinterpret_cast<char *>(image_offsets_.data()), image_offsets_.size() * sizeof(uint64_t)) &&
+      file.read(reinterpret_cast<char *>(features_.data()), features_.size() * sizeof(GeometricFeature));
+  if (!complete || image_offsets_.front() != 0 || image_offsets_.back() != features_.size() ||
+      !is_sorted(image_offsets_.begin(), image_offsets_.end())) {
+    features_.clear();
+    image_offsets_.clear();
+    return false;
+  }
+  return true;
+}
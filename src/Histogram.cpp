@@ -7,12 +7,19 @@
  *
  * There exists no functionality to incorporate new histograms as images are added to the data set.
  */
+#include <iostream>
 #include <opencv2/core.hpp>
 #include <opencv2/opencv.hpp>
 #include <opencv2/xfeatures2d.hpp>
 #include <boost/filesystem.hpp>
 
 #include "utils.hpp"
+#include "Assignment.hpp"
+#include "DescriptorArena.hpp"
+#include "GeometricIndex.hpp"
+#include "Histogram.hpp"
+#include "Keypoints.hpp"
+#include "QuantizedVocabulary.hpp"
 #include "Surf.hpp"
 #include "Vocabulary.hpp"
 #include "SVM.hpp"
@@ -80,26 +87,31 @@ void WriteHistogramToDisk(string &file_path, cv::Mat &histogram) {
  * @param file_path std:;string the relative file path to the image which is to have its histogram computed
  * @param vocabulary cv::Mat the pre-constructed Bag of Visual Words dictionary containing the words to use when
  * constructing the histogram for an image
+ * @param keypoint_policy KeypointPolicy the Hessian threshold and key point range used by the SURF detector. Must match
+ * the one the data set was encoded with
  * @return cv::Mat the normalized histogram for an image
  */
-cv::Mat ComputeHistogram(string &file_path, cv::Mat &vocabulary) {
-  // Initialize the SURF extractor/detector and BoW extractor
-  cv::Ptr<cv::xfeatures2d::SurfFeatureDetector> detector = cv::xfeatures2d::SURF::create();
-  cv::Ptr<cv::DescriptorExtractor> extractor = cv::xfeatures2d::SURF::create();
-  cv::Ptr<cv::DescriptorMatcher> matcher = cv::BFMatcher::create();
-  cv::BOWImgDescriptorExtractor bow_extractor(extractor, matcher);
-
-  bow_extractor.setVocabulary(vocabulary);
-
+cv::Mat ComputeHistogram(string &file_path, cv::Mat &vocabulary, const KeypointPolicy &keypoint_policy) {
   cv::Mat temp_img = cv::imread(file_path);
-  cv::Mat bow_descriptor;
-
-  // Get the key points of the temp_img
-  vector<cv::KeyPoint> key_points = get_key_points(temp_img);
+  return ComputeHistogram(temp_img, vocabulary, keypoint_policy);
+}
 
-  // Extract SURF descriptors for the temp_img, and then extract the Bag of Visual Words histogram for it
-  extractor->detect(temp_img, key_points);
-  bow_extractor.compute(temp_img, key_points, bow_descriptor);
+/**
+ * Computes the Bag of Visual Words histogram of an image which has already been decoded
+ * @param image cv::Mat the decoded image
+ * @param vocabulary cv::Mat the pre-constructed Bag of Visual Words dictionary
+ * @param keypoint_policy KeypointPolicy the Hessian threshold and key point range used by the SURF detector. Must match
+ * the one the data set was encoded with
+ * @return cv::Mat the normalized histogram for an image, or an empty matrix if it has no key points
+ */
+cv::Mat ComputeHistogram(cv::Mat &image, cv::Mat &vocabulary, const KeypointPolicy &keypoint_policy) {
+  // Extract SURF descriptors for the image, and then assign each to its nearest word to get the Bag of Visual Words
+  // histogram for it. See Assignment.cpp
+  cv::Ptr<cv::xfeatures2d::SURF> surf;
+  vector<cv::KeyPoint> key_points;
+  cv::Mat descriptors;
+  ExtractDescriptors(image, keypoint_policy, surf, key_points, descriptors);
+  cv::Mat bow_descriptor = ComputeBowHistogram(descriptors, vocabulary, ComputeCentroidNorms(vocabulary));
   return bow_descriptor;
 }
 
@@ -110,25 +122,12 @@ cv::Mat ComputeHistogram(string &file_path, cv::Mat &vocabulary) {
  * @param out_training_data cv::Mat the training object to append a histogram onto
  * @param vocabulary cv::Mat the pre-computed Bag of Visual Words dictionary containing the words to use when
  * constructing the histogram for an image
+ * @param keypoint_policy KeypointPolicy the Hessian threshold and key point range used by the SURF detector
  */
-void ComputeHistogram(string &file_path, cv::Mat &out_training_data, cv::Mat &vocabulary) {
-  // Initialize the SURF extractor/detector and BoW extractor
-  cv::Ptr<cv::xfeatures2d::SurfFeatureDetector> detector = cv::xfeatures2d::SURF::create();
-  cv::Ptr<cv::DescriptorExtractor> extractor = cv::xfeatures2d::SURF::create();
-  cv::Ptr<cv::DescriptorMatcher> matcher = cv::BFMatcher::create();
-  cv::BOWImgDescriptorExtractor bow_extractor(extractor, matcher);
-
-  bow_extractor.setVocabulary(vocabulary);
-
+void ComputeHistogram(string &file_path, cv::Mat &out_training_data, cv::Mat &vocabulary,
+                      const KeypointPolicy &keypoint_policy) {
   cv::Mat temp_img = cv::imread(file_path);
-  cv::Mat bow_descriptor;
-
-  // Get the key points of the temp_img
-  vector<cv::KeyPoint> key_points = get_key_points(temp_img);
-
-  // Extract SURF descriptors for the temp_img, and then extract the Bag of Visual Words histogram for it.
-  extractor->detect(temp_img, key_points);
-  bow_extractor.compute(temp_img, key_points, bow_descriptor);
+  cv::Mat bow_descriptor = ComputeHistogram(temp_img, vocabulary, keypoint_policy);
 
   /* If the out_training_data matrix has not yet been initialized then initialize it based on the number of features
    * computed by SURF, and the type of these features i.e, float, double, int, etc.
@@ -143,14 +142,19 @@ void ComputeHistogram(string &file_path, cv::Mat &out_training_data, cv::Mat &vo
 }
 
 /**
- * Recursive function to generate a Bag of Visual Words histogram for each image present within the specified vector
- * of images
- * @param images vector<std::string> a vector containing the relative file paths of the images within the user
- * specified data set. See main::readme() for more information.
+ * Generates the Bag of Visual Words histogram of every image in the extracted descriptor arena. The descriptors are
+ * assigned to words straight from the arena, so the images are not read or extracted again.
+ * @param arena DescriptorArena the descriptors, image paths and key points written by the extract stage
  * @param out_training_data cv::Mat an output matrix object to append each histogram onto
  * @param vocabulary_name std::string the name of the vocabulary file to use.
+ * @param geometry_path std::string if set, the quantized key points and words of every image are also written to this
+ * file as a GeometricIndex, for re-ranking queries. Requires the arena to hold the key points of every image
+ * @param quantized_assignment bool assign descriptors to words with the int8 vocabulary, see QuantizedVocabulary.cpp
+ * @return bool false if the histograms had to be computed but the arena is empty, or lacks the key points needed for
+ * geometry_path, in which case the reason is written to stderr
  */
-void ComputeHistograms(vector<string> &images, cv::Mat &out_training_data, string &vocabulary_name) {
+bool ComputeHistograms(const DescriptorArena &arena, cv::Mat &out_training_data, string &vocabulary_name,
+                       const string &geometry_path, bool quantized_assignment) {
   /* If the histograms directory does not already exist:
    *  1. Construct the histogram directory
    *  2. Compute each histogram for the data located within the data/images/ folder
@@ -159,16 +163,125 @@ void ComputeHistograms(vector<string> &images, cv::Mat &out_training_data, strin
    * Otherwise, simply read the already constructed histograms from disk.
    */
   string file_path = "data/classifier/svm_training.yml";
+  // The image each row of the training data was computed from
+  string index_path = "data/classifier/image_index.yml";
 
   if (!exists("data/histograms")) {
+    bool store_geometry = !geometry_path.empty();
+    if (arena.rows() == 0) {
+      cerr << "error: there are no descriptors to compute histograms from" << endl;
+      return false;
+    }
+    if (store_geometry && !arena.has_features()) {
+      cerr << "error: the descriptors were extracted without their key points, which " << geometry_path
+           << " needs" << endl;
+      return false;
+    }
+
     create_directory("data/histograms");
     cv::Mat vocabulary = ReadVocabularyFromDisk(vocabulary_name);
     cout << "Constructing histograms" << endl;
-    for (string &img : images) {
-      ComputeHistogram(img, out_training_data, vocabulary);
+
+    // Every descriptor of the data set is assigned in one call, which splits the work into blocks across threads
+    cv::Mat descriptors = arena.Descriptors();
+    cv::Mat centroid_norms = ComputeCentroidNorms(vocabulary);
+    vector<int> labels;
+    if (quantized_assignment) {
+      QuantizedVocabulary(vocabulary).Assign(descriptors, labels);
+
+      // Assign every 16th descriptor in floating point as well, to report how often the two agree on the word
+      cv::Mat sample((descriptors.rows + 15) / 16, descriptors.cols, descriptors.type());
+      for (int row = 0; row < sample.rows; row++) {
+        descriptors.row(row * 16).copyTo(sample.row(row));
+      }
+      vector<int> float_labels;
+      AssignToNearestCentroids(sample, vocabulary, centroid_norms, float_labels);
+      size_t agreements = 0;
+      for (size_t row = 0; row < float_labels.size(); row++) {
+        agreements += labels[row * 16] == float_labels[row];
+      }
+      if (!float_labels.empty()) {
+        cout << "int8 assignment agreed with float on " << 100.0 * agreements / float_labels.size() << "% of "
+             << float_labels.size() << " sampled descriptors" << endl;
+      }
+    } else {
+      AssignToNearestCentroids(descriptors, vocabulary, centroid_norms, labels);
+    }
+
+    GeometricIndex geometry;
+    if (store_geometry) {
+      geometry.Reserve(arena.image_count(), (size_t) arena.rows());
     }
+    vector<string> indexed_images;
+    out_training_data.release();
+    size_t offset = 0;
+    for (size_t i = 0; i < arena.image_count(); i++) {
+      size_t rows = (size_t) arena.ImageDescriptors(i).rows;
+      vector<int> image_labels(labels.begin() + offset, labels.begin() + offset + rows);
+      cv::Mat histogram = ComputeBowHistogram(image_labels, vocabulary.rows);
+      offset += rows;
+      if (histogram.empty()) {
+        continue;
+      }
+
+      string image_path = arena.ImagePath(i);
+      WriteHistogramToDisk(image_path, histogram);
+      if (out_training_data.empty()) {
+        out_training_data.create(0, histogram.cols, histogram.type());
+      }
+      out_training_data.push_back(histogram);
+      indexed_images.push_back(image_path);
+
+      if (store_geometry) {
+        size_t count = 0;
+        const GeometricFeature *features = arena.ImageFeatures(i, count);
+        vector<GeometricFeature> image_features(features, features + count);
+        AssignFeatureWords(image_labels.data(), image_features);
+        geometry.Add(image_features);
+      }
+    }
+
     WriteSVMTrainingDataToDisk(file_path, out_training_data);
+    WriteImageIndexToDisk(index_path, indexed_images);
+    if (store_geometry) {
+      geometry.WriteToDisk(geometry_path);
+      cout << "Geometric index: " << geometry.feature_count() << " key points of " << geometry.image_count()
+           << " images, " << geometry.feature_count() * sizeof(GeometricFeature) / (1024 * 1024) << " MB" << endl;
+    }
   }
 
   out_training_data = ReadSVMTrainingDataFromDisk(file_path);
-}
\ No newline at end of file
+  return true;
+}
+
+/**
+ * Writes the path of the image each row of the SVM training data was computed from, so that a row matched by a query
+ * can be resolved back to its image
+ * @param file_path std::string the relative path to write the index to. Expects a .yml file
+ * @param image_paths vector<std::string> the image paths, in the same order as the training data rows
+ */
+void WriteImageIndexToDisk(const string &file_path, const vector<string> &image_paths) {
+  cv::FileStorage fs(file_path, cv::FileStorage::WRITE);
+  fs << "images" << "[";
+  for (const string &image_path : image_paths) {
+    fs << image_path;
+  }
+  fs << "]";
+  fs.release();
+}
+
+/**
+ * Reads the image index written by WriteImageIndexToDisk()
+ * @param file_path std::string the relative path to the image index
+ * @return vector<std::string> the image paths, in the same order as the training data rows
+ */
+vector<string> ReadImageIndexFromDisk(const string &file_path) {
+  vector<string> image_paths;
+  cv::FileStorage fs(file_path, cv::FileStorage::READ);
+  cv::FileNode images = fs["images"];
+  for (cv::FileNodeIterator itr = images.begin(); itr != images.end(); ++itr) {
+    image_paths.push_back((string) *itr);
+  }
+  fs.release();
+  return image_paths;
+}
@@ -0,0 +1,393 @@
+/**
+ * IndexingPipeline.cpp
+ *
+ * Extracts the SURF descriptors, or computes the Bag of Visual Words histogram, of every image in a list as a staged
+ * pipeline, so that disk reads, decoding, SURF extraction and word assignment overlap instead of running one image at
+ * a time:
+ *
+ *   read -> decode -> extract -> [encode] -> write
+ *
+ * Each stage has its own pool of threads and is connected to the next by a BoundedQueue. A slow stage fills its input
+ * queue, which blocks the stages before it rather than letting decoded images pile up in memory. The time each stage
+ * spends working, waiting on input and waiting on output is reported so the bottleneck stage can be identified.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/xfeatures2d.hpp>
+
+#include "Assignment.hpp"
+#include "BoundedQueue.hpp"
+#include "DescriptorArena.hpp"
+#include "IndexingPipeline.hpp"
+#include "Keypoints.hpp"
+#include "QuantizedVocabulary.hpp"
+
+using namespace std;
+
+namespace {
+/**
+ * An image travelling through the pipeline. Each stage fills in its own field and releases the one it consumed, so an
+ * item only holds the data the next stage needs.
+ */
+struct IndexingItem {
+  size_t index;
+  string path;
+  vector<uchar> bytes;
+  cv::Mat image;
+  cv::Mat descriptors;
+  // Only kept when extracting into a DescriptorArena
+  vector<cv::KeyPoint> key_points;
+  cv::Mat histogram;
+  // Set once a stage drops the image. The item is still forwarded, without its data, so the writer can hand the images
+  // over in order
+  bool skipped = false;
+};
+
+typedef BoundedQueue<IndexingItem> ItemQueue;
+typedef function<bool(IndexingItem &)> ItemProcess;
+typedef function<void(IndexingItem &)> ItemSink;
+
+struct StageCounters {
+  StageCounters() : busy_ns(0), items(0), failed(0), running(0) {}
+
+  atomic<long long> busy_ns;
+  atomic<size_t> items;
+  atomic<size_t> failed;
+  atomic<int> running;
+};
+
+/**
+ * Resolves a configured thread count, where 0 means a share of the available cores
+ * @param configured int the thread count from the IndexingPipelineConfig
+ * @param cores_per_thread int the number of cores per thread to use when no count was configured
+ * @return int the number of threads to start, at least 1
+ */
+int ResolveThreads(int configured, int cores_per_thread) {
+  if (configured > 0) {
+    return configured;
+  }
+  int cores = max(1, (int) thread::hardware_concurrency());
+  return max(1, cores / cores_per_thread);
+}
+
+/**
+ * The loop run by every worker of a stage. Pops items until the input queue is drained, processes them and forwards
+ * them to the next stage. Items which fail are forwarded as skipped, and items skipped by an earlier stage are passed
+ * on untouched. The last worker of a stage to finish closes the output queue so the next stage can drain.
+ * @param input ItemQueue the queue feeding this stage
+ * @param output ItemQueue the queue feeding the next stage
+ * @param counters StageCounters the counters shared by the workers of this stage
+ * @param process function the work done on each item. Returns false if the image should be dropped
+ */
+void RunWorker(ItemQueue &input, ItemQueue &output, StageCounters &counters,
+               const ItemProcess &process) {
+  IndexingItem item;
+  while (input.Pop(item)) {
+    if (item.skipped) {
+      output.Push(move(item));
+      continue;
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool succeeded = process(item);
+    counters.busy_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    counters.items++;
+
+    if (!succeeded) {
+      counters.failed++;
+      // Release whatever the image was holding
+      IndexingItem skipped;
+      skipped.index = item.index;
+      skipped.skipped = true;
+      item = move(skipped);
+    }
+    output.Push(move(item));
+  }
+
+  if (--counters.running == 0) {
+    output.Close();
+  }
+}
+
+/**
+ * Starts the workers of a single stage
+ * @param threads int the number of workers to start
+ * @param make_process function creates the per-item work for one worker. Called once per worker so each can own its
+ * SURF detector/matcher instead of sharing one between threads
+ */
+void StartStage(vector<thread> &out_threads, int threads, ItemQueue &input, ItemQueue &output,
+                StageCounters &counters, const function<ItemProcess()> &make_process) {
+  counters.running = threads;
+  for (int i = 0; i < threads; i++) {
+    out_threads.push_back(thread([&input, &output, &counters, make_process]() {
+      ItemProcess process = make_process();
+      RunWorker(input, output, counters, process);
+    }));
+  }
+}
+
+IndexingStageStats MakeStageStats(const string &name, int threads, const StageCounters &counters,
+                                  const ItemQueue &input, const ItemQueue *output, double wall_seconds) {
+  IndexingStageStats stats;
+  stats.name = name;
+  stats.threads = threads;
+  stats.items = counters.items;
+  stats.busy_seconds = counters.busy_ns / 1e9;
+  stats.starved_seconds = input.pop_wait_seconds();
+  stats.blocked_seconds = output == nullptr ? 0 : output->push_wait_seconds();
+  stats.utilization = wall_seconds > 0 ? stats.busy_seconds / (threads * wall_seconds) : 0;
+  return stats;
+}
+
+/**
+ * Runs every image through the read, decode and extract stages, then the encode stage if make_encode is set. A single
+ * writer thread hands each image which made it through to sink, in the order of images, so the output does not depend
+ * on how the threads were scheduled. Images which finish ahead of an earlier one wait with the writer until it arrives.
+ * @param images vector<std::string> the relative file paths of the images
+ * @param keypoint_policy KeypointPolicy the Hessian threshold and key point range used to detect each image
+ * @param config IndexingPipelineConfig the thread counts and queue capacity of the pipeline
+ * @param keep_key_points bool keep the key points of each image for the sink rather than releasing them after
+ * extraction
+ * @param make_encode function creates the per-item work for one encode worker. If empty there is no encode stage and
+ * the sink receives the descriptors
+ * @param sink function receives every image which was not skipped. Only ever called from the writer thread
+ * @param out_stats IndexingPipelineStats how each stage spent its time
+ */
+void RunPipeline(vector<string> &images, const KeypointPolicy &keypoint_policy, const IndexingPipelineConfig &config,
+                 bool keep_key_points, const function<ItemProcess()> &make_encode, const ItemSink &sink,
+                 IndexingPipelineStats &out_stats) {
+  int read_threads = ResolveThreads(config.read_threads, 8);
+  int decode_threads = ResolveThreads(config.decode_threads, 4);
+  int extract_threads = ResolveThreads(config.extract_threads, 2);
+  int encode_threads = ResolveThreads(config.encode_threads, 4);
+
+  ItemQueue paths(config.queue_capacity);
+  ItemQueue loaded(config.queue_capacity);
+  ItemQueue decoded(config.queue_capacity);
+  ItemQueue extracted(config.queue_capacity);
+  ItemQueue encoded(config.queue_capacity);
+  StageCounters read_counters, decode_counters, extract_counters, encode_counters, write_counters;
+  // The queue the writer drains
+  ItemQueue &finished = make_encode ? encoded : extracted;
+
+  vector<thread> threads;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  StartStage(threads, read_threads, paths, loaded, read_counters, []() -> ItemProcess {
+    return [](IndexingItem &item) -> bool {
+      ifstream file(item.path.c_str(), ios::binary);
+      if (!file) {
+        return false;
+      }
+      item.bytes.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+      return !item.bytes.empty();
+    };
+  });
+
+  StartStage(threads, decode_threads, loaded, decoded, decode_counters, []() -> ItemProcess {
+    return [](IndexingItem &item) -> bool {
+      item.image = cv::imdecode(item.bytes, cv::IMREAD_COLOR);
+      vector<uchar>().swap(item.bytes);
+      return !item.image.empty();
+    };
+  });
+
+  mutex keypoint_mutex;
+  KeypointStats keypoint_stats;
+  StartStage(threads, extract_threads, decoded, extracted, extract_counters,
+             [&keypoint_policy, &keypoint_mutex, &keypoint_stats, keep_key_points]() -> ItemProcess {
+    cv::Ptr<cv::xfeatures2d::SURF> surf;
+    return [&keypoint_policy, &keypoint_mutex, &keypoint_stats, keep_key_points, surf](IndexingItem &item) mutable
+        -> bool {
+      KeypointStats image_stats;
+      ExtractDescriptors(item.image, keypoint_policy, surf, item.key_points, item.descriptors, &image_stats);
+      item.image.release();
+      if (!keep_key_points) {
+        vector<cv::KeyPoint>().swap(item.key_points);
+      }
+      {
+        lock_guard<mutex> lock(keypoint_mutex);
+        keypoint_stats.Merge(image_stats);
+      }
+      return item.descriptors.rows > 0;
+    };
+  });
+
+  if (make_encode) {
+    StartStage(threads, encode_threads, extracted, encoded, encode_counters, make_encode);
+  }
+
+  thread writer([&]() {
+    map<size_t, IndexingItem> pending;
+    size_t next = 0;
+    IndexingItem item;
+    while (finished.Pop(item)) {
+      // Drain whatever is queued so the sink is called in batches
+      size_t popped = 0;
+      do {
+        size_t index = item.index;
+        pending[index] = move(item);
+        popped++;
+      } while (popped < config.write_batch_size && finished.TryPop(item));
+
+      chrono::steady_clock::time_point batch_start = chrono::steady_clock::now();
+      for (map<size_t, IndexingItem>::iterator done = pending.begin();
+           done != pending.end() && done->first == next; done = pending.erase(done), next++) {
+        if (!done->second.skipped) {
+          sink(done->second);
+          write_counters.items++;
+        }
+      }
+      write_counters.busy_ns +=
+          chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - batch_start).count();
+    }
+  });
+
+  // Feed the pipeline. Blocks whenever the read stage falls behind, so at most queue_capacity paths are pending
+  for (size_t i = 0; i < images.size(); i++) {
+    IndexingItem item;
+    item.index = i;
+    item.path = images[i];
+    paths.Push(move(item));
+  }
+  paths.Close();
+
+  for (thread &worker : threads) {
+    worker.join();
+  }
+  writer.join();
+  double wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  out_stats.wall_seconds = wall_seconds;
+  out_stats.failed_images = read_counters.failed + decode_counters.failed + extract_counters.failed +
+                            encode_counters.failed;
+  out_stats.stages.clear();
+  out_stats.stages.push_back(MakeStageStats("read", read_threads, read_counters, paths, &loaded, wall_seconds));
+  out_stats.stages.push_back(MakeStageStats("decode", decode_threads, decode_counters, loaded, &decoded,
+                                            wall_seconds));
+  out_stats.stages.push_back(MakeStageStats("extract", extract_threads, extract_counters, decoded, &extracted,
+                                            wall_seconds));
+  if (make_encode) {
+    out_stats.stages.push_back(MakeStageStats("encode", encode_threads, encode_counters, extracted, &encoded,
+                                              wall_seconds));
+  }
+  out_stats.stages.push_back(MakeStageStats("write", 1, write_counters, finished, nullptr, wall_seconds));
+  out_stats.keypoints = keypoint_stats;
+}
+}
+
+/**
+ * Extracts the SURF descriptors of every image using the staged pipeline, appending them to an arena along with the
+ * image's path and key points. The writer thread copies each image into the arena as it arrives, growing it as needed,
+ * since its final size is only known once every image has been detected. Images which cannot be read, decoded, or have
+ * no key points are skipped.
+ * @param images vector<std::string> the relative file paths of the images within the data set
+ * @param keypoint_policy KeypointPolicy the Hessian threshold and key point range used to detect each image
+ * @param config IndexingPipelineConfig the thread counts and queue capacity of the pipeline. The encoding options are
+ * unused
+ * @param out_arena DescriptorArena the arena to append each image to, in the order of images
+ * @param out_stats IndexingPipelineStats how each stage spent its time
+ */
+void ExtractDescriptorsPipelined(vector<string> &images, const KeypointPolicy &keypoint_policy,
+                                 const IndexingPipelineConfig &config, DescriptorArena &out_arena,
+                                 IndexingPipelineStats &out_stats) {
+  RunPipeline(images, keypoint_policy, config, true, function<ItemProcess()>(), [&out_arena](IndexingItem &item) {
+    out_arena.Append(item.descriptors, item.path, item.key_points);
+  }, out_stats);
+}
+
+/**
+ * Computes the Bag of Visual Words histogram for every image using the staged pipeline, appending it to the training
+ * data. Images which cannot be read, decoded, or have no key points are skipped.
+ * @param images vector<std::string> the relative file paths of the images
+ * @param out_training_data cv::Mat an output matrix holding one histogram per row, in the order of images
+ * @param out_indexed_images vector<std::string> the path of the image each row of out_training_data belongs to
+ * @param vocabulary cv::Mat the Bag of Visual Words dictionary. Shared read-only between the encode workers. Unused if
+ * config.encoder is set
+ * @param keypoint_policy KeypointPolicy the Hessian threshold and key point range used to detect each image
+ * @param config IndexingPipelineConfig the thread counts and queue capacity of the pipeline
+ * @param out_stats IndexingPipelineStats how each stage spent its time
+ */
+void ComputeHistogramsPipelined(vector<string> &images, cv::Mat &out_training_data,
+                                vector<string> &out_indexed_images, cv::Mat &vocabulary,
+                                const KeypointPolicy &keypoint_policy, const IndexingPipelineConfig &config,
+                                IndexingPipelineStats &out_stats) {
+  cv::Mat centroid_norms = config.encoder ? cv::Mat() : ComputeCentroidNorms(vocabulary);
+  // Quantized once and shared read-only between the encode workers
+  QuantizedVocabulary quantized_vocabulary;
+  if (config.quantized_assignment && !config.encoder) {
+    quantized_vocabulary = QuantizedVocabulary(vocabulary);
+  }
+  function<ItemProcess()> make_encode = [&vocabulary, &centroid_norms, &quantized_vocabulary, &config]()
+      -> ItemProcess {
+    return [&vocabulary, &centroid_norms, &quantized_vocabulary, &config](IndexingItem &item) -> bool {
+      if (config.encoder) {
+        item.histogram = config.encoder(item.descriptors);
+        item.descriptors.release();
+        return !item.histogram.empty();
+      }
+
+      vector<int> labels;
+      if (quantized_vocabulary.empty()) {
+        AssignToNearestCentroids(item.descriptors, vocabulary, centroid_norms, labels);
+      } else {
+        quantized_vocabulary.Assign(item.descriptors, labels);
+      }
+      item.histogram = ComputeBowHistogram(labels, vocabulary.rows);
+      item.descriptors.release();
+      return !item.histogram.empty();
+    };
+  };
+
+  // The rows are appended in the order of the images so they can be mapped back to their file
+  RunPipeline(images, keypoint_policy, config, false, make_encode,
+              [&out_training_data, &out_indexed_images](IndexingItem &item) {
+    if (out_training_data.empty()) {
+      out_training_data.create(0, item.histogram.cols, item.histogram.type());
+    }
+    out_training_data.push_back(item.histogram);
+    out_indexed_images.push_back(item.path);
+  }, out_stats);
+}
+
+/**
+ * Prints the per-stage utilization of a pipeline run, marking the stage with the highest utilization as the
+ * bottleneck
+ * @param stats IndexingPipelineStats the stats returned by ExtractDescriptorsPipelined() or
+ * ComputeHistogramsPipelined()
+ */
+void PrintIndexingPipelineStats(const IndexingPipelineStats &stats) {
+  size_t bottleneck = 0;
+  for (size_t i = 0; i < stats.stages.size(); i++) {
+    if (stats.stages[i].utilization > stats.stages[bottleneck].utilization) {
+      bottleneck = i;
+    }
+  }
+
+  ios::fmtflags flags = cout.flags();
+  streamsize precision = cout.precision();
+  cout << "Indexed in " << fixed << setprecision(1) << stats.wall_seconds << "s, " << stats.failed_images
+       << " images skipped" << endl;
+  cout << "stage    threads  items    busy(s)  starved(s)  blocked(s)  utilization" << endl;
+  for (size_t i = 0; i < stats.stages.size(); i++) {
+    const IndexingStageStats &stage = stats.stages[i];
+    cout << left << setw(9) << stage.name << right << setw(7) << stage.threads << setw(7) << stage.items
+         << setw(11) << stage.busy_seconds << setw(12) << stage.starved_seconds << setw(12) << stage.blocked_seconds
+         << setw(12) << stage.utilization * 100 << "%" << (i == bottleneck ? "  <- bottleneck" : "") << endl;
+  }
+  cout.flags(flags);
+  cout.precision(precision);
+  PrintKeypointStats(stats.keypoints);
+}
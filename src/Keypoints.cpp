@@ -0,0 +1,174 @@
+/**
+ * Keypoints.cpp
+ *
+ * Makes the cost of extracting an image predictable. With a fixed Hessian threshold a highly textured image yields
+ * thousands of SURF key points, and since descriptor computation and word assignment are both linear in the number of
+ * key points those images dominate the tail of both indexing and query latency. A flat, low contrast image on the
+ * other hand may yield almost none and cannot be matched.
+ *
+ * DetectKeyPoints() steers every image into the range set by a KeypointPolicy: too few key points lowers the threshold
+ * and detects again, too many keeps the strongest responses, which is the same set a higher threshold would have
+ * found. Each image is handled on its own, so the same image always gets the same key points at index and query time.
+ */
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <opencv2/core.hpp>
+
+#include "Keypoints.hpp"
+
+using namespace std;
+
+namespace {
+// The most times an image is detected again at a lower threshold
+const int kMaxPasses = 4;
+
+int Percentile(vector<int> sorted_counts, double percentile) {
+  if (sorted_counts.empty()) {
+    return 0;
+  }
+  size_t index = min(sorted_counts.size() - 1, (size_t) (percentile / 100 * (sorted_counts.size() - 1) + 0.5));
+  nth_element(sorted_counts.begin(), sorted_counts.begin() + index, sorted_counts.end());
+  return sorted_counts[index];
+}
+}
+
+/**
+ * Adds one image to the stats
+ * @param detection KeypointDetection the outcome of detecting the image's key points
+ * @param descriptor_seconds double the time taken to compute the descriptors of the kept key points
+ */
+void KeypointStats::Record(const KeypointDetection &detection, double descriptor_seconds) {
+  detected.push_back(detection.detected);
+  kept.push_back(detection.kept);
+  if (detection.kept < detection.detected) {
+    capped_images++;
+  }
+  if (detection.passes > 1) {
+    lowered_images++;
+  }
+  compute_seconds += descriptor_seconds;
+}
+
+void KeypointStats::Merge(const KeypointStats &other) {
+  detected.insert(detected.end(), other.detected.begin(), other.detected.end());
+  kept.insert(kept.end(), other.kept.begin(), other.kept.end());
+  capped_images += other.capped_images;
+  lowered_images += other.lowered_images;
+  compute_seconds += other.compute_seconds;
+}
+
+/**
+ * Estimates the descriptor computation time saved by the cap, from the average time spent per kept key point. Word
+ * assignment time is saved in the same proportion but is not included.
+ * @return double the estimated number of seconds saved
+ */
+double KeypointStats::EstimatedSecondsSaved() const {
+  long long detected_total = 0;
+  long long kept_total = 0;
+  for (size_t i = 0; i < detected.size(); i++) {
+    detected_total += detected[i];
+    kept_total += kept[i];
+  }
+  return kept_total == 0 ? 0 : compute_seconds / kept_total * (detected_total - kept_total);
+}
+
+/**
+ * Detects the SURF key points of an image under a key point policy
+ * @param image cv::Mat the decoded image
+ * @param policy KeypointPolicy the threshold and the range of key points to aim for
+ * @param surf cv::Ptr<cv::xfeatures2d::SURF> the detector to use, created if empty. Its threshold is changed, so it
+ * must not be shared between threads
+ * @param out_detection KeypointDetection if not null, how the key points were found
+ * @return vector<cv::KeyPoint> the key points, at most policy.max_keypoints if it is set
+ */
+vector<cv::KeyPoint> DetectKeyPoints(const cv::Mat &image, const KeypointPolicy &policy,
+                                     cv::Ptr<cv::xfeatures2d::SURF> &surf, KeypointDetection *out_detection) {
+  if (surf.empty()) {
+    surf = cv::xfeatures2d::SURF::create(policy.min_hessian);
+  }
+
+  double threshold = policy.min_hessian;
+  vector<cv::KeyPoint> key_points;
+  int passes = 0;
+  do {
+    if (passes > 0) {
+      threshold = max((double) policy.min_hessian_floor, threshold / 2);
+    }
+    surf->setHessianThreshold(threshold);
+    surf->detect(image, key_points);
+    passes++;
+  } while (policy.min_keypoints > 0 && (int) key_points.size() < policy.min_keypoints &&
+           threshold > policy.min_hessian_floor && passes < kMaxPasses);
+
+  int detected = (int) key_points.size();
+  if (policy.max_keypoints > 0 && (int) key_points.size() > policy.max_keypoints) {
+    nth_element(key_points.begin(), key_points.begin() + policy.max_keypoints, key_points.end(),
+                [](const cv::KeyPoint &a, const cv::KeyPoint &b) {
+      return a.response > b.response;
+    });
+    key_points.resize(policy.max_keypoints);
+  }
+
+  if (out_detection != nullptr) {
+    out_detection->detected = detected;
+    out_detection->kept = (int) key_points.size();
+    out_detection->hessian_threshold = threshold;
+    out_detection->passes = passes;
+  }
+  return key_points;
+}
+
+/**
+ * Detects the key points of an image under a key point policy and computes their SURF descriptors
+ * @param image cv::Mat the decoded image
+ * @param policy KeypointPolicy the threshold and the range of key points to aim for
+ * @param surf cv::Ptr<cv::xfeatures2d::SURF> the calling thread's detector, created if empty
+ * @param out_key_points vector<cv::KeyPoint> the key points the descriptors were computed for
+ * @param out_descriptors cv::Mat the descriptors, one row per key point
+ * @param stats KeypointStats if not null, the image is recorded in these stats
+ */
+void ExtractDescriptors(const cv::Mat &image, const KeypointPolicy &policy, cv::Ptr<cv::xfeatures2d::SURF> &surf,
+                        vector<cv::KeyPoint> &out_key_points, cv::Mat &out_descriptors, KeypointStats *stats) {
+  KeypointDetection detection;
+  out_key_points = DetectKeyPoints(image, policy, surf, &detection);
+  if (out_key_points.empty()) {
+    out_descriptors.release();
+    if (stats != nullptr) {
+      stats->Record(detection, 0);
+    }
+    return;
+  }
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  surf->compute(image, out_key_points, out_descriptors);
+  if (stats != nullptr) {
+    stats->Record(detection, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+  }
+}
+
+/**
+ * Prints the distribution of key points per image before and after the cap, and the estimated time it saved
+ * @param stats KeypointStats the stats of the images
+ */
+void PrintKeypointStats(const KeypointStats &stats) {
+  if (stats.kept.empty()) {
+    return;
+  }
+
+  ios::fmtflags flags = cout.flags();
+  streamsize precision = cout.precision();
+  cout << "key points   p50      p90      p99      max" << endl;
+  cout << left << setw(10) << "detected" << right << setw(6) << Percentile(stats.detected, 50) << setw(9)
+       << Percentile(stats.detected, 90) << setw(9) << Percentile(stats.detected, 99) << setw(9)
+       << Percentile(stats.detected, 100) << endl;
+  cout << left << setw(10) << "kept" << right << setw(6) << Percentile(stats.kept, 50) << setw(9)
+       << Percentile(stats.kept, 90) << setw(9) << Percentile(stats.kept, 99) << setw(9)
+       << Percentile(stats.kept, 100) << endl;
+  cout << stats.capped_images << " of " << stats.kept.size() << " images capped, " << stats.lowered_images
+       << " detected again at a lower threshold, ~" << fixed << setprecision(1) << stats.EstimatedSecondsSaved()
+       << "s of descriptor computation saved" << endl;
+  cout.flags(flags);
+  cout.precision(precision);
+}
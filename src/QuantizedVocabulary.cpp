@@ -0,0 +1,402 @@
+/**
+ * QuantizedVocabulary.cpp
+ *
+ * Word assignment with int8 dot products. AssignToNearestCentroids() reads the whole CV_32F vocabulary (2500 x 64
+ * floats, 640KB) for every block of descriptors, which is more than the L2 cache holds, so encoding is bound by memory
+ * bandwidth rather than arithmetic. Stored as int8 the vocabulary is 160KB, and a 256 bit register holds 32 dimensions
+ * instead of 8.
+ *
+ * The nearest word is still the argmin of ||c||^2 - 2 x.c (see Assignment.cpp). The vocabulary is quantized once with a
+ * scale per dimension, as the range of the SURF dimensions differs widely, and each descriptor is quantized with a
+ * single scale of its own after folding the vocabulary's scales into it:
+ *
+ *   c_d  ~= qc_d * s_d                          s_d = max_w |c_wd| / 127
+ *   x.c  ~= sum_d (x_d * s_d) * qc_d
+ *        ~= t * sum_d qx_d * qc_d               qx_d = round(x_d * s_d / t), t = max_d |x_d * s_d| / 127
+ *
+ * leaving a plain int8 x int8 dot product per word. ||c||^2 is taken from the dequantized words so the distances are
+ * those to the quantized vocabulary. Ties and near ties between words can be resolved differently than in floating
+ * point, which is what the agreement rate reported by the assignment benchmark and the encode stage measures.
+ *
+ * The codes are interleaved in groups of 8 words x 4 dimensions, so one 32 byte load holds the same 4 dimensions of 8
+ * words and each 32 bit lane of a register accumulates the dot product of its own word, with no horizontal sums. Three
+ * kernels scan the whole vocabulary for one descriptor, keeping the nearest word of each lane as they go:
+ *
+ *   scalar  portable fallback
+ *   AVX2    sign extends the codes to int16 and multiplies them with _mm256_madd_epi16 against 4 dimensions of the
+ *           descriptor broadcast to every word
+ *   VNNI    _mm256_dpbusd_epi32 multiplies 32 unsigned by signed bytes and sums each 4 per instruction. The descriptor
+ *           is offset by 128 to make it unsigned, and 128 * sum_d qc_d is subtracted again afterwards
+ *
+ * The x86 kernels are compiled with target attributes and picked at run time, so the build needs no -mavx2 and the
+ * same binary still runs on CPUs without them.
+ */
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "QuantizedVocabulary.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define REVERSE_IMAGE_SEARCH_X86_KERNELS 1
+#include <immintrin.h>
+#if defined(__clang__) ? __clang_major__ >= 8 : __GNUC__ >= 8
+#define REVERSE_IMAGE_SEARCH_VNNI_KERNEL 1
+#endif
+#endif
+
+using namespace std;
+
+namespace {
+/**
+ * The quantized vocabulary as the kernels see it
+ */
+struct KernelVocabulary {
+  const int8_t *codes;
+  const int32_t *code_sums;
+  const float *norms;
+  // The number of groups of 8 words, and of 4 dimensions
+  int groups;
+  int chunks;
+};
+
+/**
+ * A quantized descriptor, in the form each kernel multiplies with
+ */
+struct KernelQuery {
+  // qx, one byte per dimension
+  const int8_t *codes;
+  // Each 4 dimensions of qx widened to int16 and packed into 64 bits, for the AVX2 kernel
+  const int64_t *widened;
+  // Each 4 dimensions of qx + 128 packed into 32 bits, for the VNNI kernel
+  const uint32_t *offset;
+  // 2t, which turns the integer dot products back into 2 x.c
+  float two_t;
+};
+
+typedef int (*NearestWordKernel)(const KernelVocabulary &vocabulary, const KernelQuery &query);
+
+int8_t QuantizeTo8(float value) {
+  return (int8_t) max(-127L, min(127L, lrintf(value)));
+}
+
+int NearestWordScalar(const KernelVocabulary &vocabulary, const KernelQuery &query) {
+  int best = 0;
+  float best_distance = numeric_limits<float>::infinity();
+  for (int g = 0; g < vocabulary.groups; g++) {
+    const int8_t *group = vocabulary.codes + (size_t) g * vocabulary.chunks * 32;
+    int32_t dots[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    for (int c = 0; c < vocabulary.chunks; c++) {
+      const int8_t *chunk = group + c * 32;
+      const int8_t *x = query.codes + c * 4;
+      for (int k = 0; k < 8; k++) {
+        dots[k] += chunk[k * 4] * x[0] + chunk[k * 4 + 1] * x[1] + chunk[k * 4 + 2] * x[2] + chunk[k * 4 + 3] * x[3];
+      }
+    }
+    for (int k = 0; k < 8; k++) {
+      float distance = vocabulary.norms[g * 8 + k] - query.two_t * (float) dots[k];
+      if (distance < best_distance) {
+        best_distance = distance;
+        best = g * 8 + k;
+      }
+    }
+  }
+  return best;
+}
+
+#ifdef REVERSE_IMAGE_SEARCH_X86_KERNELS
+/**
+ * Keeps, for each of the 8 lanes, the nearest word seen so far given the dot products of the next 8 words
+ */
+__attribute__((target("avx2")))
+inline void UpdateNearest(__m256i dots, const float *norms, __m256 two_t, __m256i index, __m256 &best_distance,
+                          __m256i &best_index) {
+  __m256 distance = _mm256_sub_ps(_mm256_loadu_ps(norms), _mm256_mul_ps(two_t, _mm256_cvtepi32_ps(dots)));
+  __m256 closer = _mm256_cmp_ps(distance, best_distance, _CMP_LT_OQ);
+  best_distance = _mm256_blendv_ps(best_distance, distance, closer);
+  best_index = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_index), _mm256_castsi256_ps(index),
+                                                    closer));
+}
+
+/**
+ * Picks the nearest word of the 8 lanes, preferring the lowest index on a tie as the scalar kernel does
+ */
+__attribute__((target("avx2")))
+inline int ReduceNearest(__m256 best_distance, __m256i best_index) {
+  float distances[8];
+  int32_t indices[8];
+  _mm256_storeu_ps(distances, best_distance);
+  _mm256_storeu_si256((__m256i *) indices, best_index);
+  int best = 0;
+  for (int k = 1; k < 8; k++) {
+    if (distances[k] < distances[best] || (distances[k] == distances[best] && indices[k] < indices[best])) {
+      best = k;
+    }
+  }
+  return indices[best];
+}
+
+__attribute__((target("avx2")))
+int NearestWordAvx2(const KernelVocabulary &vocabulary, const KernelQuery &query) {
+  __m256 two_t = _mm256_set1_ps(query.two_t);
+  __m256 best_distance = _mm256_set1_ps(numeric_limits<float>::infinity());
+  __m256i best_index = _mm256_setzero_si256();
+  __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i step = _mm256_set1_epi32(8);
+  for (int g = 0; g < vocabulary.groups; g++) {
+    const int8_t *group = vocabulary.codes + (size_t) g * vocabulary.chunks * 32;
+    __m256i low = _mm256_setzero_si256();
+    __m256i high = _mm256_setzero_si256();
+    for (int c = 0; c < vocabulary.chunks; c++) {
+      __m256i x = _mm256_set1_epi64x(query.widened[c]);
+      __m256i low_codes = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (group + c * 32)));
+      __m256i high_codes = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (group + c * 32 + 16)));
+      low = _mm256_add_epi32(low, _mm256_madd_epi16(low_codes, x));
+      high = _mm256_add_epi32(high, _mm256_madd_epi16(high_codes, x));
+    }
+    // low holds two partial sums for each of words 0-3 and high for words 4-7. Adding the pairs leaves words 0, 1, 4, 5
+    // in the lower 128 bits and 2, 3, 6, 7 in the upper, which the permute puts back in order
+    __m256i dots = _mm256_permute4x64_epi64(_mm256_hadd_epi32(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+    UpdateNearest(dots, vocabulary.norms + g * 8, two_t, index, best_distance, best_index);
+    index = _mm256_add_epi32(index, step);
+  }
+  return ReduceNearest(best_distance, best_index);
+}
+#endif
+
+#ifdef REVERSE_IMAGE_SEARCH_VNNI_KERNEL
+__attribute__((target("avx2,avx512vnni,avx512vl")))
+int NearestWordVnni(const KernelVocabulary &vocabulary, const KernelQuery &query) {
+  __m256 two_t = _mm256_set1_ps(query.two_t);
+  __m256 best_distance = _mm256_set1_ps(numeric_limits<float>::infinity());
+  __m256i best_index = _mm256_setzero_si256();
+  __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i step = _mm256_set1_epi32(8);
+  size_t group_bytes = (size_t) vocabulary.chunks * 32;
+  // 4 groups of words at a time, so 4 independent chains of dot products hide the latency of vpdpbusd
+  for (int g = 0; g < vocabulary.groups; g += 4) {
+    const int8_t *group = vocabulary.codes + g * group_bytes;
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    __m256i acc2 = _mm256_setzero_si256();
+    __m256i acc3 = _mm256_setzero_si256();
+    for (int c = 0; c < vocabulary.chunks; c++) {
+      __m256i x = _mm256_set1_epi32((int) query.offset[c]);
+      const int8_t *chunk = group + c * 32;
+      acc0 = _mm256_dpbusd_epi32(acc0, x, _mm256_loadu_si256((const __m256i *) chunk));
+      acc1 = _mm256_dpbusd_epi32(acc1, x, _mm256_loadu_si256((const __m256i *) (chunk + group_bytes)));
+      acc2 = _mm256_dpbusd_epi32(acc2, x, _mm256_loadu_si256((const __m256i *) (chunk + 2 * group_bytes)));
+      acc3 = _mm256_dpbusd_epi32(acc3, x, _mm256_loadu_si256((const __m256i *) (chunk + 3 * group_bytes)));
+    }
+
+    // (qx + 128) . qc = qx . qc + 128 * sum(qc)
+    __m256i accumulators[4] = {acc0, acc1, acc2, acc3};
+    for (int j = 0; j < 4; j++) {
+      __m256i offsets = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *) (vocabulary.code_sums + (g + j) * 8)), 7);
+      UpdateNearest(_mm256_sub_epi32(accumulators[j], offsets), vocabulary.norms + (g + j) * 8, two_t, index,
+                    best_distance, best_index);
+      index = _mm256_add_epi32(index, step);
+    }
+  }
+  return ReduceNearest(best_distance, best_index);
+}
+#endif
+
+NearestWordKernel KernelFunction(Int8Kernel kernel) {
+#ifdef REVERSE_IMAGE_SEARCH_VNNI_KERNEL
+  if (kernel == Int8Kernel::kVnni) {
+    return NearestWordVnni;
+  }
+#endif
+#ifdef REVERSE_IMAGE_SEARCH_X86_KERNELS
+  if (kernel == Int8Kernel::kAvx2) {
+    return NearestWordAvx2;
+  }
+#endif
+  return NearestWordScalar;
+}
+
+/**
+ * @param requested Int8Kernel the kernel asked for
+ * @return Int8Kernel the requested kernel if the CPU supports it, otherwise the fastest one it does
+ */
+Int8Kernel ResolveKernel(Int8Kernel requested) {
+  if (requested != Int8Kernel::kAuto && Int8KernelSupported(requested)) {
+    return requested;
+  }
+  if (Int8KernelSupported(Int8Kernel::kVnni)) {
+    return Int8Kernel::kVnni;
+  }
+  if (Int8KernelSupported(Int8Kernel::kAvx2)) {
+    return Int8Kernel::kAvx2;
+  }
+  return Int8Kernel::kScalar;
+}
+}
+
+/**
+ * @param kernel Int8Kernel a kernel
+ * @return const char* the kernel's name, for reports
+ */
+const char *Int8KernelName(Int8Kernel kernel) {
+  switch (kernel) {
+    case Int8Kernel::kScalar:
+      return "scalar";
+    case Int8Kernel::kAvx2:
+      return "avx2";
+    case Int8Kernel::kVnni:
+      return "vnni";
+    default:
+      return "auto";
+  }
+}
+
+/**
+ * @param kernel Int8Kernel a kernel
+ * @return bool true|false on whether or not the kernel was compiled in and the CPU can run it
+ */
+bool Int8KernelSupported(Int8Kernel kernel) {
+  if (kernel == Int8Kernel::kAuto || kernel == Int8Kernel::kScalar) {
+    return true;
+  }
+#ifdef REVERSE_IMAGE_SEARCH_X86_KERNELS
+  if (kernel == Int8Kernel::kAvx2) {
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+#ifdef REVERSE_IMAGE_SEARCH_VNNI_KERNEL
+  if (kernel == Int8Kernel::kVnni) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("avx512vnni") &&
+           __builtin_cpu_supports("avx512vl");
+  }
+#endif
+  return false;
+}
+
+/**
+ * Assigns one range of descriptor blocks. Each descriptor is quantized into the thread's own buffers and handed to the
+ * vocabulary's kernel.
+ */
+class QuantizedVocabulary::AssignBlocks : public cv::ParallelLoopBody {
+ public:
+  AssignBlocks(const QuantizedVocabulary &vocabulary, const cv::Mat &descriptors, int block_rows, int *out_labels)
+      : vocabulary_(vocabulary), descriptors_(descriptors), block_rows_(block_rows), out_labels_(out_labels) {}
+
+  void operator()(const cv::Range &blocks) const {
+    const QuantizedVocabulary &vocabulary = vocabulary_;
+    NearestWordKernel kernel = KernelFunction(vocabulary.kernel_);
+    int chunks = vocabulary.padded_dims_ / 4;
+    KernelVocabulary words = {vocabulary.codes_.data(), vocabulary.code_sums_.data(), vocabulary.norms_.data(),
+                              vocabulary.padded_words_ / 8, chunks};
+
+    // The padding dimensions stay 0, and meet zero codes
+    vector<float> scaled(vocabulary.dims_);
+    vector<int8_t> codes(vocabulary.padded_dims_, 0);
+    vector<int64_t> widened(chunks);
+    vector<uint32_t> offset(chunks);
+    KernelQuery query = {codes.data(), widened.data(), offset.data(), 0};
+
+    for (int block = blocks.start; block < blocks.end; block++) {
+      int start = block * block_rows_;
+      int end = min(start + block_rows_, descriptors_.rows);
+      for (int i = start; i < end; i++) {
+        const float *x = descriptors_.ptr<float>(i);
+        float peak = 0;
+        for (int d = 0; d < vocabulary.dims_; d++) {
+          scaled[d] = x[d] * vocabulary.scales_[d];
+          peak = max(peak, fabs(scaled[d]));
+        }
+        float t = peak > 0 ? peak / 127 : 1;
+        for (int d = 0; d < vocabulary.dims_; d++) {
+          codes[d] = QuantizeTo8(scaled[d] / t);
+        }
+        for (int c = 0; c < chunks; c++) {
+          int16_t wide[4];
+          uint8_t shifted[4];
+          for (int b = 0; b < 4; b++) {
+            wide[b] = codes[c * 4 + b];
+            shifted[b] = (uint8_t) (codes[c * 4 + b] + 128);
+          }
+          memcpy(&widened[c], wide, sizeof(wide));
+          memcpy(&offset[c], shifted, sizeof(shifted));
+        }
+        query.two_t = 2 * t;
+        out_labels_[i] = kernel(words, query);
+      }
+    }
+  }
+
+ private:
+  const QuantizedVocabulary &vocabulary_;
+  const cv::Mat &descriptors_;
+  int block_rows_;
+  int *out_labels_;
+};
+
+/**
+ * Quantizes a vocabulary. Should be done once per vocabulary and reused for every call to Assign()
+ * @param vocabulary cv::Mat the CV_32F vocabulary, one word per row
+ * @param kernel Int8Kernel the dot product kernel to use. Falls back to the fastest supported kernel if the CPU cannot
+ * run the requested one. Default is kAuto
+ */
+QuantizedVocabulary::QuantizedVocabulary(const cv::Mat &vocabulary, Int8Kernel kernel)
+    : words_(vocabulary.rows), padded_words_((vocabulary.rows + 31) / 32 * 32), dims_(vocabulary.cols),
+      padded_dims_((vocabulary.cols + 3) / 4 * 4), kernel_(ResolveKernel(kernel)) {
+  assert(vocabulary.type() == CV_32F);
+
+  scales_.assign(dims_, 0);
+  for (int w = 0; w < words_; w++) {
+    const float *word = vocabulary.ptr<float>(w);
+    for (int d = 0; d < dims_; d++) {
+      scales_[d] = max(scales_[d], fabs(word[d]));
+    }
+  }
+  for (float &scale : scales_) {
+    scale = scale > 0 ? scale / 127 : 1;
+  }
+
+  int chunks = padded_dims_ / 4;
+  codes_.assign((size_t) padded_words_ * padded_dims_, 0);
+  code_sums_.assign(padded_words_, 0);
+  norms_.assign(padded_words_, numeric_limits<float>::max());
+  for (int w = 0; w < words_; w++) {
+    const float *word = vocabulary.ptr<float>(w);
+    // Groups of 8 words x 4 dimensions, one after the other, each laid out word by word
+    int8_t *group = codes_.data() + (size_t) (w / 8) * chunks * 32 + (w % 8) * 4;
+    norms_[w] = 0;
+    for (int d = 0; d < dims_; d++) {
+      int8_t code = QuantizeTo8(word[d] / scales_[d]);
+      group[(d / 4) * 32 + d % 4] = code;
+      code_sums_[w] += code;
+      float value = code * scales_[d];
+      norms_[w] += value * value;
+    }
+  }
+}
+
+/**
+ * Finds the nearest word of every descriptor using the quantized vocabulary
+ * @param descriptors cv::Mat the CV_32F descriptors to assign, one per row
+ * @param out_labels vector<int> the index of the nearest word of each descriptor
+ * @param block_rows int the number of descriptors handed to a thread at once. Default is 256
+ */
+void QuantizedVocabulary::Assign(const cv::Mat &descriptors, vector<int> &out_labels, int block_rows) const {
+  assert(descriptors.type() == CV_32F && descriptors.cols == dims_);
+  out_labels.resize(descriptors.rows);
+  if (descriptors.rows == 0) {
+    return;
+  }
+
+  int blocks = (descriptors.rows + block_rows - 1) / block_rows;
+  AssignBlocks body(*this, descriptors, block_rows, out_labels.data());
+  // A typical image fits in a single block, which is not worth handing off to other threads
+  if (blocks == 1) {
+    body(cv::Range(0, 1));
+  } else {
+    cv::parallel_for_(cv::Range(0, blocks), body);
+  }
+}
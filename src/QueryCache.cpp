@@ -0,0 +1,191 @@
+/**
+ * QueryCache.cpp
+ *
+ * A result cache placed in front of the query path. A large share of query traffic is repeated or near-identical
+ * images, such as re-uploads and thumbnails, and each one would otherwise pay for SURF extraction, encoding and
+ * classification again. The cache is keyed by the difference hash (dHash) of the decoded image: the image is shrunk to
+ * 9x8 grey pixels and each bit records whether a pixel is brighter than its right-hand neighbour. The hash survives
+ * re-encoding, rescaling and small brightness changes, and costs a single resize of the image.
+ */
+#include <cstdlib>
+#include <sstream>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "QueryCache.hpp"
+
+using namespace std;
+
+namespace {
+string ToHex(uint64_t value) {
+  ostringstream out;
+  out << hex;
+  out.width(16);
+  out.fill('0');
+  out << value;
+  return out.str();
+}
+}
+
+/**
+ * Computes the 64-bit difference hash of an image
+ * @param image cv::Mat the decoded BGR or greyscale image
+ * @return uint64_t the hash, one bit per pair of horizontally adjacent pixels of the 9x8 thumbnail
+ */
+uint64_t ComputeDHash(const cv::Mat &image) {
+  cv::Mat grey;
+  if (image.channels() == 3) {
+    cv::cvtColor(image, grey, cv::COLOR_BGR2GRAY);
+  } else if (image.channels() == 4) {
+    cv::cvtColor(image, grey, cv::COLOR_BGRA2GRAY);
+  } else {
+    grey = image;
+  }
+
+  cv::Mat thumbnail;
+  // INTER_AREA averages over each cell, so the hash does not depend on the resolution of the image
+  cv::resize(grey, thumbnail, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+
+  uint64_t hash = 0;
+  for (int y = 0; y < 8; y++) {
+    const uchar *row = thumbnail.ptr<uchar>(y);
+    for (int x = 0; x < 8; x++) {
+      hash = (hash << 1) | (row[x] > row[x + 1] ? 1 : 0);
+    }
+  }
+  return hash;
+}
+
+/**
+ * @param capacity size_t the maximum number of results to hold. Default is 1024
+ * @param generation std::string the generation of the index the results will come from
+ */
+QueryCache::QueryCache(size_t capacity, const string &generation) : capacity_(capacity), generation_(generation) {}
+
+/**
+ * Looks up the result of a query, marking it as the most recently used entry on a hit
+ * @param key uint64_t the ComputeDHash() of the query image
+ * @param out_match std::string the cached result, set on a hit
+ * @return bool true|false on whether or not the result was cached
+ */
+bool QueryCache::Lookup(uint64_t key, string &out_match) {
+  lock_guard<mutex> lock(mutex_);
+  unordered_map<uint64_t, EntryList::iterator>::iterator found = index_.find(key);
+  if (found == index_.end()) {
+    stats_.misses++;
+    return false;
+  }
+
+  entries_.splice(entries_.begin(), entries_, found->second);
+  out_match = found->second->second;
+  stats_.hits++;
+  return true;
+}
+
+/**
+ * Stores the result of a query, evicting the least recently used entry if the cache is full
+ * @param key uint64_t the ComputeDHash() of the query image
+ * @param match std::string the result of the query
+ */
+void QueryCache::Insert(uint64_t key, const string &match) {
+  lock_guard<mutex> lock(mutex_);
+  InsertLocked(key, match);
+}
+
+void QueryCache::InsertLocked(uint64_t key, const string &match) {
+  if (capacity_ == 0) {
+    return;
+  }
+
+  unordered_map<uint64_t, EntryList::iterator>::iterator found = index_.find(key);
+  if (found != index_.end()) {
+    found->second->second = match;
+    entries_.splice(entries_.begin(), entries_, found->second);
+    return;
+  }
+
+  if (entries_.size() >= capacity_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+    stats_.evictions++;
+  }
+  entries_.push_front(make_pair(key, match));
+  index_[key] = entries_.begin();
+}
+
+/**
+ * Moves the cache to a new index generation. Every cached result is dropped if the generation changed, as it may no
+ * longer be what the rebuilt index would return.
+ * @param generation std::string the generation of the index now being queried
+ */
+void QueryCache::SetGeneration(const string &generation) {
+  lock_guard<mutex> lock(mutex_);
+  if (generation == generation_) {
+    return;
+  }
+  generation_ = generation;
+  if (!entries_.empty()) {
+    entries_.clear();
+    index_.clear();
+    stats_.invalidations++;
+  }
+}
+
+QueryCacheStats QueryCache::stats() const {
+  lock_guard<mutex> lock(mutex_);
+  return stats_;
+}
+
+size_t QueryCache::size() const {
+  lock_guard<mutex> lock(mutex_);
+  return entries_.size();
+}
+
+/**
+ * Writes the cached results and their generation to disk so they survive a restart
+ * @param file_path std::string the relative path to write the cache to. Expects a .yml file
+ * @return bool true|false on whether or not the file could be opened
+ */
+bool QueryCache::WriteToDisk(const string &file_path) const {
+  lock_guard<mutex> lock(mutex_);
+  cv::FileStorage fs(file_path, cv::FileStorage::WRITE);
+  if (!fs.isOpened()) {
+    return false;
+  }
+
+  fs << "generation" << generation_;
+  // Least recently used first, so reading the entries back in order restores the same recency order
+  fs << "entries" << "[";
+  for (EntryList::const_reverse_iterator itr = entries_.rbegin(); itr != entries_.rend(); ++itr) {
+    fs << "{" << "hash" << ToHex(itr->first) << "match" << itr->second << "}";
+  }
+  fs << "]";
+  fs.release();
+  return true;
+}
+
+/**
+ * Restores the results written by WriteToDisk(). Nothing is restored if they belong to a different generation than the
+ * cache's current one.
+ * @param file_path std::string the relative path to the cache file
+ * @return bool true|false on whether or not any results were restored
+ */
+bool QueryCache::ReadFromDisk(const string &file_path) {
+  cv::FileStorage fs(file_path, cv::FileStorage::READ);
+  if (!fs.isOpened()) {
+    return false;
+  }
+
+  lock_guard<mutex> lock(mutex_);
+  if ((string) fs["generation"] != generation_) {
+    return false;
+  }
+
+  cv::FileNode entries = fs["entries"];
+  for (cv::FileNodeIterator itr = entries.begin(); itr != entries.end(); ++itr) {
+    string hash = (string) (*itr)["hash"];
+    InsertLocked(strtoull(hash.c_str(), nullptr, 16), (string) (*itr)["match"]);
+  }
+  fs.release();
+  return !entries_.empty();
+}
@@ -0,0 +1,428 @@
+/**
+ * QueryEngine.cpp
+ *
+ * The query path packaged as an object that can be embedded in a multi-threaded service. TestSVM() reads the predicted
+ * class's histograms back from data/histograms/ and walks data/images/ on every query to resolve the match, and the
+ * stage functions around it log to cout. The engine instead loads everything a query needs once, from configurable
+ * paths, and holds it read only:
+ *
+ *   vocabulary + centroid norms   -> Bag of Visual Words histogram of the query (see Assignment.cpp)
+ *   SVM                           -> the predicted class
+ *   per class normalized rows     -> cross-correlation of the query against each image of that class
+ *   per class image paths         -> the path of the best scoring image
+ *
+ * Everything a query writes goes into a QueryScratch owned by the calling thread.
+ *
+ * Searching only the predicted class makes a misclassified query a certain miss, while scanning the whole database is
+ * too slow. With probe_classes > 1 the engine evaluates the SVM's one-vs-one decision functions itself, ranks every
+ * class by its votes (first the class predict() would return, then the summed decision values breaking ties) and
+ * searches the classes in that order until the probe budget in QueryEngineConfig runs out. Each class also keeps the
+ * centroid and radius of its histograms, which bound the best score any of its images can reach, so a class that
+ * cannot beat the match found so far by a safe margin is skipped without being scored.
+ *
+ * Histogram scores ignore where each word was found. With rerank_top_n > 0 the best scoring images of every probed
+ * class are verified geometrically against the query's key points (see GeometricIndex.cpp), using the key points and
+ * words stored at index time so no database image is read again.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <boost/filesystem.hpp>
+
+#include "Assignment.hpp"
+#include "BatchQuery.hpp"
+#include "GeometricIndex.hpp"
+#include "Histogram.hpp"
+#include "Keypoints.hpp"
+#include "QuantizedVocabulary.hpp"
+#include "QueryEngine.hpp"
+#include "SVM.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+/**
+ * Loads a query engine
+ * @param config QueryEngineConfig the paths of the artifacts to load
+ * @param out_error std::string if not null, set to the reason the engine could not be loaded
+ * @return cv::Ptr<QueryEngine> the loaded engine, or an empty pointer if an artifact is missing or inconsistent
+ */
+cv::Ptr<QueryEngine> QueryEngine::Create(const QueryEngineConfig &config, string *out_error) {
+  cv::Ptr<QueryEngine> engine(new QueryEngine());
+  string error;
+  if (!engine->Load(config, error)) {
+    if (out_error != nullptr) {
+      *out_error = error;
+    }
+    return cv::Ptr<QueryEngine>();
+  }
+  return engine;
+}
+
+bool QueryEngine::Load(const QueryEngineConfig &config, string &out_error) {
+  config_ = config;
+  const string required[] = {config.vocabulary_path, config.predictor_path, config.training_data_path,
+                             config.image_index_path, config.histograms_dir};
+  for (const string &file_path : required) {
+    if (!boost::filesystem::exists(file_path)) {
+      out_error = file_path + " does not exist";
+      return false;
+    }
+  }
+
+  // Read directly rather than with ReadVocabularyFromDisk(), which logs to cout
+  cv::FileStorage fs(config.vocabulary_path, cv::FileStorage::READ);
+  fs["vocabulary"] >> vocabulary_;
+  fs.release();
+  if (vocabulary_.empty() || vocabulary_.type() != CV_32F) {
+    out_error = config.vocabulary_path + " does not hold a CV_32F vocabulary";
+    return false;
+  }
+  centroid_norms_ = ComputeCentroidNorms(vocabulary_);
+  if (config.quantized_assignment) {
+    quantized_vocabulary_ = QuantizedVocabulary(vocabulary_);
+  }
+
+  svm_ = cv::Algorithm::load<cv::ml::SVM>(config.predictor_path);
+  if (svm_.empty() || !svm_->isTrained()) {
+    out_error = config.predictor_path + " does not hold a trained SVM";
+    return false;
+  }
+  if (config.probe_classes > 1 && !LoadDecisionFunctions()) {
+    // Fall back to probing only the predicted class
+    decision_functions_.clear();
+  }
+
+  string training_data_path = config.training_data_path;
+  cv::Mat histograms = NormalizeForCorrelation(ReadSVMTrainingDataFromDisk(training_data_path));
+  images_ = ReadImageIndexFromDisk(config.image_index_path);
+  if (histograms.rows != (int) images_.size() || histograms.cols != vocabulary_.rows) {
+    out_error = config.training_data_path + " does not match " + config.image_index_path + " and the vocabulary";
+    return false;
+  }
+
+  // Group the database rows by the SVM class they were trained under, so a query only scores its predicted class
+  vector<string> classes = utils::Utility::get_classes(config.histograms_dir);
+  class_histograms_.assign(classes.size(), cv::Mat());
+  class_rows_.assign(classes.size(), vector<int>());
+  for (size_t i = 0; i < images_.size(); i++) {
+    string label = utils::Utility::get_image_label(images_[i]);
+    for (size_t c = 0; c < classes.size(); c++) {
+      if (classes[c] == label) {
+        class_histograms_[c].push_back(histograms.row((int) i));
+        class_rows_[c].push_back((int) i);
+        break;
+      }
+    }
+  }
+
+  class_centroids_ = cv::Mat::zeros((int) classes.size(), histograms.cols, CV_32F);
+  class_radii_.assign(classes.size(), 0);
+  for (size_t c = 0; c < classes.size(); c++) {
+    if (class_histograms_[c].empty()) {
+      continue;
+    }
+    cv::Mat centroid = class_centroids_.row((int) c);
+    cv::reduce(class_histograms_[c], centroid, 0, cv::REDUCE_AVG);
+    for (int i = 0; i < class_histograms_[c].rows; i++) {
+      class_radii_[c] = max(class_radii_[c], (float) cv::norm(class_histograms_[c].row(i), centroid, cv::NORM_L2));
+    }
+  }
+
+  if (config.rerank_top_n > 0) {
+    if (!geometry_.ReadFromDisk(config.geometry_path)) {
+      out_error = config.geometry_path + " does not hold a geometric index, encode with --geometry";
+      return false;
+    }
+    if (geometry_.image_count() != images_.size()) {
+      out_error = config.geometry_path + " does not match " + config.image_index_path;
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Unpacks the SVM's one-vs-one decision functions so every class can be ranked, rather than only the winner being
+ * returned by cv::ml::SVM::predict()
+ * @return bool true|false on whether or not the SVM is a multi-class C_SVC with a supported (RBF or linear) kernel
+ */
+bool QueryEngine::LoadDecisionFunctions() {
+  int kernel = svm_->getKernelType();
+  if (svm_->getType() != cv::ml::SVM::C_SVC || (kernel != cv::ml::SVM::RBF && kernel != cv::ml::SVM::LINEAR)) {
+    return false;
+  }
+
+  // The labels are not exposed by cv::ml::SVM, but are stored alongside the model
+  cv::Mat labels;
+  cv::FileStorage fs(config_.predictor_path, cv::FileStorage::READ);
+  fs["opencv_ml_svm"]["class_labels"] >> labels;
+  fs.release();
+  if (labels.total() < 2) {
+    return false;
+  }
+  labels.convertTo(labels, CV_32S);
+  labels.reshape(1, 1).copyTo(class_labels_);
+
+  svm_->getSupportVectors().convertTo(support_vectors_, CV_32F);
+  support_vector_norms_ = ComputeCentroidNorms(support_vectors_);
+
+  // Decision functions are numbered over the class pairs (i, j), i < j, in the same order cv::ml::SVM trains them
+  int class_count = (int) class_labels_.size();
+  for (int i = 0; i < class_count; i++) {
+    for (int j = i + 1; j < class_count; j++) {
+      DecisionFunction function;
+      function.first_class = i;
+      function.second_class = j;
+      function.rho = svm_->getDecisionFunction((int) decision_functions_.size(), function.alpha,
+                                               function.support_vector_index);
+      function.alpha.convertTo(function.alpha, CV_64F);
+      decision_functions_.push_back(function);
+    }
+  }
+  return true;
+}
+
+/**
+ * Ranks every class for a query histogram, most likely first. Reproduces the voting of cv::ml::SVM::predict(), so the
+ * first class is the one predict() returns, which among classes with the same number of votes is the lowest. The other
+ * classes with the same number of votes are ordered by the sum of their decision values.
+ * @param histogram cv::Mat the query's Bag of Visual Words histogram
+ * @param scratch QueryScratch the calling thread's working memory. Receives the ranking in class_order, as SVM labels.
+ * Holds only the predicted class if the SVM's kernel cannot be ranked
+ */
+void QueryEngine::RankClasses(const cv::Mat &histogram, QueryScratch &scratch) const {
+  if (decision_functions_.empty()) {
+    scratch.class_order.assign(1, (int) svm_->predict(histogram));
+    return;
+  }
+
+  // k(x, sv) against every support vector. For RBF, ||x - sv||^2 is expanded around the product as in Assignment.cpp
+  cv::gemm(histogram, support_vectors_, 1.0, cv::noArray(), 0.0, scratch.kernel_values, cv::GEMM_2_T);
+  if (svm_->getKernelType() == cv::ml::SVM::RBF) {
+    float gamma = (float) svm_->getGamma();
+    float x_norm = (float) histogram.dot(histogram);
+    float *values = scratch.kernel_values.ptr<float>(0);
+    const float *sv_norms = support_vector_norms_.ptr<float>(0);
+    for (int k = 0; k < scratch.kernel_values.cols; k++) {
+      values[k] = -gamma * max(0.0f, x_norm + sv_norms[k] - 2 * values[k]);
+    }
+    cv::exp(scratch.kernel_values, scratch.kernel_values);
+  }
+
+  int class_count = (int) class_labels_.size();
+  scratch.votes.assign(class_count, 0);
+  scratch.confidence.assign(class_count, 0);
+  const float *values = scratch.kernel_values.ptr<float>(0);
+  for (const DecisionFunction &function : decision_functions_) {
+    const double *alpha = function.alpha.ptr<double>(0);
+    const int *index = function.support_vector_index.ptr<int>(0);
+    double sum = -function.rho;
+    for (size_t k = 0; k < function.alpha.total(); k++) {
+      sum += alpha[k] * values[index[k]];
+    }
+    scratch.votes[sum > 0 ? function.first_class : function.second_class]++;
+    scratch.confidence[function.first_class] += sum;
+    scratch.confidence[function.second_class] -= sum;
+  }
+
+  scratch.class_order.resize(class_count);
+  for (int i = 0; i < class_count; i++) {
+    scratch.class_order[i] = i;
+  }
+  const vector<int> &votes = scratch.votes;
+  const vector<double> &confidence = scratch.confidence;
+  sort(scratch.class_order.begin(), scratch.class_order.end(), [&votes, &confidence](int a, int b) {
+    return votes[a] != votes[b] ? votes[a] > votes[b] : confidence[a] > confidence[b];
+  });
+  // predict() takes the first class with the most votes, so probing more classes never changes the predicted one
+  int predicted = (int) (max_element(votes.begin(), votes.end()) - votes.begin());
+  vector<int>::iterator winner = find(scratch.class_order.begin(), scratch.class_order.end(), predicted);
+  rotate(scratch.class_order.begin(), winner, winner + 1);
+  for (int &position : scratch.class_order) {
+    position = class_labels_[position];
+  }
+}
+
+/**
+ * The highest score any image of a class can reach against a query. Every normalized histogram of the class lies within
+ * the class's radius of its centroid, and the query has at most unit length, so its dot product with one of them is at
+ * most its dot product with the centroid plus the radius.
+ * @param label int the SVM label of the class
+ * @param normalized_histogram cv::Mat the query's histogram, normalized with NormalizeForCorrelation()
+ * @return float an upper bound on the class's scores
+ */
+float QueryEngine::ClassScoreBound(int label, const cv::Mat &normalized_histogram) const {
+  return (float) normalized_histogram.dot(class_centroids_.row(label)) + class_radii_[label];
+}
+
+/**
+ * Finds the best match for a decoded query image. May be called from many threads at once, each with its own scratch
+ * @param image cv::Mat the decoded query image
+ * @param scratch QueryScratch the calling thread's working memory
+ * @param out_result QueryResult the best match
+ */
+void QueryEngine::Query(const cv::Mat &image, QueryScratch &scratch, QueryResult &out_result) const {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  out_result = QueryResult();
+  if (image.empty()) {
+    return;
+  }
+
+  scratch.key_points = DetectKeyPoints(image, config_.keypoint_policy, scratch.surf, &out_result.keypoints);
+  if (scratch.key_points.empty()) {
+    return;
+  }
+  chrono::steady_clock::time_point descriptor_start = chrono::steady_clock::now();
+  scratch.surf->compute(image, scratch.key_points, scratch.descriptors);
+  out_result.descriptor_seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - descriptor_start).count();
+  if (scratch.descriptors.rows == 0) {
+    return;
+  }
+
+  // The same histogram as ComputeBowHistogram(), built into the scratch buffers
+  if (config_.quantized_assignment) {
+    quantized_vocabulary_.Assign(scratch.descriptors, scratch.labels);
+  } else {
+    AssignToNearestCentroids(scratch.descriptors, vocabulary_, centroid_norms_, scratch.labels);
+  }
+  scratch.histogram.create(1, vocabulary_.rows, CV_32F);
+  scratch.histogram.setTo(0);
+  float *bins = scratch.histogram.ptr<float>(0);
+  for (int label : scratch.labels) {
+    bins[label] += 1;
+  }
+  scratch.histogram /= scratch.descriptors.rows;
+
+  // Ranking every class costs the same kernel evaluations as predict(), so is only done when more than one is probed
+  if (config_.probe_classes > 1 && !decision_functions_.empty()) {
+    RankClasses(scratch.histogram, scratch);
+  } else {
+    scratch.class_order.assign(1, (int) svm_->predict(scratch.histogram));
+  }
+  out_result.predicted_class = scratch.class_order[0];
+
+  scratch.normalized_histogram = NormalizeForCorrelation(scratch.histogram);
+  scratch.candidates.clear();
+  bool rerank = config_.rerank_top_n > 0;
+  double best_score = -numeric_limits<double>::max();
+  int probes = min(max(1, config_.probe_classes), (int) scratch.class_order.size());
+  for (int probe = 0; probe < probes; probe++) {
+    int label = scratch.class_order[probe];
+    if (label < 0 || label >= (int) class_histograms_.size() || class_histograms_[label].empty()) {
+      continue;
+    }
+    const cv::Mat &candidates = class_histograms_[label];
+
+    // The first class is always searched, after that the budget decides
+    if (out_result.classes_probed > 0) {
+      double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+      if ((config_.probe_time_ms > 0 && elapsed_ms >= config_.probe_time_ms) ||
+          (config_.probe_rows > 0 && out_result.rows_scored + candidates.rows > config_.probe_rows)) {
+        break;
+      }
+      if (config_.probe_safe_score > 0 &&
+          ClassScoreBound(label, scratch.normalized_histogram) <= best_score + config_.probe_safe_score) {
+        out_result.classes_skipped++;
+        continue;
+      }
+    }
+
+    // Cross-correlation of the query against every image of the class, as a single matrix-vector product
+    cv::gemm(candidates, scratch.normalized_histogram, 1.0, cv::noArray(), 0.0, scratch.scores, cv::GEMM_2_T);
+    cv::Point best;
+    double score = 0;
+    cv::minMaxLoc(scratch.scores, nullptr, &score, nullptr, &best);
+    out_result.classes_probed++;
+    out_result.rows_scored += candidates.rows;
+    if (score > best_score) {
+      best_score = score;
+      out_result.match = images_[class_rows_[label][best.y]];
+      out_result.score = (float) score;
+      out_result.matched_class = label;
+    }
+
+    if (rerank) {
+      const float *scores = scratch.scores.ptr<float>(0);
+      for (int i = 0; i < candidates.rows; i++) {
+        QueryCandidate candidate = {class_rows_[label][i], label, scores[i], 0};
+        scratch.candidates.push_back(candidate);
+      }
+    }
+  }
+
+  if (rerank && !scratch.candidates.empty()) {
+    Rerank(scratch, out_result);
+  }
+}
+
+/**
+ * Verifies the best scoring candidates geometrically, in score order until the re-rank budget is spent, and replaces
+ * the match with the verified candidate with the most inliers. The match is left alone if no candidate reaches
+ * rerank_min_inliers.
+ * @param scratch QueryScratch the calling thread's working memory, holding the query's key points, their words and the
+ * scored candidates
+ * @param out_result QueryResult the result to update
+ */
+void QueryEngine::Rerank(QueryScratch &scratch, QueryResult &out_result) const {
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<QueryCandidate> &candidates = scratch.candidates;
+  size_t top_n = min((size_t) config_.rerank_top_n, candidates.size());
+  partial_sort(candidates.begin(), candidates.begin() + top_n, candidates.end(),
+               [](const QueryCandidate &a, const QueryCandidate &b) {
+    return a.score > b.score;
+  });
+  QuantizeFeatures(scratch.key_points, scratch.labels, scratch.features);
+
+  const QueryCandidate *best = nullptr;
+  for (size_t i = 0; i < top_n; i++) {
+    double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    if (config_.rerank_time_ms > 0 && elapsed_ms >= config_.rerank_time_ms) {
+      out_result.rerank_timed_out = true;
+      break;
+    }
+
+    QueryCandidate &candidate = candidates[i];
+    size_t feature_count = 0;
+    const GeometricFeature *features = geometry_.ImageFeatures((size_t) candidate.row, feature_count);
+    candidate.inliers = VerifyGeometry(scratch.features.data(), scratch.features.size(), features, feature_count,
+                                       config_.verification, scratch.correspondences);
+    out_result.candidates_verified++;
+    // Candidates are in score order, so on equal inliers the better scoring one is kept
+    if (candidate.inliers >= config_.rerank_min_inliers && (best == nullptr || candidate.inliers > best->inliers)) {
+      best = &candidate;
+    }
+  }
+
+  if (best != nullptr) {
+    out_result.match = images_[best->row];
+    out_result.score = best->score;
+    out_result.matched_class = best->class_label;
+    out_result.inliers = best->inliers;
+  }
+}
+
+/**
+ * Finds the best match for a decoded query image, using working memory reused by every query on the calling thread
+ * @param image cv::Mat the decoded query image
+ * @return QueryResult the best match
+ */
+QueryResult QueryEngine::Query(const cv::Mat &image) const {
+  static thread_local QueryScratch scratch;
+  QueryResult result;
+  Query(image, scratch, result);
+  return result;
+}
+
+/**
+ * Finds the best match for a query image on disk
+ * @param image_path std::string the path to the query image
+ * @return QueryResult the best match. The match is empty if the image could not be read
+ */
+QueryResult QueryEngine::QueryFile(const string &image_path) const {
+  return Query(cv::imread(image_path));
+}
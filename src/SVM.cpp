@@ -20,14 +20,15 @@ using namespace boost::filesystem;
 
 /**
  * Reads the existing SVM training data from disk. Rows are histograms which correspond to a particular image.
- * @param file_path
- * @return
+ * @param file_path std::string the relative file path to the training data written by WriteSVMTrainingDataToDisk()
+ * @return cv::Mat the concatenated histograms
  */
 cv::Mat ReadSVMTrainingDataFromDisk(string &file_path) {
   cv::Mat training_data;
   cv::FileStorage fs(file_path, cv::FileStorage::READ);
   fs["svm_training"] >> training_data;
   fs.release();
+  return training_data;
 }
 
 /**
@@ -36,7 +37,7 @@ cv::Mat ReadSVMTrainingDataFromDisk(string &file_path) {
  * @param training_data cv::Mat the concatenated histograms to write to disk
  */
 void WriteSVMTrainingDataToDisk(string &file_path, cv::Mat &training_data) {
-  if (!exists("data/classifer")) {
+  if (!exists("data/classifier")) {
     create_directory("data/classifier");
   }
 
@@ -51,15 +52,15 @@ void WriteSVMTrainingDataToDisk(string &file_path, cv::Mat &training_data) {
 }
 
 /**
- * Trains the SVM with Bag of Visual Words histograms
+ * Reads the histograms of every class, labelled with the position of their class in the listing of class_file_path
  * @param class_file_path std::string the path to the directory containing the image histograms (i.e, data/histograms/)
- * @param response_cols int the number of columns that the training data have (for SURF this would be 64 as 64 feature
- * descriptors are extracted)
- * @param response_type int the type of the matrix to construct. See the OpenCV documentation for further explanation on
- * what the int values correspond to
- * @param out_svm cv::Ptr<cv::ml::SVM> the trained SVM to use for a prediction
+ * @param response_cols int the number of columns that the training data have
+ * @param response_type int the type of the matrix to construct
+ * @param out_samples cv::Mat the histograms, one per row
+ * @param out_labels cv::Mat the CV_32S class label of each row
  */
-void TrainSVM(const string &class_file_path, int response_cols, int response_type, cv::Ptr<cv::ml::SVM> &out_svm) {
+void ReadSVMTrainingSet(const string &class_file_path, int response_cols, int response_type, cv::Mat &out_samples,
+                        cv::Mat &out_labels) {
   vector<string> classes = utils::Utility::get_classes(class_file_path);
 
   cv::Mat samples(0, response_cols, response_type);
@@ -71,6 +72,23 @@ void TrainSVM(const string &class_file_path, int response_cols, int response_typ
     cv::Mat class_label = cv::Mat(training_data.rows, 1, CV_32SC1, i);
     labels.push_back(class_label);
   }
+  samples.convertTo(out_samples, response_type);
+  out_labels = labels;
+}
+
+/**
+ * Trains the SVM with Bag of Visual Words histograms
+ * @param class_file_path std::string the path to the directory containing the image histograms (i.e, data/histograms/)
+ * @param response_cols int the number of columns that the training data have (for SURF this would be 64 as 64 feature
+ * descriptors are extracted)
+ * @param response_type int the type of the matrix to construct. See the OpenCV documentation for further explanation on
+ * what the int values correspond to
+ * @param out_svm cv::Ptr<cv::ml::SVM> the trained SVM to use for a prediction
+ */
+void TrainSVM(const string &class_file_path, int response_cols, int response_type, cv::Ptr<cv::ml::SVM> &out_svm) {
+  cv::Mat samples;
+  cv::Mat labels;
+  ReadSVMTrainingSet(class_file_path, response_cols, response_type, samples, labels);
   if (exists("predictor.yml")) {
     cout << "Trained SVM already found, loading..." << endl;
     out_svm = out_svm->load("predictor.yml");
@@ -78,9 +96,7 @@ void TrainSVM(const string &class_file_path, int response_cols, int response_typ
 
   } else {
     cout << "Trained SVM not found, training..." << endl;
-    cv::Mat samples_32f;
-    samples.convertTo(samples_32f, response_type);
-    out_svm->train(samples_32f, cv::ml::ROW_SAMPLE, labels);
+    out_svm->train(samples, cv::ml::ROW_SAMPLE, labels);
     out_svm->save("predictor.yml");
   }
 }
@@ -103,7 +119,6 @@ string TestSVM(cv::Mat &test_img, cv::Ptr<cv::ml::SVM> &svm) {
   // TODO: Refactor this cross-correlation computation for the most similar image into utils.cpp
   vector<string> classes = utils::Utility::get_classes("data/histograms/");
   cv::Mat class_hists = ReadClassHistogramsFromDisk("data/histograms/", classes[(int)res]);
-  cout << res << endl;
   double max = -9999;
   int max_index = 0;
   for (int i = 0; i < class_hists.rows; i++) {
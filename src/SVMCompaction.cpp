@@ -0,0 +1,483 @@
+/**
+ * SVMCompaction.cpp
+ *
+ * Shrinks a trained RBF SVM into a reduced set model that predicts with far fewer support vectors. Every one-vs-one
+ * decision function of cv::ml::SVM
+ *
+ *   f(x) = sum_i alpha_i k(x, s_i) - rho
+ *
+ * is the dot product of phi(x) with w = sum_i alpha_i phi(s_i) in the kernel's feature space. The reduced model
+ * replaces the support vectors of each class with the k-means centers z_j of them (see ClusterDescriptors()), and picks
+ * the weights beta that bring sum_j beta_j phi(z_j) closest to w. Minimizing that distance is the linear system
+ *
+ *   K_zz beta = K_zs alpha
+ *
+ * where K_zz holds k(z_j, z_l) and K_zs holds k(z_j, s_i). The decision function between classes a and b only uses the
+ * centers of a and b, as the original only used the support vectors of a and b, so a prediction still evaluates the
+ * kernel once per center and each decision function only sums over two classes' centers.
+ *
+ * The reduced model is written in the format cv::ml::SVM::save() uses, so it loads with cv::Algorithm::load() in place
+ * of predictor.yml. There is no held out data, so the accuracy lost is measured on a sample of the training histograms.
+ */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+
+#include "Assignment.hpp"
+#include "SVMCompaction.hpp"
+
+using namespace std;
+
+namespace {
+// Keeps K_zz positive definite when centers are nearly identical, as the histograms of near duplicate images are
+const double kRidge = 1e-6;
+
+/**
+ * One of the one-vs-one decision functions, separating first_class (positive) from second_class
+ */
+struct DecisionFunction {
+  int first_class;
+  int second_class;
+  double rho;
+  // CV_64F weights, and the CV_32S row of the support vector each weight applies to
+  cv::Mat alpha;
+  cv::Mat index;
+};
+
+double ElapsedMs(chrono::steady_clock::time_point start) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Computes the RBF kernel k(a, b) = exp(-gamma ||a - b||^2) of every pair of rows. ||a - b||^2 is expanded around a
+ * matrix product as in Assignment.cpp, in double precision since the histograms are close together and their kernel
+ * values close to 1
+ * @param a cv::Mat the CV_32F rows of the first operand
+ * @param b cv::Mat the CV_32F rows of the second operand
+ * @param gamma double the kernel's gamma
+ * @return cv::Mat the a.rows x b.rows CV_64F kernel values
+ */
+cv::Mat RbfKernel(const cv::Mat &a, const cv::Mat &b, double gamma) {
+  cv::Mat a_64f;
+  cv::Mat b_64f;
+  a.convertTo(a_64f, CV_64F);
+  b.convertTo(b_64f, CV_64F);
+  cv::Mat values;
+  cv::gemm(a_64f, b_64f, 1.0, cv::noArray(), 0.0, values, cv::GEMM_2_T);
+
+  vector<double> b_norms(b.rows);
+  for (int j = 0; j < b.rows; j++) {
+    b_norms[j] = b_64f.row(j).dot(b_64f.row(j));
+  }
+  for (int i = 0; i < values.rows; i++) {
+    double a_norm = a_64f.row(i).dot(a_64f.row(i));
+    double *row = values.ptr<double>(i);
+    for (int j = 0; j < values.cols; j++) {
+      row[j] = -gamma * max(0.0, a_norm + b_norms[j] - 2 * row[j]);
+    }
+  }
+  cv::exp(values, values);
+  return values;
+}
+
+/**
+ * Computes the right hand side K_zs alpha of every decision function one class at a time, filling in the rows that
+ * belong to that class's centers. Only one class's rows of K_zs are held at once.
+ */
+class ProjectClasses : public cv::ParallelLoopBody {
+ public:
+  ProjectClasses(const cv::Mat &support_vectors, const cv::Mat &centers, const vector<int> &center_offsets,
+                 double gamma, const vector<DecisionFunction> &functions, vector<cv::Mat> &out_projections)
+      : support_vectors_(support_vectors), centers_(centers), center_offsets_(center_offsets), gamma_(gamma),
+        functions_(functions), out_projections_(out_projections) {}
+
+  void operator()(const cv::Range &classes) const {
+    for (int c = classes.start; c < classes.end; c++) {
+      int start = center_offsets_[c];
+      int end = center_offsets_[c + 1];
+      if (start == end) {
+        continue;
+      }
+      cv::Mat kernel = RbfKernel(centers_.rowRange(start, end), support_vectors_, gamma_);
+
+      for (size_t f = 0; f < functions_.size(); f++) {
+        const DecisionFunction &function = functions_[f];
+        if (function.first_class != c && function.second_class != c) {
+          continue;
+        }
+        // The first class's centers come before the second's
+        int offset = function.first_class == c ? 0 :
+                     center_offsets_[function.first_class + 1] - center_offsets_[function.first_class];
+        const double *alpha = function.alpha.ptr<double>(0);
+        const int *index = function.index.ptr<int>(0);
+        double *projection = out_projections_[f].ptr<double>(0);
+        for (int j = 0; j < end - start; j++) {
+          const double *values = kernel.ptr<double>(j);
+          double sum = 0;
+          for (size_t i = 0; i < function.alpha.total(); i++) {
+            sum += alpha[i] * values[index[i]];
+          }
+          projection[offset + j] = sum;
+        }
+      }
+    }
+  }
+
+ private:
+  const cv::Mat &support_vectors_;
+  const cv::Mat &centers_;
+  const vector<int> &center_offsets_;
+  double gamma_;
+  const vector<DecisionFunction> &functions_;
+  vector<cv::Mat> &out_projections_;
+};
+
+/**
+ * Solves K_zz beta = K_zs alpha for a range of decision functions, over the centers of their two classes
+ */
+class SolveFunctions : public cv::ParallelLoopBody {
+ public:
+  SolveFunctions(const cv::Mat &centers, const vector<int> &center_offsets, double gamma,
+                 const vector<cv::Mat> &projections, vector<DecisionFunction> &out_functions)
+      : centers_(centers), center_offsets_(center_offsets), gamma_(gamma), projections_(projections),
+        out_functions_(out_functions) {}
+
+  void operator()(const cv::Range &range) const {
+    for (int f = range.start; f < range.end; f++) {
+      DecisionFunction &function = out_functions_[f];
+      vector<int> index;
+      cv::Mat rows;
+      const int pair[] = {function.first_class, function.second_class};
+      for (int c : pair) {
+        for (int j = center_offsets_[c]; j < center_offsets_[c + 1]; j++) {
+          index.push_back(j);
+        }
+        if (center_offsets_[c] < center_offsets_[c + 1]) {
+          rows.push_back(centers_.rowRange(center_offsets_[c], center_offsets_[c + 1]));
+        }
+      }
+
+      cv::Mat gram = RbfKernel(rows, rows, gamma_);
+      gram += cv::Mat::eye(gram.rows, gram.cols, CV_64F) * kRidge;
+      if (!cv::solve(gram, projections_[f], function.alpha, cv::DECOMP_CHOLESKY)) {
+        cv::solve(gram, projections_[f], function.alpha, cv::DECOMP_SVD);
+      }
+      function.index = cv::Mat(index, true);
+    }
+  }
+
+ private:
+  const cv::Mat &centers_;
+  const vector<int> &center_offsets_;
+  double gamma_;
+  const vector<cv::Mat> &projections_;
+  vector<DecisionFunction> &out_functions_;
+};
+
+/**
+ * Writes an RBF C_SVC in the layout cv::ml::SVM::save() writes, so cv::Algorithm::load() reads it back as any other
+ * trained SVM
+ * @param file_path std::string the .yml file to write
+ * @param svm cv::Ptr<cv::ml::SVM> the original model, whose parameters are copied
+ * @param class_labels cv::Mat the original model's class labels
+ * @param support_vectors cv::Mat the CV_32F support vectors, one per row
+ * @param functions vector<DecisionFunction> the decision functions over support_vectors, in the original's order
+ */
+void WriteSVM(const string &file_path, const cv::Ptr<cv::ml::SVM> &svm, const cv::Mat &class_labels,
+              const cv::Mat &support_vectors, const vector<DecisionFunction> &functions) {
+  cv::FileStorage fs(file_path, cv::FileStorage::WRITE);
+  fs << "opencv_ml_svm" << "{";
+  fs << "format" << 3;
+  fs << "svmType" << "C_SVC";
+  fs << "kernel" << "{" << "type" << "RBF" << "gamma" << svm->getGamma() << "}";
+  fs << "C" << svm->getC();
+  cv::TermCriteria criteria = svm->getTermCriteria();
+  fs << "term_criteria" << "{:";
+  if (criteria.type & cv::TermCriteria::EPS) {
+    fs << "epsilon" << criteria.epsilon;
+  }
+  if (criteria.type & cv::TermCriteria::COUNT) {
+    fs << "iterations" << criteria.maxCount;
+  }
+  fs << "}";
+
+  fs << "var_count" << support_vectors.cols;
+  fs << "class_count" << (int) class_labels.total();
+  fs << "class_labels" << class_labels;
+  cv::Mat class_weights = svm->getClassWeights();
+  if (!class_weights.empty()) {
+    fs << "class_weights" << class_weights;
+  }
+
+  fs << "sv_total" << support_vectors.rows;
+  fs << "support_vectors" << "[";
+  for (int i = 0; i < support_vectors.rows; i++) {
+    fs << "[:";
+    fs.writeRaw("f", support_vectors.ptr(i), support_vectors.cols * sizeof(float));
+    fs << "]";
+  }
+  fs << "]";
+
+  fs << "decision_functions" << "[";
+  for (const DecisionFunction &function : functions) {
+    int sv_count = (int) function.alpha.total();
+    fs << "{" << "sv_count" << sv_count << "rho" << function.rho;
+    fs << "alpha" << "[:";
+    fs.writeRaw("d", function.alpha.ptr(), sv_count * sizeof(double));
+    fs << "]";
+    fs << "index" << "[:";
+    fs.writeRaw("i", function.index.ptr(), sv_count * sizeof(int));
+    fs << "]" << "}";
+  }
+  fs << "]";
+  fs << "}";
+  fs.release();
+}
+
+/**
+ * Builds and writes a reduced model with at most center_count support vectors, spread over the classes in proportion
+ * to how many support vectors each has. A class keeps at least one, and keeps its own support vectors if it has no
+ * more than it is given.
+ * @param svm cv::Ptr<cv::ml::SVM> the original model
+ * @param class_labels cv::Mat the original model's class labels
+ * @param support_vectors cv::Mat the original CV_32F support vectors, indexed by the decision functions
+ * @param class_support_vectors vector<cv::Mat> the original support vectors of each class
+ * @param functions vector<DecisionFunction> the original decision functions
+ * @param center_count int the number of support vectors to aim for
+ * @param out_path std::string the .yml file to write the reduced model to
+ */
+void WriteReducedSVM(const cv::Ptr<cv::ml::SVM> &svm, const cv::Mat &class_labels, const cv::Mat &support_vectors,
+                     const vector<cv::Mat> &class_support_vectors, const vector<DecisionFunction> &functions,
+                     int center_count, const string &out_path) {
+  int total = 0;
+  for (const cv::Mat &support_vectors : class_support_vectors) {
+    total += support_vectors.rows;
+  }
+
+  cv::Mat centers;
+  vector<int> center_offsets(1, 0);
+  for (const cv::Mat &support_vectors : class_support_vectors) {
+    int count = support_vectors.rows;
+    int kept = count == 0 ? 0 : max(1, min(count, (int) ((double) center_count * count / total)));
+    if (kept == count) {
+      centers.push_back(support_vectors);
+    } else if (kept > 0) {
+      centers.push_back(ClusterDescriptors(support_vectors, kept,
+                                           cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 20, 1e-4)));
+    }
+    center_offsets.push_back(centers.rows);
+  }
+
+  vector<cv::Mat> projections(functions.size());
+  vector<DecisionFunction> reduced(functions.size());
+  for (size_t f = 0; f < functions.size(); f++) {
+    const DecisionFunction &function = functions[f];
+    int rows = center_offsets[function.first_class + 1] - center_offsets[function.first_class] +
+               center_offsets[function.second_class + 1] - center_offsets[function.second_class];
+    projections[f] = cv::Mat::zeros(rows, 1, CV_64F);
+    reduced[f].first_class = function.first_class;
+    reduced[f].second_class = function.second_class;
+    reduced[f].rho = function.rho;
+  }
+
+  double gamma = svm->getGamma();
+  cv::parallel_for_(cv::Range(0, (int) class_support_vectors.size()),
+                    ProjectClasses(support_vectors, centers, center_offsets, gamma, functions, projections));
+  cv::parallel_for_(cv::Range(0, (int) functions.size()),
+                    SolveFunctions(centers, center_offsets, gamma, projections, reduced));
+  WriteSVM(out_path, svm, class_labels, centers, reduced);
+}
+
+/**
+ * Picks up to row_count rows at random, the same rows on every run
+ * @param samples cv::Mat the training samples
+ * @param labels cv::Mat the CV_32S label of each sample
+ * @param row_count int the number of rows to pick
+ * @param out_samples cv::Mat the picked samples
+ * @param out_labels cv::Mat the picked labels
+ */
+void SampleRows(const cv::Mat &samples, const cv::Mat &labels, int row_count, cv::Mat &out_samples,
+                cv::Mat &out_labels) {
+  vector<int> rows(samples.rows);
+  for (int i = 0; i < samples.rows; i++) {
+    rows[i] = i;
+  }
+  cv::RNG rng(42);
+  cv::randShuffle(rows, 1, &rng);
+  rows.resize(min(samples.rows, row_count));
+  sort(rows.begin(), rows.end());
+
+  out_samples.release();
+  out_labels.release();
+  for (int row : rows) {
+    out_samples.push_back(samples.row(row));
+    out_labels.push_back(labels.row(row));
+  }
+}
+
+/**
+ * Computes the fraction of predictions that equal their label
+ * @param predictions cv::Mat the CV_32F predictions, one per row
+ * @param labels cv::Mat the CV_32S or CV_32F expected labels, one per row
+ * @return double the fraction in [0, 1]
+ */
+double Agreement(const cv::Mat &predictions, const cv::Mat &labels) {
+  if (predictions.rows == 0) {
+    return 0;
+  }
+  cv::Mat labels_32f;
+  labels.convertTo(labels_32f, CV_32F);
+  int agreed = 0;
+  for (int i = 0; i < predictions.rows; i++) {
+    if (predictions.at<float>(i, 0) == labels_32f.at<float>(i, 0)) {
+      agreed++;
+    }
+  }
+  return (double) agreed / predictions.rows;
+}
+
+/**
+ * Times predict() on one row at a time, as a query calls it
+ * @param svm cv::Ptr<cv::ml::SVM> the model to time
+ * @param samples cv::Mat the rows to predict
+ * @param row_count int the number of rows to time
+ * @return double the mean milliseconds per call
+ */
+double MeanPredictMs(const cv::Ptr<cv::ml::SVM> &svm, const cv::Mat &samples, int row_count) {
+  row_count = min(row_count, samples.rows);
+  if (row_count <= 0) {
+    return 0;
+  }
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int i = 0; i < row_count; i++) {
+    svm->predict(samples.row(i));
+  }
+  return ElapsedMs(start) / row_count;
+}
+
+/**
+ * Writes the original model as the reduced one, for when it cannot be or need not be reduced
+ * @param svm cv::Ptr<cv::ml::SVM> the original model
+ * @param out_path std::string the .yml file to write it to
+ * @param out_report SVMCompactionReport the report, whose original fields are already filled in
+ */
+void KeepOriginal(const cv::Ptr<cv::ml::SVM> &svm, const string &out_path, SVMCompactionReport &out_report) {
+  svm->save(out_path);
+  out_report.copied = true;
+  out_report.reduced_support_vectors = out_report.original_support_vectors;
+  out_report.reduced_accuracy = out_report.original_accuracy;
+  out_report.agreement = 1;
+  out_report.reduced_predict_ms = out_report.original_predict_ms;
+}
+}
+
+/**
+ * Compacts a trained SVM into a reduced set model with fewer support vectors (see the top of this file). The number of
+ * support vectors starts at two per class and doubles until the reduced model loses at most params.max_accuracy_loss
+ * of the original's accuracy on the validation rows, or reaches params.max_support_vectors.
+ * @param predictor_path std::string the model written by TrainSVM()
+ * @param samples cv::Mat the CV_32F training histograms, one per row
+ * @param labels cv::Mat the CV_32S class label of each row
+ * @param params SVMCompactionParams how far to compact the model
+ * @param out_path std::string the .yml file to write the reduced model to. Loads in place of predictor_path
+ * @param out_report SVMCompactionReport the size, accuracy and prediction time of both models. If the model is not a
+ * multi-class RBF C_SVC, or reducing it would keep every support vector, it is written to out_path unchanged and
+ * out_report.copied is set
+ * @param out_error std::string if not null, set to the reason the model could not be loaded
+ * @return bool false if the model could not be loaded, in which case nothing is written to out_path
+ */
+bool CompactSVM(const string &predictor_path, const cv::Mat &samples, const cv::Mat &labels,
+                const SVMCompactionParams &params, const string &out_path, SVMCompactionReport &out_report,
+                string *out_error) {
+  out_report = SVMCompactionReport();
+  cv::Ptr<cv::ml::SVM> svm = cv::Algorithm::load<cv::ml::SVM>(predictor_path);
+  if (svm.empty() || !svm->isTrained()) {
+    if (out_error != nullptr) {
+      *out_error = predictor_path + " could not be loaded as a trained SVM";
+    }
+    return false;
+  }
+
+  cv::Mat validation;
+  cv::Mat validation_labels;
+  SampleRows(samples, labels, params.validation_rows, validation, validation_labels);
+  cv::Mat original_predictions;
+  svm->predict(validation, original_predictions);
+  out_report.validation_rows = validation.rows;
+  out_report.original_accuracy = Agreement(original_predictions, validation_labels);
+  out_report.original_predict_ms = MeanPredictMs(svm, validation, params.latency_rows);
+  out_report.original_support_vectors = svm->getSupportVectors().rows;
+
+  // The labels are not exposed by cv::ml::SVM, but are stored alongside the model
+  cv::Mat class_labels;
+  cv::FileStorage fs(predictor_path, cv::FileStorage::READ);
+  fs["opencv_ml_svm"]["class_labels"] >> class_labels;
+  fs.release();
+
+  int max_support_vectors = out_report.original_support_vectors;
+  if (params.max_support_vectors > 0) {
+    max_support_vectors = min(max_support_vectors, params.max_support_vectors);
+  }
+  if (svm->getType() != cv::ml::SVM::C_SVC || svm->getKernelType() != cv::ml::SVM::RBF || class_labels.total() < 2) {
+    KeepOriginal(svm, out_path, out_report);
+    return true;
+  }
+
+  // Decision functions are numbered over the class pairs (i, j), i < j. A support vector of class i has a positive
+  // weight in the functions of i against later classes, and a negative one against earlier classes
+  int class_count = (int) class_labels.total();
+  cv::Mat support_vectors;
+  svm->getSupportVectors().convertTo(support_vectors, CV_32F);
+  vector<int> support_vector_class(support_vectors.rows, -1);
+  vector<DecisionFunction> functions;
+  for (int i = 0; i < class_count; i++) {
+    for (int j = i + 1; j < class_count; j++) {
+      DecisionFunction function;
+      function.first_class = i;
+      function.second_class = j;
+      function.rho = svm->getDecisionFunction((int) functions.size(), function.alpha, function.index);
+      function.alpha.convertTo(function.alpha, CV_64F);
+      const double *alpha = function.alpha.ptr<double>(0);
+      const int *index = function.index.ptr<int>(0);
+      for (size_t k = 0; k < function.alpha.total(); k++) {
+        if (support_vector_class[index[k]] < 0) {
+          support_vector_class[index[k]] = alpha[k] > 0 ? i : j;
+        }
+      }
+      functions.push_back(function);
+    }
+  }
+  vector<cv::Mat> class_support_vectors(class_count);
+  for (int s = 0; s < support_vectors.rows; s++) {
+    if (support_vector_class[s] >= 0) {
+      class_support_vectors[support_vector_class[s]].push_back(support_vectors.row(s));
+    }
+  }
+
+  for (int count = min(max_support_vectors, 2 * class_count); ; count = min(max_support_vectors, 2 * count)) {
+    if (count >= out_report.original_support_vectors) {
+      KeepOriginal(svm, out_path, out_report);
+      break;
+    }
+    WriteReducedSVM(svm, class_labels, support_vectors, class_support_vectors, functions, count, out_path);
+    cv::Ptr<cv::ml::SVM> reduced = cv::Algorithm::load<cv::ml::SVM>(out_path);
+    cv::Mat reduced_predictions;
+    reduced->predict(validation, reduced_predictions);
+    out_report.reduced_support_vectors = reduced->getSupportVectors().rows;
+    out_report.reduced_accuracy = Agreement(reduced_predictions, validation_labels);
+    out_report.agreement = Agreement(reduced_predictions, original_predictions);
+    out_report.reduced_predict_ms = MeanPredictMs(reduced, validation, params.latency_rows);
+    cout << "  " << out_report.reduced_support_vectors << " support vectors: accuracy "
+         << out_report.reduced_accuracy * 100 << "%, agreement " << out_report.agreement * 100 << "%, "
+         << out_report.reduced_predict_ms << " ms per prediction" << endl;
+
+    if (out_report.original_accuracy - out_report.reduced_accuracy <= params.max_accuracy_loss ||
+        count >= max_support_vectors) {
+      break;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,776 @@
+/**
+ * Stages.cpp
+ *
+ * Splits the system into the stages the command line exposes: extract, build-vocab, encode, train, compact, query and
+ * serve. Each stage writes a single artifact and a manifest describing what it was built from (see Artifact.cpp).
+ * Before a stage runs it brings its upstream stages up to date, then compares its own manifest against the one on disk
+ * so that it is skipped when its output is still valid, and rebuilt only when an input or parameter has changed.
+ *
+ *   images --extract--> data/descriptors.bin --build-vocab--> vocabulary.yml --encode--> data/histograms/ and
+ *   data/classifier/svm_training.yml --train--> predictor.yml --compact--> predictor_reduced.yml
+ *
+ * The encode stage assigns the descriptors already in data/descriptors.bin to words rather than extracting the images
+ * again.
+ *
+ * With --svm-vectors=N the compact stage writes predictor_reduced.yml, the SVM approximated with at most N support
+ * vectors, and queries are classified with it instead of predictor.yml.
+ *
+ * With --geometry the encode stage also writes data/classifier/geometry.bin, the key points and words of every image
+ * used to re-rank queries geometrically.
+ *
+ * With --encoding=vlad the encode stage instead builds data/classifier/vlad_index.yml straight from the extracted
+ * descriptors, and queries are answered by scoring against the VLAD vectors without the SVM.
+ */
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/ml.hpp>
+#include <boost/filesystem.hpp>
+
+#include "Artifact.hpp"
+#include "BatchQuery.hpp"
+#include "DescriptorArena.hpp"
+#include "Histogram.hpp"
+#include "IndexingPipeline.hpp"
+#include "Keypoints.hpp"
+#include "QueryCache.hpp"
+#include "QueryEngine.hpp"
+#include "Stages.hpp"
+#include "Surf.hpp"
+#include "SVM.hpp"
+#include "SVMCompaction.hpp"
+#include "utils.hpp"
+#include "Vlad.hpp"
+#include "Vocabulary.hpp"
+
+using namespace std;
+using namespace boost::filesystem;
+
+namespace {
+const string kDescriptorsPath = "data/descriptors.bin";
+const string kVocabularyPath = "vocabulary.yml";
+const string kHistogramsDir = "data/histograms/";
+const string kTrainingDataPath = "data/classifier/svm_training.yml";
+const string kImageIndexPath = "data/classifier/image_index.yml";
+const string kVladIndexPath = "data/classifier/vlad_index.yml";
+const string kGeometryPath = "data/classifier/geometry.bin";
+const string kPredictorPath = "predictor.yml";
+const string kReducedPredictorPath = "predictor_reduced.yml";
+
+// The version of what each stage writes, recorded in its manifest as "format". Bump a stage's version whenever its
+// output changes layout or meaning for the same inputs and parameters, so artifacts written by older code are rebuilt
+// instead of being taken as fresh.
+// 2: descriptors.bin also holds the path and quantized key points of every image
+const int kExtractFormat = 2;
+// 2: k-means++ seeding by SeedCenters() instead of cv::kmeans
+const int kVocabularyFormat = 2;
+// 2: histograms are encoded from descriptors.bin instead of extracting the images again
+const int kEncodeFormat = 2;
+const int kTrainFormat = 1;
+const int kCompactFormat = 1;
+const int kVladFormat = 1;
+
+/**
+ * Formats a numeric parameter for a manifest. Uses enough precision that any change to the value changes the string.
+ * @param value double the parameter value
+ * @return std::string the value as a string
+ */
+string FormatParam(double value) {
+  ostringstream out;
+  out.precision(17);
+  out << value;
+  return out.str();
+}
+
+/**
+ * Checks whether a stage's artifact can be reused, and reports the decision
+ * @param stage std::string the name of the stage, used for logging
+ * @param artifact_path std::string the relative path to the artifact the stage produces
+ * @param expected ArtifactManifest the manifest the artifact would be built with now
+ * @param force bool rebuild the artifact regardless of its manifest
+ * @param companions vector<std::string> other files the stage writes alongside the artifact. The stage is rebuilt if
+ * any is missing, as happens when the artifact was built before the stage started writing them
+ * @return bool true|false on whether or not the stage can be skipped
+ */
+bool CanSkipStage(const string &stage, const string &artifact_path, const ArtifactManifest &expected, bool force,
+                  const vector<string> &companions=vector<string>()) {
+  if (!force && ArtifactIsFresh(artifact_path, expected)) {
+    string missing;
+    for (const string &companion : companions) {
+      if (!exists(companion)) {
+        missing = companion;
+        break;
+      }
+    }
+    if (missing.empty()) {
+      cout << "[" << stage << "] " << artifact_path << " is up to date, skipping" << endl;
+      return true;
+    }
+    cout << "[" << stage << "] " << missing << " is missing, rebuilding " << artifact_path << endl;
+    return false;
+  }
+  cout << "[" << stage << "] building " << artifact_path << endl;
+  return false;
+}
+
+/**
+ * Builds the key point policy used at both index and query time
+ * @param params PipelineParams the pipeline parameters
+ * @return KeypointPolicy the policy
+ */
+KeypointPolicy KeypointPolicyFor(const PipelineParams &params) {
+  KeypointPolicy policy;
+  policy.min_hessian = params.min_hessian;
+  policy.min_keypoints = params.min_keypoints;
+  policy.max_keypoints = params.max_keypoints;
+  return policy;
+}
+
+/**
+ * Records the key point policy in a manifest. The range is only recorded once set, so artifacts built before it
+ * existed stay up to date
+ * @param params PipelineParams the pipeline parameters
+ * @param out_manifest ArtifactManifest the manifest to record the policy in
+ */
+void AddKeypointParams(const PipelineParams &params, ArtifactManifest &out_manifest) {
+  out_manifest.params["min_hessian"] = FormatParam(params.min_hessian);
+  if (params.min_keypoints > 0) {
+    out_manifest.params["min_keypoints"] = FormatParam(params.min_keypoints);
+  }
+  if (params.max_keypoints > 0) {
+    out_manifest.params["max_keypoints"] = FormatParam(params.max_keypoints);
+  }
+}
+
+ArtifactManifest ExtractManifest(const PipelineParams &params) {
+  ArtifactManifest manifest;
+  manifest.params["format"] = FormatParam(kExtractFormat);
+  manifest.inputs["images"] = HashDirectory(params.db_dir);
+  AddKeypointParams(params, manifest);
+  return manifest;
+}
+
+ArtifactManifest VocabularyManifest(const PipelineParams &params) {
+  ArtifactManifest manifest;
+  manifest.params["format"] = FormatParam(kVocabularyFormat);
+  // The descriptor file can be several gigabytes, so it is identified by its manifest which already fingerprints the
+  // images and parameters it was extracted from.
+  manifest.inputs["descriptors"] = HashFile(ManifestPath(kDescriptorsPath));
+  manifest.params["dictionary_size"] = FormatParam(params.dictionary_size);
+  return manifest;
+}
+
+ArtifactManifest EncodeManifest(const PipelineParams &params) {
+  ArtifactManifest manifest;
+  manifest.params["format"] = FormatParam(kEncodeFormat);
+  manifest.inputs["images"] = HashDirectory(params.db_dir);
+  manifest.inputs["descriptors"] = HashFile(ManifestPath(kDescriptorsPath));
+  manifest.inputs["vocabulary"] = HashFile(kVocabularyPath);
+  AddKeypointParams(params, manifest);
+  if (params.store_geometry) {
+    manifest.params["geometry"] = "1";
+  }
+  if (params.assignment != "float") {
+    manifest.params["assignment"] = params.assignment;
+  }
+  return manifest;
+}
+
+ArtifactManifest TrainManifest(const PipelineParams &params) {
+  ArtifactManifest manifest;
+  manifest.params["format"] = FormatParam(kTrainFormat);
+  manifest.inputs["training_data"] = HashFile(kTrainingDataPath);
+  manifest.params["svm_gamma"] = FormatParam(params.svm_gamma);
+  manifest.params["svm_c"] = FormatParam(params.svm_c);
+  return manifest;
+}
+
+ArtifactManifest CompactManifest(const PipelineParams &params) {
+  ArtifactManifest manifest;
+  manifest.params["format"] = FormatParam(kCompactFormat);
+  manifest.inputs["predictor"] = HashFile(ManifestPath(kPredictorPath));
+  manifest.params["svm_vectors"] = FormatParam(params.svm_vectors);
+  manifest.params["svm_max_loss"] = FormatParam(params.svm_max_loss);
+  return manifest;
+}
+
+ArtifactManifest VladManifest(const PipelineParams &params) {
+  ArtifactManifest manifest;
+  manifest.params["format"] = FormatParam(kVladFormat);
+  manifest.inputs["images"] = HashDirectory(params.db_dir);
+  manifest.inputs["descriptors"] = HashFile(ManifestPath(kDescriptorsPath));
+  AddKeypointParams(params, manifest);
+  manifest.params["vlad_words"] = FormatParam(params.vlad_words);
+  manifest.params["vlad_dims"] = FormatParam(params.vlad_dims);
+  return manifest;
+}
+
+/**
+ * Creates an SVM configured with the pipeline's parameters
+ * @param params PipelineParams the pipeline parameters holding gamma and C
+ * @return cv::Ptr<cv::ml::SVM> an untrained SVM
+ */
+cv::Ptr<cv::ml::SVM> CreateSVM(const PipelineParams &params) {
+  cv::Ptr<cv::ml::SVM> svm = cv::ml::SVM::create();
+
+  // Note: the default params were found from performing parameter estimation on a smaller subset of the data.
+  // More desirable results may be acquired from modifying the gamma and C values.
+  svm->setType(cv::ml::SVM::C_SVC);
+  svm->setKernel(cv::ml::SVM::RBF);
+  svm->setGamma(params.svm_gamma);
+  svm->setC(params.svm_c);
+  return svm;
+}
+
+/**
+ * Brings data/descriptors.bin up to date
+ * @param params PipelineParams the pipeline parameters
+ * @param force bool extract the data set again even if its manifest is up to date
+ * @return bool false if no descriptors could be extracted or written, in which case the reason is written to stderr
+ */
+bool Extract(const PipelineParams &params, bool force) {
+  ArtifactManifest manifest = ExtractManifest(params);
+  if (CanSkipStage("extract", kDescriptorsPath, manifest, force)) {
+    return true;
+  }
+
+  vector<string> db_images = utils::Utility::get_image_names_from_dir(params.db_dir);
+  DescriptorArena arena;
+  IndexingPipelineConfig config;
+  IndexingPipelineStats stats;
+  ExtractDescriptorsPipelined(db_images, KeypointPolicyFor(params), config, arena, stats);
+  PrintIndexingPipelineStats(stats);
+  if (arena.rows() == 0) {
+    cerr << "error: no descriptors could be extracted from the images in " << params.db_dir << endl;
+    return false;
+  }
+
+  if (!arena.WriteToDisk(kDescriptorsPath)) {
+    cerr << "error: " << kDescriptorsPath << " could not be written" << endl;
+    return false;
+  }
+  WriteArtifactManifest(kDescriptorsPath, manifest);
+  return true;
+}
+
+/**
+ * Reads the descriptors written by the extract stage. A file which is truncated, or lacks the image paths and key
+ * points, is extracted again once before giving up
+ * @param params PipelineParams the pipeline parameters
+ * @param out_arena DescriptorArena the descriptors, image paths and key points of the data set
+ * @return bool false if the descriptors could not be read, in which case the reason is written to stderr
+ */
+bool LoadDescriptors(const PipelineParams &params, DescriptorArena &out_arena) {
+  if (out_arena.ReadFromDisk(kDescriptorsPath) && out_arena.has_features()) {
+    return true;
+  }
+
+  cout << "[extract] " << kDescriptorsPath << " could not be read, extracting the images again" << endl;
+  if (!Extract(params, true)) {
+    return false;
+  }
+  if (!out_arena.ReadFromDisk(kDescriptorsPath) || !out_arena.has_features()) {
+    cerr << "error: " << kDescriptorsPath << " could not be read" << endl;
+    return false;
+  }
+  return true;
+}
+
+bool BuildVocabulary(const PipelineParams &params, bool force) {
+  if (!Extract(params, false)) {
+    return false;
+  }
+
+  ArtifactManifest manifest = VocabularyManifest(params);
+  if (CanSkipStage("build-vocab", kVocabularyPath, manifest, force)) {
+    return true;
+  }
+
+  DescriptorArena arena;
+  if (!LoadDescriptors(params, arena)) {
+    return false;
+  }
+  // ConstructVocabulary() reuses any vocabulary it finds on disk, so the stale one has to go first
+  boost::filesystem::remove(kVocabularyPath);
+  cv::Mat descriptors = arena.Descriptors();
+  ConstructVocabulary(descriptors, kVocabularyPath, true, params.dictionary_size);
+  WriteArtifactManifest(kVocabularyPath, manifest);
+  return true;
+}
+
+bool Encode(const PipelineParams &params, bool force) {
+  if (!BuildVocabulary(params, false)) {
+    return false;
+  }
+
+  ArtifactManifest manifest = EncodeManifest(params);
+  vector<string> companions(1, kImageIndexPath);
+  if (params.store_geometry) {
+    companions.push_back(kGeometryPath);
+  }
+  if (CanSkipStage("encode", kTrainingDataPath, manifest, force, companions)) {
+    return true;
+  }
+
+  DescriptorArena arena;
+  if (!LoadDescriptors(params, arena)) {
+    return false;
+  }
+
+  // ComputeHistograms() only encodes the data set when no histograms exist yet
+  remove_all(kHistogramsDir);
+  boost::filesystem::remove(kTrainingDataPath);
+  boost::filesystem::remove(kImageIndexPath);
+  boost::filesystem::remove(kGeometryPath);
+
+  string vocabulary_name = kVocabularyPath;
+  cv::Mat training_data;
+  if (!ComputeHistograms(arena, training_data, vocabulary_name, params.store_geometry ? kGeometryPath : "",
+                         params.assignment == "int8")) {
+    return false;
+  }
+  WriteArtifactManifest(kTrainingDataPath, manifest);
+  return true;
+}
+
+bool BuildVlad(const PipelineParams &params, bool force) {
+  if (!Extract(params, false)) {
+    return false;
+  }
+
+  ArtifactManifest manifest = VladManifest(params);
+  if (CanSkipStage("encode", kVladIndexPath, manifest, force)) {
+    return true;
+  }
+
+  DescriptorArena arena;
+  if (!LoadDescriptors(params, arena)) {
+    return false;
+  }
+  VladIndex index;
+  BuildVladIndex(arena, params.vlad_words, params.vlad_dims, index);
+
+  if (!exists("data/classifier")) {
+    create_directory("data/classifier");
+  }
+  WriteVladIndexToDisk(kVladIndexPath, index);
+  WriteArtifactManifest(kVladIndexPath, manifest);
+  return true;
+}
+
+/**
+ * Brings the VLAD index up to date and loads it
+ * @param params PipelineParams the pipeline parameters
+ * @param out_index VladIndex the loaded index
+ * @return bool false if the index could not be read, in which case the reason is written to stderr
+ */
+bool LoadVladIndex(const PipelineParams &params, VladIndex &out_index) {
+  if (!BuildVlad(params, false)) {
+    return false;
+  }
+  if (!ReadVladIndexFromDisk(kVladIndexPath, out_index)) {
+    cerr << "error: " << kVladIndexPath << " could not be read, rebuild it with --force" << endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Finds the best match for a query image by scoring its VLAD vector against every vector in the index
+ * @param image cv::Mat the decoded query image
+ * @param index VladIndex the loaded VLAD index
+ * @param keypoint_policy KeypointPolicy the Hessian threshold and key point range used by the SURF detector
+ * @return std::string the relative path to the best matching image, or an empty string if it could not be encoded
+ */
+string QueryVladIndex(cv::Mat &image, const VladIndex &index, const KeypointPolicy &keypoint_policy) {
+  cv::Ptr<cv::xfeatures2d::SURF> surf;
+  vector<cv::KeyPoint> key_points;
+  cv::Mat descriptors;
+  ExtractDescriptors(image, keypoint_policy, surf, key_points, descriptors);
+  cv::Mat query = EncodeVlad(descriptors, index);
+  if (query.empty()) {
+    return "";
+  }
+
+  vector<vector<ScoredMatch> > matches;
+  ScoreTopK(query, index.vectors, 1, matches);
+  return matches[0].empty() ? "" : index.images[matches[0][0].row];
+}
+
+bool Train(const PipelineParams &params, bool force, cv::Ptr<cv::ml::SVM> &out_svm) {
+  if (!Encode(params, false)) {
+    return false;
+  }
+
+  out_svm = CreateSVM(params);
+  ArtifactManifest manifest = TrainManifest(params);
+  if (CanSkipStage("train", kPredictorPath, manifest, force)) {
+    TrainSVM(kHistogramsDir, 64, CV_32FC1, out_svm);
+    return true;
+  }
+
+  // TrainSVM() loads an existing predictor instead of training a new one
+  boost::filesystem::remove(kPredictorPath);
+  TrainSVM(kHistogramsDir, 64, CV_32FC1, out_svm);
+  WriteArtifactManifest(kPredictorPath, manifest);
+  return true;
+}
+
+bool Compact(const PipelineParams &params, bool force) {
+  cv::Ptr<cv::ml::SVM> svm;
+  if (!Train(params, false, svm)) {
+    return false;
+  }
+
+  ArtifactManifest manifest = CompactManifest(params);
+  if (CanSkipStage("compact", kReducedPredictorPath, manifest, force)) {
+    return true;
+  }
+
+  cv::Mat samples;
+  cv::Mat labels;
+  ReadSVMTrainingSet(kHistogramsDir, 64, CV_32FC1, samples, labels);
+  SVMCompactionParams compaction;
+  compaction.max_support_vectors = params.svm_vectors;
+  compaction.max_accuracy_loss = params.svm_max_loss;
+  SVMCompactionReport report;
+  string error;
+  if (!CompactSVM(kPredictorPath, samples, labels, compaction, kReducedPredictorPath, report, &error)) {
+    cerr << "error: " << error << ", retrain it with train --force" << endl;
+    return false;
+  }
+  if (report.copied) {
+    cout << "[compact] " << kPredictorPath << " could not be reduced, " << kReducedPredictorPath << " is a copy of it"
+         << endl;
+  }
+  cout << "[compact] " << report.original_support_vectors << " -> " << report.reduced_support_vectors
+       << " support vectors" << endl;
+  cout << "[compact] accuracy on " << report.validation_rows << " training rows: " << report.original_accuracy * 100
+       << "% -> " << report.reduced_accuracy * 100 << "%, " << report.agreement * 100 << "% agreement" << endl;
+  cout << "[compact] predict: " << report.original_predict_ms << " ms -> " << report.reduced_predict_ms << " ms ("
+       << report.original_predict_ms / max(1e-9, report.reduced_predict_ms) << "x)" << endl;
+  WriteArtifactManifest(kReducedPredictorPath, manifest);
+  return true;
+}
+
+/**
+ * Brings the SVM queries are classified with up to date
+ * @param params PipelineParams the pipeline parameters
+ * @param out_path std::string the relative path to the compacted SVM with --svm-vectors, otherwise to the trained SVM
+ * @return bool false if a stage failed, in which case the reason is written to stderr
+ */
+bool QueryPredictorPath(const PipelineParams &params, string &out_path) {
+  if (params.svm_vectors > 0) {
+    out_path = kReducedPredictorPath;
+    return Compact(params, false);
+  }
+  cv::Ptr<cv::ml::SVM> svm;
+  out_path = kPredictorPath;
+  return Train(params, false, svm);
+}
+}
+
+/**
+ * Extracts the SURF descriptors of every image in the data set, skipping the extraction if the images and key point settings
+ * are unchanged since the last run
+ * @param params PipelineParams the pipeline parameters
+ * @return bool false if the stage failed, in which case the reason is written to stderr
+ */
+bool RunExtractStage(const PipelineParams &params) {
+  return Extract(params, params.force);
+}
+
+/**
+ * Clusters the extracted descriptors into the Bag of Visual Words vocabulary, running the extract stage first if needed
+ * @param params PipelineParams the pipeline parameters
+ * @return bool false if a stage failed, in which case the reason is written to stderr
+ */
+bool RunBuildVocabularyStage(const PipelineParams &params) {
+  return BuildVocabulary(params, params.force);
+}
+
+/**
+ * Computes the Bag of Visual Words histogram (or with --encoding=vlad, the VLAD vector) of every image in the data set,
+ * running upstream stages first if needed
+ * @param params PipelineParams the pipeline parameters
+ * @return bool false if a stage failed, in which case the reason is written to stderr
+ */
+bool RunEncodeStage(const PipelineParams &params) {
+  if (params.encoding == "vlad") {
+    return BuildVlad(params, params.force);
+  }
+  return Encode(params, params.force);
+}
+
+/**
+ * Trains the SVM on the encoded histograms, running upstream stages first if needed
+ * @param params PipelineParams the pipeline parameters
+ * @param out_svm cv::Ptr<cv::ml::SVM> the trained SVM
+ * @return bool false if a stage failed, in which case the reason is written to stderr
+ */
+bool RunTrainStage(const PipelineParams &params, cv::Ptr<cv::ml::SVM> &out_svm) {
+  return Train(params, params.force, out_svm);
+}
+
+/**
+ * Compacts the trained SVM into a reduced set model with at most params.svm_vectors support vectors, running upstream
+ * stages first if needed. Reports the support vectors, accuracy and prediction time of both models
+ * @param params PipelineParams the pipeline parameters
+ * @return bool false if a stage failed, in which case the reason is written to stderr
+ */
+bool RunCompactStage(const PipelineParams &params) {
+  return Compact(params, params.force);
+}
+
+namespace {
+/**
+ * The models a single query image is matched with
+ */
+struct QueryModels {
+  cv::Ptr<QueryEngine> engine;
+  VladIndex index;
+};
+
+/**
+ * Brings every stage up to date and loads the models needed to answer queries
+ * @param params PipelineParams the pipeline parameters
+ * @param out_models QueryModels the loaded models
+ * @return bool false if the models could not be loaded, in which case the reason is written to stderr
+ */
+bool LoadQueryModels(const PipelineParams &params, QueryModels &out_models) {
+  if (params.encoding == "vlad") {
+    return LoadVladIndex(params, out_models.index);
+  } else {
+    QueryEngineConfig config;
+    if (!QueryPredictorPath(params, config.predictor_path)) {
+      return false;
+    }
+    config.vocabulary_path = kVocabularyPath;
+    config.training_data_path = kTrainingDataPath;
+    config.image_index_path = kImageIndexPath;
+    config.histograms_dir = kHistogramsDir;
+    config.keypoint_policy = KeypointPolicyFor(params);
+    config.quantized_assignment = params.assignment == "int8";
+    config.probe_classes = params.probe_classes;
+    config.probe_time_ms = params.probe_time_ms;
+    config.probe_rows = params.probe_rows;
+    config.probe_safe_score = params.probe_safe_score;
+    config.geometry_path = kGeometryPath;
+    config.rerank_top_n = params.rerank_top_n;
+    config.rerank_time_ms = params.rerank_time_ms;
+    config.rerank_min_inliers = params.rerank_min_inliers;
+    string error;
+    out_models.engine = QueryEngine::Create(config, &error);
+    if (out_models.engine.empty()) {
+      cerr << "error: " << error << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Identifies the version of the models queries are currently answered with. Each artifact's manifest already
+ * fingerprints everything it was built from, so the manifests of the artifacts a query reads are enough.
+ * @param params PipelineParams the pipeline parameters
+ * @return std::string the generation, which changes whenever a query could return a different result
+ */
+string IndexGeneration(const PipelineParams &params) {
+  if (params.encoding == "vlad") {
+    return HashString(params.encoding + HashFile(ManifestPath(kVladIndexPath)));
+  }
+  // Probing more classes or re-ranking can find a different match, so their budgets are part of the generation
+  string probing = FormatParam(params.probe_classes) + FormatParam(params.probe_time_ms) +
+                   FormatParam(params.probe_rows) + FormatParam(params.probe_safe_score);
+  if (params.rerank_top_n > 0) {
+    probing += FormatParam(params.rerank_top_n) + FormatParam(params.rerank_time_ms) +
+               FormatParam(params.rerank_min_inliers);
+  }
+  string predictor_path = params.svm_vectors > 0 ? kReducedPredictorPath : kPredictorPath;
+  return HashString(params.encoding + HashFile(ManifestPath(kVocabularyPath)) + HashFile(ManifestPath(predictor_path)) +
+                    HashFile(ManifestPath(kTrainingDataPath)) + probing);
+}
+
+/**
+ * Finds the best match for a decoded query image
+ * @param image cv::Mat the decoded query image
+ * @param params PipelineParams the pipeline parameters
+ * @param models QueryModels the models loaded by LoadQueryModels()
+ * @return std::string the relative path to the best matching image, or an empty string if it could not be encoded
+ */
+string MatchImage(cv::Mat &image, const PipelineParams &params, QueryModels &models) {
+  if (params.encoding == "vlad") {
+    return QueryVladIndex(image, models.index, KeypointPolicyFor(params));
+  }
+  return models.engine->Query(image).match;
+}
+
+/**
+ * Finds the best match for a query image, answering repeated and near-identical images from the cache
+ * @param query_path std::string the relative path to the query image
+ * @param params PipelineParams the pipeline parameters
+ * @param models QueryModels the models loaded by LoadQueryModels()
+ * @param cache QueryCache the cache of earlier results
+ * @return std::string the relative path to the best matching image, or an empty string if it could not be encoded
+ */
+string CachedMatchImage(const string &query_path, const PipelineParams &params, QueryModels &models,
+                        QueryCache &cache) {
+  cv::Mat image = cv::imread(query_path);
+  if (!image.data) {
+    return "";
+  }
+
+  uint64_t key = ComputeDHash(image);
+  string match;
+  if (cache.Lookup(key, match)) {
+    return match;
+  }
+  match = MatchImage(image, params, models);
+  cache.Insert(key, match);
+  return match;
+}
+}
+
+/**
+ * Brings every stage up to date and returns the best match for a single query image. If params.cache_path is set the
+ * result is looked up in and saved to the persisted query cache.
+ * @param query_path std::string the relative path to the query image
+ * @param params PipelineParams the pipeline parameters
+ * @param out_match std::string the relative path to the best matching image within the data set
+ * @return bool false if the models could not be loaded, in which case the reason is written to stderr
+ */
+bool RunQuery(string &query_path, const PipelineParams &params, string &out_match) {
+  QueryModels models;
+  if (!LoadQueryModels(params, models)) {
+    return false;
+  }
+
+  if (params.cache_path.empty()) {
+    cv::Mat image = cv::imread(query_path);
+    out_match = MatchImage(image, params, models);
+    return true;
+  }
+
+  QueryCache cache(params.cache_size, IndexGeneration(params));
+  cache.ReadFromDisk(params.cache_path);
+  out_match = CachedMatchImage(query_path, params, models, cache);
+  cache.WriteToDisk(params.cache_path);
+  return true;
+}
+
+/**
+ * Brings every stage up to date, then keeps the vocabulary and SVM loaded while answering queries. Reads one query
+ * image path per line from stdin and writes the best match for each to stdout until stdin is closed. Results are
+ * cached by the perceptual hash of the query image, and the cache's hit rate is written to stderr on exit.
+ * @param params PipelineParams the pipeline parameters
+ * @return bool false if the models could not be loaded, in which case the reason is written to stderr
+ */
+bool RunServe(const PipelineParams &params) {
+  QueryModels models;
+  if (!LoadQueryModels(params, models)) {
+    return false;
+  }
+
+  QueryCache cache(params.cache_size, IndexGeneration(params));
+  if (!params.cache_path.empty()) {
+    cache.ReadFromDisk(params.cache_path);
+  }
+
+  string query_path;
+  while (getline(cin, query_path)) {
+    if (query_path.empty()) {
+      continue;
+    }
+    if (!exists(query_path)) {
+      cout << "error: " << query_path << " does not exist" << endl;
+      continue;
+    }
+    cout << CachedMatchImage(query_path, params, models, cache) << endl;
+  }
+
+  if (!params.cache_path.empty()) {
+    cache.WriteToDisk(params.cache_path);
+  }
+  QueryCacheStats stats = cache.stats();
+  cerr << "query cache: " << stats.hits << " hits, " << stats.misses << " misses (" << stats.HitRate() * 100
+       << "% hit rate), " << stats.evictions << " evictions" << endl;
+  return true;
+}
+
+/**
+ * Answers a list of queries in one run. Brings the encode stage up to date, encodes every query image in parallel and
+ * scores all of them against every database histogram (or VLAD vector) with ScoreTopK(). Writes one line per match to stdout:
+ * query_path, rank, match_path and score separated by tabs.
+ * @param query_list_path std::string the relative path to a file holding one query image path per line
+ * @param params PipelineParams the pipeline parameters. params.top_k sets the number of matches per query
+ * @return bool false if the index could not be loaded, in which case the reason is written to stderr
+ */
+bool RunBatchQuery(const string &query_list_path, const PipelineParams &params) {
+  vector<string> query_paths;
+  std::ifstream query_list(query_list_path.c_str());
+  string line;
+  while (getline(query_list, line)) {
+    if (!line.empty()) {
+      query_paths.push_back(line);
+    }
+  }
+
+  // Queries are read, decoded and encoded in parallel by the indexing pipeline
+  IndexingPipelineConfig config;
+  config.quantized_assignment = params.assignment == "int8";
+
+  cv::Mat database;
+  vector<string> database_images;
+  cv::Mat vocabulary;
+  VladIndex index;
+  if (params.encoding == "vlad") {
+    if (!LoadVladIndex(params, index)) {
+      return false;
+    }
+    database = index.vectors;
+    database_images = index.images;
+    config.encoder = [&index](const cv::Mat &descriptors) {
+      return EncodeVlad(descriptors, index);
+    };
+  } else {
+    if (!Encode(params, false)) {
+      return false;
+    }
+    string training_data_path = kTrainingDataPath;
+    database = NormalizeForCorrelation(ReadSVMTrainingDataFromDisk(training_data_path));
+    database_images = ReadImageIndexFromDisk(kImageIndexPath);
+    vocabulary = ReadVocabularyFromDisk(kVocabularyPath);
+  }
+  if (database.rows == 0 || database.rows != (int) database_images.size()) {
+    cerr << "error: the index holds " << database.rows << " rows but " << database_images.size()
+         << " image paths, rebuild it with --force" << endl;
+    return false;
+  }
+
+  IndexingPipelineStats stats;
+  cv::Mat query_hists;
+  vector<string> encoded_queries;
+  ComputeHistogramsPipelined(query_paths, query_hists, encoded_queries, vocabulary, KeypointPolicyFor(params), config,
+                             stats);
+  if (stats.failed_images > 0) {
+    cerr << stats.failed_images << " of " << query_paths.size() << " queries could not be encoded" << endl;
+  }
+
+  vector<vector<ScoredMatch> > matches;
+  // VLAD vectors are already unit length, so their dot product is the cosine similarity
+  cv::Mat queries = params.encoding == "vlad" ? query_hists : NormalizeForCorrelation(query_hists);
+  ScoreTopK(queries, database, params.top_k, matches);
+
+  for (size_t i = 0; i < matches.size(); i++) {
+    for (size_t rank = 0; rank < matches[i].size(); rank++) {
+      cout << encoded_queries[i] << '\t' << rank + 1 << '\t' << database_images[matches[i][rank].row] << '\t'
+           << matches[i][rank].score << '\n';
+    }
+  }
+  cout.flush();
+  return true;
+}
@@ -4,6 +4,7 @@
  * This class provides key point, and feature vector extraction from an image using the SURF algorithm in a convenient
  * way. Essentially reducing the required steps to get the provided methods
  */
+#include <fstream>
 #include <iostream>
 #include <vector>
 #include <opencv2/core.hpp>
@@ -18,11 +19,11 @@ using namespace std;
 /**
  * Gets the key points for a given image
  * @param input_image cv::Mat a matrix of the image's data
+ * @param min_hessian int the Hessian threshold used by the SURF detector. Default is 400
  * @return vector<cv::KeyPoint> a matrix of the key points within the given image
  */
-vector<cv::KeyPoint> get_key_points(cv::Mat &input_image) {
-  int minHessian = 400; // Modify this as needed
-  cv::Ptr<cv::xfeatures2d::SURF> detector = cv::xfeatures2d::SURF::create(minHessian);
+vector<cv::KeyPoint> get_key_points(cv::Mat &input_image, int min_hessian) {
+  cv::Ptr<cv::xfeatures2d::SURF> detector = cv::xfeatures2d::SURF::create(min_hessian);
   vector<cv::KeyPoint> key_points;
   detector->detect(input_image, key_points);
   return key_points;
@@ -32,11 +33,11 @@ vector<cv::KeyPoint> get_key_points(cv::Mat &input_image) {
  * Compute a feature vector for an image given the image, and its key points
  * @param image cv::Mat a matrix of the image's data
  * @param key_points vector<cv::KeyPoint> a matrix of the key points within the given image
+ * @param min_hessian int the Hessian threshold used by the SURF detector. Default is 400
  * @return cv::Mat a feature vector in the form of a matrix
  */
-cv::Mat get_single_feature_vector(cv::Mat &image, vector<cv::KeyPoint> &key_points) {
-  int minHessian = 400; // Modify this as needed
-  cv::Ptr<cv::FeatureDetector> detector = cv::xfeatures2d::SURF::create(minHessian);
+cv::Mat get_single_feature_vector(cv::Mat &image, vector<cv::KeyPoint> &key_points, int min_hessian) {
+  cv::Ptr<cv::FeatureDetector> detector = cv::xfeatures2d::SURF::create(min_hessian);
 
   cv::Mat descriptors;
   detector->compute(image, key_points, descriptors);
@@ -47,9 +48,10 @@ cv::Mat get_single_feature_vector(cv::Mat &image, vector<cv::KeyPoint> &key_poin
 /**
  * Compute a feature vector for a single file
  * @param file_name std::string the file name of the image
+ * @param min_hessian int the Hessian threshold used by the SURF detector
  * @return cv::Mat a feature vector in the form of a matrix
  */
-cv::Mat get_single_feature_vector(string &file_name) {
+cv::Mat get_single_feature_vector(string &file_name, int min_hessian) {
   // Read in file
   cv::Mat image = cv::imread(file_name);
 
@@ -57,8 +59,7 @@ cv::Mat get_single_feature_vector(string &file_name) {
     return cv::Mat(0, 0, CV_64F);
   }
 
-  int minHessian = 400;  // Modify this as needed
-  cv::Ptr<cv::DescriptorExtractor> extractor = cv::xfeatures2d::SURF::create(minHessian);
+  cv::Ptr<cv::DescriptorExtractor> extractor = cv::xfeatures2d::SURF::create(min_hessian);
   // Get key points
   vector<cv::KeyPoint> key_points;
   cv::Mat descriptors;
@@ -74,14 +75,15 @@ cv::Mat get_single_feature_vector(string &file_name) {
  * images
  * @param file_names vector<string> contains each file name within a directory
  * @param indices_mapping vector<IndicesMapping> a matrix composed of relevant IndicesMapping objects for each image
+ * @param min_hessian int the Hessian threshold used by the SURF detector. Default is 400
  * @return vector<cv::Mat> a vector composed of each image's feature vector within a directory (vector of image matrices)
  */
-vector<cv::Mat> get_multiple_feature_vectors(vector<string> &file_names) {
+vector<cv::Mat> get_multiple_feature_vectors(vector<string> &file_names, int min_hessian) {
   vector<cv::Mat> descriptors;
   cout << "Computing feature vectors..." << endl;
   for (string &file : file_names) {
     string file_label = utils::Utility::get_image_label(file);
-    cv::Mat desc = get_single_feature_vector(file);
+    cv::Mat desc = get_single_feature_vector(file, min_hessian);
     if (desc.rows < 1) {
       continue;
     }
@@ -94,17 +96,61 @@ vector<cv::Mat> get_multiple_feature_vectors(vector<string> &file_names) {
 /**
  * Given a vector<cv::Mat>, combine all of the elements into one singular matrix in order to create an index when searching
  * for an image match
- * @param descriptors
- * @return
+ * @param descriptors vector<cv::Mat> the descriptors of each image, all with the same number of columns and type
+ * @return cv::Mat the descriptors of every image, one per row
  */
 cv::Mat ConcatenateDescriptors(vector<cv::Mat> &descriptors) {
+  int rows = 0;
+  for (const cv::Mat &descriptor : descriptors) {
+    rows += descriptor.rows;
+  }
+  if (descriptors.empty()) {
+    return cv::Mat();
+  }
+
+  // Allocate once instead of growing the matrix with every push_back
+  cv::Mat concatenated_descriptors(rows, descriptors[0].cols, descriptors[0].type());
+  int offset = 0;
+  for (const cv::Mat &descriptor : descriptors) {
+    descriptor.copyTo(concatenated_descriptors.rowRange(offset, offset + descriptor.rows));
+    offset += descriptor.rows;
+  }
+
+  return concatenated_descriptors;
+}
+
+/**
+ * Writes the concatenated SURF descriptors of the data set to disk so the vocabulary can be rebuilt without extracting
+ * them again. Stored as a raw binary matrix (rows, cols, type followed by the data) as the YAML representation of
+ * millions of descriptors is several times larger and very slow to parse.
+ * @param descriptors cv::Mat the concatenated descriptors to write
+ * @param file_path std::string the relative path to write the descriptors to
+ */
+void WriteDescriptorsToDisk(const cv::Mat &descriptors, const string &file_path) {
+  cv::Mat continuous = descriptors.isContinuous() ? descriptors : descriptors.clone();
+  int header[3] = {continuous.rows, continuous.cols, continuous.type()};
 
-  // TODO: Could probably pre-allocate the size of the matrix based on the dimensions labelled in descriptors
-  cv::Mat concatenated_descriptors;
+  ofstream file(file_path.c_str(), ios::binary);
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(continuous.data), continuous.total() * continuous.elemSize());
+}
 
-  for (cv::Mat descriptor : descriptors) {
-    concatenated_descriptors.push_back(descriptor);
+/**
+ * Reads the concatenated SURF descriptors written by WriteDescriptorsToDisk()
+ * @param file_path std::string the relative path to the descriptor file
+ * @return cv::Mat the concatenated descriptors, or an empty matrix if the file could not be read
+ */
+cv::Mat ReadDescriptorsFromDisk(const string &file_path) {
+  ifstream file(file_path.c_str(), ios::binary);
+  int header[3] = {0, 0, 0};
+  if (!file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    return cv::Mat();
   }
 
-return concatenated_descriptors;
+  cv::Mat descriptors(header[0], header[1], header[2]);
+  file.read(reinterpret_cast<char *>(descriptors.data), descriptors.total() * descriptors.elemSize());
+  if (!file) {
+    return cv::Mat();
+  }
+  return descriptors;
 }
@@ -0,0 +1,265 @@
+/**
+ * Vlad.cpp
+ *
+ * An alternative to the Bag of Visual Words histogram which keeps more information in far fewer dimensions. Instead of
+ * counting how many descriptors fall on each of 2500 words, VLAD (Vector of Locally Aggregated Descriptors) sums the
+ * residuals x - c between each descriptor and its nearest word over a small vocabulary, i.e, 64 words x 64 dimension
+ * SURF residuals. The result is power and L2 normalized, then reduced with PCA to 128-256 dimensions.
+ *
+ * Two images are compared with a single dot product of their dense, normalized vectors, which is much cheaper than a
+ * 2500 dimension histogram comparison and well suited to the blocked scoring in BatchQuery.cpp.
+ */
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "Assignment.hpp"
+#include "DescriptorArena.hpp"
+#include "Vlad.hpp"
+
+using namespace std;
+
+namespace {
+// The number of descriptors sampled from the data set to cluster the VLAD vocabulary
+const int kVocabularySampleSize = 200000;
+// The minimum number of images used to fit the PCA projection
+const int kPcaMinSampleSize = 5000;
+
+/**
+ * Scales a row vector to unit length in place. Leaves an all-zero vector untouched
+ * @param row cv::Mat the CV_32F row vector to normalize
+ */
+void L2Normalize(cv::Mat &row) {
+  double norm = cv::norm(row, cv::NORM_L2);
+  if (norm > 0) {
+    row /= norm;
+  }
+}
+
+/**
+ * Picks every nth row so at most sample_size rows are returned
+ * @param rows cv::Mat the matrix to sample
+ * @param sample_size int the maximum number of rows to keep
+ * @return cv::Mat the sampled rows
+ */
+cv::Mat SampleRows(const cv::Mat &rows, int sample_size) {
+  if (rows.rows <= sample_size) {
+    return rows;
+  }
+  cv::Mat sample(0, rows.cols, rows.type());
+  double step = (double) rows.rows / sample_size;
+  for (int i = 0; i < sample_size; i++) {
+    sample.push_back(rows.row((int) (i * step)));
+  }
+  return sample;
+}
+
+/**
+ * Sums the residuals of the descriptors assigned to each word, then power normalizes (signed square root) the
+ * concatenated sums to dampen bursty words and L2 normalizes them
+ * @param descriptors cv::Mat the CV_32F SURF descriptors of the image
+ * @param labels int the word each descriptor was assigned to
+ * @param vocabulary cv::Mat the CV_32F VLAD vocabulary, one word per row
+ * @return cv::Mat the 1x(words * dims) VLAD vector
+ */
+cv::Mat AggregateResiduals(const cv::Mat &descriptors, const int *labels, const cv::Mat &vocabulary) {
+  int dims = vocabulary.cols;
+  cv::Mat vlad = cv::Mat::zeros(1, vocabulary.rows * dims, CV_32F);
+  float *residuals = vlad.ptr<float>(0);
+  for (int i = 0; i < descriptors.rows; i++) {
+    const float *x = descriptors.ptr<float>(i);
+    const float *c = vocabulary.ptr<float>(labels[i]);
+    float *residual = residuals + labels[i] * dims;
+    for (int d = 0; d < dims; d++) {
+      residual[d] += x[d] - c[d];
+    }
+  }
+
+  for (int i = 0; i < vlad.cols; i++) {
+    residuals[i] = residuals[i] < 0 ? -sqrt(-residuals[i]) : sqrt(residuals[i]);
+  }
+  L2Normalize(vlad);
+  return vlad;
+}
+
+/**
+ * Computes the projected VLAD vector of a range of the arena's images, each into its own row of the index
+ */
+class EncodeImages : public cv::ParallelLoopBody {
+ public:
+  EncodeImages(const DescriptorArena &arena, const vector<size_t> &images, const vector<size_t> &label_offsets,
+               const vector<int> &labels, VladIndex &out_index)
+      : arena_(arena), images_(images), label_offsets_(label_offsets), labels_(labels), out_index_(out_index) {}
+
+  void operator()(const cv::Range &range) const override {
+    for (int row = range.start; row < range.end; row++) {
+      size_t image = images_[row];
+      cv::Mat vlad = AggregateResiduals(arena_.ImageDescriptors(image), labels_.data() + label_offsets_[image],
+                                        out_index_.vocabulary);
+      ProjectVlad(vlad, out_index_.pca).copyTo(out_index_.vectors.row(row));
+    }
+  }
+
+ private:
+  const DescriptorArena &arena_;
+  const vector<size_t> &images_;
+  const vector<size_t> &label_offsets_;
+  const vector<int> &labels_;
+  VladIndex &out_index_;
+};
+}
+
+/**
+ * Computes the VLAD vector of an image. For each word the residuals of the descriptors assigned to it are summed, and
+ * the concatenated sums are power normalized (signed square root) to dampen bursty words, then L2 normalized.
+ * @param descriptors cv::Mat the CV_32F SURF descriptors of the image
+ * @param vocabulary cv::Mat the CV_32F VLAD vocabulary, one word per row
+ * @param centroid_norms cv::Mat the output of ComputeCentroidNorms() for vocabulary
+ * @return cv::Mat the 1x(words * dims) VLAD vector, or an empty matrix if the image has no descriptors
+ */
+cv::Mat ComputeVlad(const cv::Mat &descriptors, const cv::Mat &vocabulary, const cv::Mat &centroid_norms) {
+  if (descriptors.rows == 0) {
+    return cv::Mat();
+  }
+  assert(descriptors.cols == vocabulary.cols);
+
+  vector<int> labels;
+  AssignToNearestCentroids(descriptors, vocabulary, centroid_norms, labels);
+  return AggregateResiduals(descriptors, labels.data(), vocabulary);
+}
+
+/**
+ * Projects a VLAD vector onto the PCA basis and L2 normalizes the result, so that the dot product of two projected
+ * vectors is their cosine similarity
+ * @param vlad cv::Mat the VLAD vector from ComputeVlad()
+ * @param pca cv::PCA the projection fitted by BuildVladIndex()
+ * @return cv::Mat the 1xdims projected vector
+ */
+cv::Mat ProjectVlad(const cv::Mat &vlad, const cv::PCA &pca) {
+  cv::Mat projected = pca.project(vlad);
+  L2Normalize(projected);
+  return projected;
+}
+
+/**
+ * Computes the compact VLAD vector of an image with the vocabulary and projection of an index
+ * @param descriptors cv::Mat the CV_32F SURF descriptors of the image
+ * @param index VladIndex the index the image is to be compared against
+ * @return cv::Mat the 1xdims projected vector, or an empty matrix if the image has no descriptors
+ */
+cv::Mat EncodeVlad(const cv::Mat &descriptors, const VladIndex &index) {
+  cv::Mat vlad = ComputeVlad(descriptors, index.vocabulary, index.centroid_norms);
+  if (vlad.empty()) {
+    return vlad;
+  }
+  return ProjectVlad(vlad, index.pca);
+}
+
+/**
+ * Builds a VLAD index for the data set from the descriptors written by the extract stage:
+ *  1. Clusters a sample of the descriptors into the small VLAD vocabulary
+ *  2. Assigns every descriptor to its word in one call, which splits the work into blocks across threads
+ *  3. Fits the PCA projection on the full VLAD vectors of a sample of the images
+ *  4. Encodes every image in parallel, projecting each vector as it is computed so the full size vectors of the whole
+ *     data set are never held in memory
+ * @param arena DescriptorArena the descriptors and image paths written by the extract stage
+ * @param words int the number of words in the VLAD vocabulary (i.e, 64)
+ * @param dims int the number of dimensions to project to (i.e, 128)
+ * @param out_index VladIndex the constructed index, with one vector per image of the arena that has descriptors
+ */
+void BuildVladIndex(const DescriptorArena &arena, int words, int dims, VladIndex &out_index) {
+  cv::Mat descriptors = arena.Descriptors();
+  assert(descriptors.rows >= words);
+
+  cout << "Clustering the VLAD vocabulary" << endl;
+  cv::Mat vocabulary_sample = SampleRows(descriptors, kVocabularySampleSize);
+  out_index.vocabulary = ClusterDescriptors(vocabulary_sample, words,
+                                            cv::TermCriteria(cv::TermCriteria::COUNT, 50, 0));
+  out_index.centroid_norms = ComputeCentroidNorms(out_index.vocabulary);
+
+  cout << "Assigning descriptors to VLAD words" << endl;
+  vector<int> labels;
+  AssignToNearestCentroids(descriptors, out_index.vocabulary, out_index.centroid_norms, labels);
+  vector<size_t> label_offsets(arena.image_count());
+  vector<size_t> images;
+  size_t offset = 0;
+  for (size_t i = 0; i < arena.image_count(); i++) {
+    label_offsets[i] = offset;
+    int rows = arena.ImageDescriptors(i).rows;
+    offset += (size_t) rows;
+    if (rows > 0) {
+      images.push_back(i);
+    }
+  }
+  assert(!images.empty());
+
+  // Fit PCA on the full size VLAD vectors of every nth image
+  cout << "Fitting the VLAD projection" << endl;
+  size_t sample_size = max((size_t) kPcaMinSampleSize, (size_t) dims * 4);
+  size_t step = max((size_t) 1, images.size() / sample_size);
+  cv::Mat sample_vlads;
+  for (size_t i = 0; i < images.size(); i += step) {
+    sample_vlads.push_back(AggregateResiduals(arena.ImageDescriptors(images[i]),
+                                              labels.data() + label_offsets[images[i]], out_index.vocabulary));
+  }
+  // A small data set cannot support more components than it has sampled images
+  out_index.pca = cv::PCA(sample_vlads, cv::noArray(), cv::PCA::DATA_AS_ROW, min(dims, sample_vlads.rows));
+
+  cout << "Encoding VLAD vectors" << endl;
+  out_index.vectors.create((int) images.size(), out_index.pca.eigenvectors.rows, CV_32F);
+  cv::parallel_for_(cv::Range(0, (int) images.size()),
+                    EncodeImages(arena, images, label_offsets, labels, out_index));
+  out_index.images.clear();
+  for (size_t image : images) {
+    out_index.images.push_back(arena.ImagePath(image));
+  }
+}
+
+/**
+ * Writes a VLAD index to disk
+ * @param file_path std::string the relative path to write the index to. Expects a .yml file
+ * @param index VladIndex the index to write
+ */
+void WriteVladIndexToDisk(const string &file_path, const VladIndex &index) {
+  cv::FileStorage fs(file_path, cv::FileStorage::WRITE);
+  fs << "vocabulary" << index.vocabulary;
+  fs << "pca" << "{";
+  index.pca.write(fs);
+  fs << "}";
+  fs << "vectors" << index.vectors;
+  fs << "images" << "[";
+  for (const string &image_path : index.images) {
+    fs << image_path;
+  }
+  fs << "]";
+  fs.release();
+}
+
+/**
+ * Reads a VLAD index written by WriteVladIndexToDisk()
+ * @param file_path std::string the relative path to the index
+ * @param out_index VladIndex the index read from disk
+ * @return bool true|false on whether or not the index could be read
+ */
+bool ReadVladIndexFromDisk(const string &file_path, VladIndex &out_index) {
+  cv::FileStorage fs(file_path, cv::FileStorage::READ);
+  if (!fs.isOpened()) {
+    return false;
+  }
+
+  fs["vocabulary"] >> out_index.vocabulary;
+  out_index.pca.read(fs["pca"]);
+  fs["vectors"] >> out_index.vectors;
+  out_index.images.clear();
+  cv::FileNode images = fs["images"];
+  for (cv::FileNodeIterator itr = images.begin(); itr != images.end(); ++itr) {
+    out_index.images.push_back((string) *itr);
+  }
+  fs.release();
+
+  out_index.centroid_norms = ComputeCentroidNorms(out_index.vocabulary);
+  return out_index.vectors.rows == (int) out_index.images.size();
+}
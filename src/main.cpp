@@ -2,131 +2,213 @@
  * main.cpp
  *
  * The "main" file for the system in which every component is incorporated and provides full functionality of the system.
+ * The system is split into stages which can be ran on their own (see Stages.cpp):
  *
- * Example 1: The first initial compilation, and run of the system:
+ *   extract      extract the SURF descriptors of every image in the data set
+ *   build-vocab  cluster the descriptors into the Bag of Visual Words vocabulary
+ *   encode       compute the Bag of Visual Words histogram of every image in the data set
+ *   train        train the SVM on the histograms
+ *   compact      approximate the SVM with fewer support vectors, for faster predictions (needs --svm-vectors)
+ *   query        find the best match for a single query image
+ *   serve        find the best match for every query image path read from stdin, keeping the models loaded
+ *   batch-query  find the top-K matches in the whole data set for every query image listed in a file
  *
-  string db_dir = argv[2];
-
-  // Iterate over all images in DB and obtain their feature vectors
-  vector<string> db_images = Utility::get_image_names_from_dir(db_dir);
-  vector<cv::Mat> feature_descriptors = get_multiple_feature_vectors(db_images);
-  cv::Mat concatenated_descriptors = ConcatenateDescriptors(feature_descriptors);
-
-
-  string vocabulary_name = "vocabulary.yml";
-  ConstructVocabulary(concatenated_descriptors, "vocabulary.yml", false);
-
-  cv::Mat training_data;
-  ComputeHistograms(db_images, training_data, vocabulary_name);
-
-  cv::Ptr<cv::ml::SVM> svm = cv::ml::SVM::create();
-
-  // Note: these params were found from performing parameter estimation on a smaller subset of the data.
-  // More desirable results may be acquired from modifying the gamma and C values.
-  svm->setType(cv::ml::SVM::C_SVC);
-  svm->setKernel(cv::ml::SVM::RBF);
-  svm->setGamma(0.50625);
-  svm->setC(34389);
-
-  string _dir = "data/histograms/";
-  TrainSVM(_dir, 64, CV_32FC1, svm);
-  cv::Mat vocabulary = ReadVocabularyFromDisk(vocabulary_name);
-
-
-  string query_path = argv[1];
-  cv::Mat query_hist = ComputeHistogram(query_path, vocabulary);
-
-  string best_match = TestSVM(query_hist, svm);
-  cout << best_match << endl;
-
- * After this has been ran for the first time, the feature descriptors are no longer required to be computed and
- * concatenated as they already exist. If you wish to incorporate new images, or a new data set, then it must be ran as
- * shown in the previous example.
+ * Every stage first brings the stages it depends on up to date. A stage is skipped when the inputs and parameters
+ * recorded in its artifact's manifest are unchanged, so the initial run builds everything (this takes several hours on
+ * Caltech-256) while later runs only rebuild what an upstream change invalidated.
  *
- * Example 2: Additional compilation with NO modifications to the original data set:
-  string db_dir = argv[2];
-
-  string vocabulary_name = "vocabulary.yml";
-  cv::Ptr<cv::ml::SVM> svm = cv::ml::SVM::create();
-
-  svm->setType(cv::ml::SVM::C_SVC);
-  svm->setKernel(cv::ml::SVM::RBF);
-  svm->setGamma(0.50625);
-  svm->setC(34389);
-
-  string _dir = "data/histograms/";
-  // Will not re-train the SVM, checks to see if the predictor.yml file already exists on disk, and uses that if so.
-  TrainSVM(_dir, 64, CV_32FC1, svm);
-
-  cv::Mat vocabulary = ReadVocabularyFromDisk(vocabulary_name);
-
-  // Compute the Bag of Visual Words for the query image and feed it into the SVM predictor
-  string query_path = argv[1];
-  cv::Mat query_hist = ComputeHistogram(query_path, vocabulary);
-
-  string best_match = TestSVM(query_hist, svm);
-  cout << best_match << endl;
+ * Example 1: The first run of the system, or a run after images were added to the data set:
+ *   ./reverse-image-search query path/to/query_image.jpg --images=data/images/
+ *
+ * Example 2: Retraining the SVM with a different C value, which reuses the vocabulary and histograms:
+ *   ./reverse-image-search train --c=10000
+ *
+ * Example 3: Querying against compact 128 dimension VLAD vectors instead of the histograms and SVM:
+ *   ./reverse-image-search query path/to/query_image.jpg --encoding=vlad --vlad-dims=128
+ *
+ * Example 4: Classifying queries with the SVM compacted to at most 2000 support vectors, losing at most 1% accuracy:
+ *   ./reverse-image-search query path/to/query_image.jpg --svm-vectors=2000 --svm-max-loss=0.01
+ *
+ * The original invocation ./reverse-image-search query_img.jpg data/images/ is still accepted and runs a query.
  */
-#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <string>
 #include <opencv2/opencv.hpp>
-#include <boost/filesystem.hpp>
 
-#include "utils.hpp"
-#include "Surf.hpp"
-#include "Histogram.hpp"
-#include "SVM.hpp"
-#include "Vocabulary.hpp"
+#include "Stages.hpp"
 
 using namespace std;
-using namespace utils;
-using namespace boost::filesystem;
 
 void readme();
 
-int main(int argc, char** argv) {
+/**
+ * Parses a --name=value option into the pipeline parameters
+ * @param option std::string the option as given on the command line
+ * @param out_params PipelineParams the parameters to update
+ * @return bool true|false on whether or not the option was recognized
+ */
+bool ParseOption(const string &option, PipelineParams &out_params) {
+  if (option == "--force") {
+    out_params.force = true;
+    return true;
+  }
+  if (option == "--geometry") {
+    out_params.store_geometry = true;
+    return true;
+  }
 
-  // Assumes argv[2] is the directory of images;
-  if (argc != 3) {
+  size_t separator = option.find('=');
+  if (option.compare(0, 2, "--") != 0 || separator == string::npos) {
+    return false;
+  }
+  string name = option.substr(2, separator - 2);
+  string value = option.substr(separator + 1);
+
+  if (name == "images") {
+    out_params.db_dir = value;
+  } else if (name == "min-hessian") {
+    out_params.min_hessian = atoi(value.c_str());
+  } else if (name == "min-keypoints") {
+    out_params.min_keypoints = atoi(value.c_str());
+  } else if (name == "max-keypoints") {
+    out_params.max_keypoints = atoi(value.c_str());
+  } else if (name == "dictionary-size") {
+    out_params.dictionary_size = atoi(value.c_str());
+  } else if (name == "gamma") {
+    out_params.svm_gamma = atof(value.c_str());
+  } else if (name == "c") {
+    out_params.svm_c = atof(value.c_str());
+  } else if (name == "svm-vectors") {
+    out_params.svm_vectors = atoi(value.c_str());
+  } else if (name == "svm-max-loss") {
+    out_params.svm_max_loss = atof(value.c_str());
+  } else if (name == "encoding" && (value == "bow" || value == "vlad")) {
+    out_params.encoding = value;
+  } else if (name == "assignment" && (value == "float" || value == "int8")) {
+    out_params.assignment = value;
+  } else if (name == "vlad-words") {
+    out_params.vlad_words = atoi(value.c_str());
+  } else if (name == "vlad-dims") {
+    out_params.vlad_dims = atoi(value.c_str());
+  } else if (name == "top-k") {
+    out_params.top_k = atoi(value.c_str());
+  } else if (name == "cache-size") {
+    out_params.cache_size = (size_t) atol(value.c_str());
+  } else if (name == "cache-file") {
+    out_params.cache_path = value;
+  } else if (name == "probe-classes") {
+    out_params.probe_classes = atoi(value.c_str());
+  } else if (name == "probe-time-ms") {
+    out_params.probe_time_ms = atof(value.c_str());
+  } else if (name == "probe-rows") {
+    out_params.probe_rows = atoi(value.c_str());
+  } else if (name == "probe-safe-score") {
+    out_params.probe_safe_score = atof(value.c_str());
+  } else if (name == "rerank-top-n") {
+    out_params.rerank_top_n = atoi(value.c_str());
+  } else if (name == "rerank-time-ms") {
+    out_params.rerank_time_ms = atof(value.c_str());
+  } else if (name == "rerank-min-inliers") {
+    out_params.rerank_min_inliers = atoi(value.c_str());
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
     readme();
     return -1;
   }
 
-  string db_dir = argv[2];
-
-// Iterate over all images in DB and obtain their feature vectors
-  vector<string> db_images = utils::Utility::get_image_names_from_dir(db_dir);
-  vector<cv::Mat> feature_descriptors = get_multiple_feature_vectors(db_images);
-  cv::Mat concatenated_descriptors = ConcatenateDescriptors(feature_descriptors);
-
-
-  string vocabulary_name = "vocabulary.yml";
-  ConstructVocabulary(concatenated_descriptors, "vocabulary.yml", false);
-
-  cv::Mat training_data;
-  ComputeHistograms(db_images, training_data, vocabulary_name);
-
-  cv::Ptr<cv::ml::SVM> svm = cv::ml::SVM::create();
-
-  // Note: these params were found from performing parameter estimation on a smaller subset of the data.
-  // More desirable results may be acquired from modifying the gamma and C values.
-  svm->setType(cv::ml::SVM::C_SVC);
-  svm->setKernel(cv::ml::SVM::RBF);
-  svm->setGamma(0.50625);
-  svm->setC(34389);
-
-  string _dir = "data/histograms/";
-  TrainSVM(_dir, 64, CV_32FC1, svm);
-  cv::Mat vocabulary = ReadVocabularyFromDisk(vocabulary_name);
-
-  string query_path = argv[1];
-  cv::Mat query_hist = ComputeHistogram(query_path, vocabulary);
+  string command = argv[1];
+  PipelineParams params;
+  string query_path;
+
+  bool is_command = command == "extract" || command == "build-vocab" || command == "encode" || command == "train" ||
+                    command == "compact" || command == "query" || command == "serve" || command == "batch-query";
+
+  // Support the original `query_img data/` invocation
+  if (argc == 3 && !is_command) {
+    query_path = command;
+    params.db_dir = argv[2];
+    command = "query";
+  } else {
+    for (int i = 2; i < argc; i++) {
+      string arg = argv[i];
+      if ((command == "query" || command == "batch-query") && query_path.empty() && arg.compare(0, 2, "--") != 0) {
+        query_path = arg;
+      } else if (!ParseOption(arg, params)) {
+        cout << "Unknown option " << arg << endl;
+        readme();
+        return -1;
+      }
+    }
+  }
+  // Re-ranking reads the geometric index, so the encode stage has to build it
+  if (params.rerank_top_n > 0) {
+    params.store_geometry = true;
+  }
 
-  string best_match = TestSVM(query_hist, svm);
-  cout << best_match << endl;
+  if (command == "extract") {
+    if (!RunExtractStage(params)) {
+      return -1;
+    }
+  } else if (command == "build-vocab") {
+    if (!RunBuildVocabularyStage(params)) {
+      return -1;
+    }
+  } else if (command == "encode") {
+    if (!RunEncodeStage(params)) {
+      return -1;
+    }
+  } else if (command == "train") {
+    cv::Ptr<cv::ml::SVM> svm;
+    if (!RunTrainStage(params, svm)) {
+      return -1;
+    }
+  } else if (command == "compact" && params.svm_vectors > 0) {
+    if (!RunCompactStage(params)) {
+      return -1;
+    }
+  } else if (command == "query" && !query_path.empty()) {
+    string match;
+    if (!RunQuery(query_path, params, match)) {
+      return -1;
+    }
+    cout << match << endl;
+  } else if (command == "serve") {
+    if (!RunServe(params)) {
+      return -1;
+    }
+  } else if (command == "batch-query" && !query_path.empty()) {
+    if (!RunBatchQuery(query_path, params)) {
+      return -1;
+    }
+  } else {
+    readme();
+    return -1;
+  }
 
   return 0;
 }
 
 void readme() {
-  cout << "usage: ./reverse-image-search query_img.jpg data/" << endl;
+  cout << "usage: ./reverse-image-search <command> [options]" << endl
+       << "commands:" << endl
+       << "  extract | build-vocab | encode | train | compact" << endl
+       << "  query query_img.jpg" << endl
+       << "  serve                  (reads one query image path per line from stdin)" << endl
+       << "  batch-query queries.txt  (one query image path per line, prints the top-K matches of each)" << endl
+       << "options:" << endl
+       << "  --images=data/images/  --min-hessian=400  --dictionary-size=2500" << endl
+       << "  --min-keypoints=0  --max-keypoints=0  (key points per image, 0 leaves that end open)" << endl
+       << "  --gamma=0.50625  --c=34389  --top-k=10  --force" << endl
+       << "  --svm-vectors=0  --svm-max-loss=0.01  (compacted SVM for queries, 0 uses the full SVM)" << endl
+       << "  --encoding=bow|vlad  --vlad-words=64  --vlad-dims=128  --assignment=float|int8" << endl
+       << "  --cache-size=1024  --cache-file=query_cache.yml  (query and serve result cache)" << endl
+       << "  --probe-classes=1  --probe-time-ms=0  --probe-rows=0  --probe-safe-score=0  (0 disables a budget)" << endl
+       << "  --geometry  --rerank-top-n=0  --rerank-time-ms=5  --rerank-min-inliers=6  (geometric re-ranking)" << endl;
 }
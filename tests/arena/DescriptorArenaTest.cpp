@@ -0,0 +1,93 @@
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <opencv2/core.hpp>
+
+#include "DescriptorArena.hpp"
+
+TEST(ViewsShareMemory, DescriptorArenaTest) {
+  DescriptorArena arena(4, CV_32F);
+  cv::Mat first = cv::Mat::ones(3, 4, CV_32F);
+  cv::Mat second = cv::Mat::ones(5, 4, CV_32F) * 2;
+  arena.Append(first);
+  arena.Append(second);
+
+  ASSERT_EQ(arena.image_count(), 2u);
+  ASSERT_EQ(arena.rows(), 8);
+  ASSERT_EQ(cv::countNonZero(arena.ImageDescriptors(1) != 2), 0);
+  ASSERT_EQ(arena.ImageDescriptors(1).data, arena.Descriptors().row(3).data);
+}
+
+TEST(RoundTripsThroughDisk, DescriptorArenaTest) {
+  DescriptorArena arena(4, CV_32F);
+  cv::Mat written = arena.BeginImage(6);
+  cv::randu(written, 0, 1);
+  std::vector<cv::KeyPoint> first_key_points;
+  for (int i = 0; i < 6; i++) {
+    first_key_points.push_back(cv::KeyPoint(10.0f * i, 5.0f, 8.0f + i, 45.0f * i));
+  }
+  arena.EndImage(6, "data/images/a/first.jpg", first_key_points);
+  arena.Append(cv::Mat::zeros(2, 4, CV_32F), "data/images/b/second.jpg",
+               std::vector<cv::KeyPoint>(2, cv::KeyPoint(1.0f, 2.0f, 16.0f, 90.0f)));
+  ASSERT_TRUE(arena.has_features());
+  ASSERT_TRUE(arena.WriteToDisk("arena_test.bin"));
+
+  DescriptorArena read;
+  ASSERT_TRUE(read.ReadFromDisk("arena_test.bin"));
+  std::remove("arena_test.bin");
+  ASSERT_EQ(read.image_count(), 2u);
+  ASSERT_EQ(read.ImageDescriptors(0).rows, 6);
+  ASSERT_EQ(cv::norm(read.Descriptors(), arena.Descriptors(), cv::NORM_INF), 0);
+  ASSERT_EQ(read.ImagePath(0), "data/images/a/first.jpg");
+  ASSERT_EQ(read.ImagePath(1), "data/images/b/second.jpg");
+
+  // The features keep the order of the descriptors, one each, until their words are assigned
+  ASSERT_TRUE(read.has_features());
+  std::vector<GeometricFeature> expected;
+  QuantizeKeyPoints(first_key_points, expected);
+  size_t count = 0;
+  const GeometricFeature *features = read.ImageFeatures(0, count);
+  ASSERT_EQ(count, 6u);
+  for (size_t i = 0; i < count; i++) {
+    ASSERT_EQ(features[i].x, expected[i].x);
+    ASSERT_EQ(features[i].log_scale, expected[i].log_scale);
+    ASSERT_EQ(features[i].angle, expected[i].angle);
+    ASSERT_EQ(features[i].word, 0);
+  }
+}
+
+TEST(FeaturesNeedEveryImage, DescriptorArenaTest) {
+  DescriptorArena arena(4, CV_32F);
+  arena.Append(cv::Mat::ones(2, 4, CV_32F), "first.jpg", std::vector<cv::KeyPoint>(2, cv::KeyPoint(1, 1, 8)));
+  ASSERT_TRUE(arena.has_features());
+  arena.Append(cv::Mat::ones(3, 4, CV_32F), "second.jpg");
+  ASSERT_FALSE(arena.has_features());
+  arena.Append(cv::Mat::ones(1, 4, CV_32F), "third.jpg", std::vector<cv::KeyPoint>(1, cv::KeyPoint(1, 1, 8)));
+  ASSERT_FALSE(arena.has_features());
+}
+
+TEST(TruncatedFileIsNotUsable, DescriptorArenaTest) {
+  DescriptorArena arena(4, CV_32F);
+  arena.Append(cv::Mat::ones(3, 4, CV_32F), "data/images/a/first.jpg",
+               std::vector<cv::KeyPoint>(3, cv::KeyPoint(4, 2, 8)));
+  arena.Append(cv::Mat::ones(2, 4, CV_32F), "data/images/b/second.jpg",
+               std::vector<cv::KeyPoint>(2, cv::KeyPoint(1, 3, 16)));
+  ASSERT_TRUE(arena.WriteToDisk("arena_test.bin"));
+  std::ifstream file("arena_test.bin", std::ios::binary);
+  std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  file.close();
+
+  DescriptorArena read;
+  ASSERT_FALSE(read.ReadFromDisk("missing_arena_test.bin"));
+  // Whatever part of the file is lost, the arena is either rejected or lacks the key points every consumer needs
+  for (size_t length = 0; length < bytes.size(); length++) {
+    std::ofstream truncated("arena_test.bin", std::ios::binary | std::ios::trunc);
+    truncated.write(bytes.data(), length);
+    truncated.close();
+    ASSERT_FALSE(read.ReadFromDisk("arena_test.bin") && read.has_features());
+  }
+  std::remove("arena_test.bin");
+}
@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <string>
+
+#include "Artifact.hpp"
+
+TEST(HashStringIsStable, ArtifactTest) {
+  ASSERT_EQ(HashString("min_hessian=400"), HashString("min_hessian=400"));
+  ASSERT_NE(HashString("min_hessian=400"), HashString("min_hessian=401"));
+  ASSERT_EQ(HashString("").size(), 16);
+}
+
+TEST(HashFileTracksContents, ArtifactTest) {
+  std::string file_path = "artifact_test_input.txt";
+  std::ofstream(file_path.c_str()) << "vocabulary";
+  std::string first = HashFile(file_path);
+  std::ofstream(file_path.c_str()) << "vocabulary2";
+  ASSERT_NE(first, HashFile(file_path));
+  ASSERT_EQ(HashFile("does_not_exist.yml"), "");
+}
+
+TEST(ManifestPathOfDirectory, ArtifactTest) {
+  ASSERT_EQ(ManifestPath("vocabulary.yml"), "vocabulary.yml.manifest.yml");
+  ASSERT_EQ(ManifestPath("data/histograms/"), "data/histograms.manifest.yml");
+}
+
+TEST(ArtifactFreshness, ArtifactTest) {
+  std::string artifact_path = "artifact_test_output.yml";
+  std::ofstream(artifact_path.c_str()) << "output";
+
+  ArtifactManifest manifest;
+  manifest.inputs["descriptors"] = HashString("descriptors");
+  manifest.params["dictionary_size"] = "2500";
+  ASSERT_FALSE(ArtifactIsFresh(artifact_path, manifest));
+
+  WriteArtifactManifest(artifact_path, manifest);
+  ASSERT_TRUE(ArtifactIsFresh(artifact_path, manifest));
+
+  manifest.params["dictionary_size"] = "1000";
+  ASSERT_FALSE(ArtifactIsFresh(artifact_path, manifest));
+
+  boost::filesystem::remove(artifact_path);
+  ASSERT_FALSE(ArtifactIsFresh(artifact_path, manifest));
+}
@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "Assignment.hpp"
+#include "QuantizedVocabulary.hpp"
+
+TEST(MatchesBruteForce, AssignmentTest) {
+  cv::Mat centroids(50, 64, CV_32F);
+  cv::Mat descriptors(1000, 64, CV_32F);
+  cv::RNG rng(7);
+  rng.fill(centroids, cv::RNG::UNIFORM, -1, 1);
+  rng.fill(descriptors, cv::RNG::UNIFORM, -1, 1);
+
+  std::vector<int> labels;
+  std::vector<float> distances;
+  AssignToNearestCentroids(descriptors, centroids, ComputeCentroidNorms(centroids), labels, &distances, 64);
+
+  for (int i = 0; i < descriptors.rows; i++) {
+    int best = 0;
+    double best_distance = std::numeric_limits<double>::max();
+    for (int j = 0; j < centroids.rows; j++) {
+      double distance = cv::norm(descriptors.row(i), centroids.row(j), cv::NORM_L2SQR);
+      if (distance < best_distance) {
+        best_distance = distance;
+        best = j;
+      }
+    }
+    ASSERT_EQ(labels[i], best);
+    ASSERT_NEAR(distances[i], best_distance, 1e-3);
+  }
+}
+
+TEST(HistogramIsNormalized, AssignmentTest) {
+  cv::Mat vocabulary = (cv::Mat_<float>(2, 2) << 0, 0, 10, 10);
+  cv::Mat descriptors = (cv::Mat_<float>(4, 2) << 1, 0, 0, 1, 9, 9, 0, 0);
+  cv::Mat histogram = ComputeBowHistogram(descriptors, vocabulary, ComputeCentroidNorms(vocabulary));
+  ASSERT_EQ(histogram.cols, 2);
+  ASSERT_FLOAT_EQ(histogram.at<float>(0, 0), 0.75f);
+  ASSERT_FLOAT_EQ(histogram.at<float>(0, 1), 0.25f);
+}
+
+TEST(QuantizedKernelsAgree, AssignmentTest) {
+  cv::Mat vocabulary(300, 64, CV_32F);
+  cv::Mat descriptors(2000, 64, CV_32F);
+  cv::RNG rng(11);
+  rng.fill(vocabulary, cv::RNG::NORMAL, 0, 0.1);
+  // Descriptors scattered around random words, as real descriptors are around the clusters of the vocabulary
+  for (int i = 0; i < descriptors.rows; i++) {
+    cv::Mat noise(1, 64, CV_32F);
+    rng.fill(noise, cv::RNG::NORMAL, 0, 0.02);
+    descriptors.row(i) = vocabulary.row(rng.uniform(0, vocabulary.rows)) + noise;
+  }
+
+  std::vector<int> float_labels;
+  AssignToNearestCentroids(descriptors, vocabulary, ComputeCentroidNorms(vocabulary), float_labels);
+  std::vector<int> scalar_labels;
+  QuantizedVocabulary(vocabulary, Int8Kernel::kScalar).Assign(descriptors, scalar_labels, 64);
+
+  int agreed = 0;
+  for (int i = 0; i < descriptors.rows; i++) {
+    agreed += scalar_labels[i] == float_labels[i];
+  }
+  ASSERT_GE(agreed, descriptors.rows * 98 / 100);
+
+  // Every SIMD kernel computes the same integer dot products as the scalar one
+  const Int8Kernel kernels[] = {Int8Kernel::kAvx2, Int8Kernel::kVnni};
+  for (Int8Kernel kernel : kernels) {
+    if (!Int8KernelSupported(kernel)) {
+      continue;
+    }
+    std::vector<int> labels;
+    QuantizedVocabulary(vocabulary, kernel).Assign(descriptors, labels, 64);
+    ASSERT_EQ(labels, scalar_labels) << Int8KernelName(kernel);
+  }
+}
+
+TEST(SeedsOneCenterPerCluster, AssignmentTest) {
+  // Five tight, well separated clusters. k-means++ picks a far away point next, so every cluster gets a seed
+  cv::Mat means = (cv::Mat_<float>(5, 2) << 0, 0, 100, 0, 0, 100, 100, 100, 50, 50);
+  cv::Mat descriptors(500, 2, CV_32F);
+  cv::RNG rng(13);
+  for (int i = 0; i < descriptors.rows; i++) {
+    cv::Mat noise(1, 2, CV_32F);
+    rng.fill(noise, cv::RNG::NORMAL, 0, 1);
+    descriptors.row(i) = means.row(i % 5) + noise;
+  }
+
+  cv::Mat centers = SeedCenters(descriptors, 5, rng);
+  std::vector<int> labels;
+  AssignToNearestCentroids(means, centers, ComputeCentroidNorms(centers), labels);
+  std::sort(labels.begin(), labels.end());
+  for (int k = 0; k < 5; k++) {
+    ASSERT_EQ(labels[k], k);
+  }
+}
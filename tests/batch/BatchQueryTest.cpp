@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "BatchQuery.hpp"
+
+TEST(TopKMatchesSort, BatchQueryTest) {
+  // Small integers keep every dot product exact, so the many equal scores are true ties
+  cv::RNG rng(5);
+  cv::Mat queries(37, 8, CV_32F);
+  cv::Mat database(150, 8, CV_32F);
+  for (int i = 0; i < queries.rows; i++) {
+    for (int d = 0; d < queries.cols; d++) {
+      queries.at<float>(i, d) = (float) rng.uniform(0, 3);
+    }
+  }
+  for (int i = 0; i < database.rows; i++) {
+    for (int d = 0; d < database.cols; d++) {
+      database.at<float>(i, d) = (float) rng.uniform(0, 3);
+    }
+  }
+
+  const int ks[] = {1, 10, 150, 200};
+  for (int k : ks) {
+    std::vector<std::vector<ScoredMatch> > matches;
+    // Blocks smaller than either side, so the heaps are carried across database blocks
+    ScoreTopK(queries, database, k, matches, 8, 32);
+    ASSERT_EQ(matches.size(), (size_t) queries.rows);
+
+    for (int i = 0; i < queries.rows; i++) {
+      std::vector<ScoredMatch> expected;
+      for (int j = 0; j < database.rows; j++) {
+        expected.push_back(ScoredMatch{j, (float) queries.row(i).dot(database.row(j))});
+      }
+      std::stable_sort(expected.begin(), expected.end(), [](const ScoredMatch &a, const ScoredMatch &b) {
+        return a.score > b.score;
+      });
+      expected.resize(std::min<size_t>(k, expected.size()));
+
+      ASSERT_EQ(matches[i].size(), expected.size());
+      for (size_t rank = 0; rank < expected.size(); rank++) {
+        ASSERT_EQ(matches[i][rank].row, expected[rank].row);
+        ASSERT_EQ(matches[i][rank].score, expected[rank].score);
+      }
+    }
+  }
+}
+
+TEST(NormalizedDotIsCorrelation, BatchQueryTest) {
+  cv::RNG rng(9);
+  cv::Mat histograms(4, 50, CV_32F);
+  rng.fill(histograms, cv::RNG::UNIFORM, 0, 1);
+  cv::Mat normalized = NormalizeForCorrelation(histograms);
+
+  for (int i = 0; i < histograms.rows; i++) {
+    for (int j = 0; j < histograms.rows; j++) {
+      double correlation = cv::compareHist(histograms.row(i), histograms.row(j), CV_COMP_CORREL);
+      ASSERT_NEAR(normalized.row(i).dot(normalized.row(j)), correlation, 1e-5);
+    }
+  }
+}
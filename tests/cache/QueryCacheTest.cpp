@@ -0,0 +1,36 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "QueryCache.hpp"
+
+TEST(EvictsLeastRecentlyUsed, QueryCacheTest) {
+  QueryCache cache(2, "a");
+  std::string match;
+  cache.Insert(1, "one.jpg");
+  cache.Insert(2, "two.jpg");
+  ASSERT_TRUE(cache.Lookup(1, match));
+  cache.Insert(3, "three.jpg");
+
+  ASSERT_FALSE(cache.Lookup(2, match));
+  ASSERT_TRUE(cache.Lookup(1, match));
+  ASSERT_EQ(match, "one.jpg");
+  ASSERT_EQ(cache.stats().hits, 2u);
+  ASSERT_EQ(cache.stats().evictions, 1u);
+
+  cache.SetGeneration("b");
+  ASSERT_EQ(cache.size(), 0u);
+}
+
+TEST(HashSurvivesResizing, QueryCacheTest) {
+  cv::Mat image(240, 320, CV_8UC3);
+  cv::RNG rng(3);
+  rng.fill(image, cv::RNG::UNIFORM, 0, 255);
+  cv::GaussianBlur(image, image, cv::Size(31, 31), 0);
+  cv::Mat thumbnail;
+  cv::resize(image, thumbnail, cv::Size(160, 120), 0, 0, cv::INTER_AREA);
+
+  // A handful of bits may flip where neighbouring cells are almost equally bright
+  ASSERT_LE(__builtin_popcountll(ComputeDHash(image) ^ ComputeDHash(thumbnail)), 4);
+}
@@ -0,0 +1,115 @@
+#include <cmath>
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "GeometricIndex.hpp"
+
+namespace {
+cv::KeyPoint RandomKeyPoint(cv::RNG &rng) {
+  return cv::KeyPoint(rng.uniform(0.0f, 640.0f), rng.uniform(0.0f, 480.0f), rng.uniform(10.0f, 40.0f),
+                      rng.uniform(0.0f, 360.0f));
+}
+
+/**
+ * Moves a key point by the similarity transform scale * R(theta) * p + (tx, ty)
+ */
+cv::KeyPoint Transform(const cv::KeyPoint &key_point, float scale, float theta, float tx, float ty) {
+  float x = scale * (std::cos(theta) * key_point.pt.x - std::sin(theta) * key_point.pt.y) + tx;
+  float y = scale * (std::sin(theta) * key_point.pt.x + std::cos(theta) * key_point.pt.y) + ty;
+  float angle = std::fmod(key_point.angle + theta * 180 / (float) CV_PI, 360.0f);
+  return cv::KeyPoint(x, y, key_point.size * scale, angle);
+}
+}
+
+TEST(VerifyGeometryFindsTransformedImage, GeometricIndexTest) {
+  cv::RNG rng(7);
+  std::vector<cv::KeyPoint> query, transformed, unrelated;
+  std::vector<int> query_words, transformed_words, unrelated_words;
+  for (int i = 0; i < 200; i++) {
+    query.push_back(RandomKeyPoint(rng));
+    query_words.push_back(rng.uniform(0, 2500));
+    // Part of the query is visible in the transformed image, and the unrelated image reuses the same words elsewhere
+    if (i < 120) {
+      transformed.push_back(Transform(query.back(), 1.5f, 0.3f, 50, 20));
+      transformed_words.push_back(query_words.back());
+    }
+    unrelated.push_back(RandomKeyPoint(rng));
+    unrelated_words.push_back(query_words[rng.uniform(0, i + 1)]);
+  }
+
+  std::vector<GeometricFeature> query_features, transformed_features, unrelated_features;
+  QuantizeFeatures(query, query_words, query_features);
+  QuantizeFeatures(transformed, transformed_words, transformed_features);
+  QuantizeFeatures(unrelated, unrelated_words, unrelated_features);
+
+  GeometricVerificationParams params;
+  std::vector<Correspondence> scratch;
+  int inliers = VerifyGeometry(query_features.data(), query_features.size(), transformed_features.data(),
+                               transformed_features.size(), params, scratch);
+  int unrelated_inliers = VerifyGeometry(query_features.data(), query_features.size(), unrelated_features.data(),
+                                         unrelated_features.size(), params, scratch);
+  ASSERT_GE(inliers, 100);
+  ASSERT_LT(unrelated_inliers, 6);
+}
+
+TEST(CorrespondencesAreSubsampledEvenly, GeometricIndexTest) {
+  // The matching part of the images has the highest words, behind twice as many pairs that match nothing. The pairs
+  // kept once there are more than max_correspondences must still include the matching ones
+  cv::RNG rng(5);
+  std::vector<cv::KeyPoint> query, candidate;
+  std::vector<int> words;
+  for (int i = 0; i < 600; i++) {
+    query.push_back(RandomKeyPoint(rng));
+    words.push_back(i);
+    candidate.push_back(i < 400 ? RandomKeyPoint(rng) : Transform(query.back(), 1.2f, 0.4f, 200, 60));
+  }
+
+  std::vector<GeometricFeature> query_features, candidate_features;
+  QuantizeFeatures(query, words, query_features);
+  QuantizeFeatures(candidate, words, candidate_features);
+
+  GeometricVerificationParams params;
+  params.max_correspondences = 256;
+  std::vector<Correspondence> scratch;
+  int inliers = VerifyGeometry(query_features.data(), query_features.size(), candidate_features.data(),
+                               candidate_features.size(), params, scratch);
+  ASSERT_EQ(scratch.size(), 256u);
+  // A third of the kept pairs are from the matching part
+  ASSERT_GE(inliers, 60);
+  ASSERT_LE(inliers, 90);
+}
+
+TEST(WriteAndReadIndex, GeometricIndexTest) {
+  std::vector<cv::KeyPoint> key_points;
+  std::vector<int> words;
+  for (int i = 0; i < 10; i++) {
+    key_points.push_back(cv::KeyPoint(i * 10.0f, i * 5.0f, 20.0f, i * 30.0f));
+    words.push_back(9 - i);
+  }
+  std::vector<GeometricFeature> features;
+  QuantizeFeatures(key_points, words, features);
+  ASSERT_EQ(features.size(), 10u);
+  ASSERT_EQ(features[0].word, 0);
+  ASSERT_EQ(features[0].x, 360);
+
+  GeometricIndex index;
+  index.Add(features);
+  index.Add(std::vector<GeometricFeature>());
+  index.Add(features);
+  std::string file_path = "geometric_index_test.bin";
+  ASSERT_TRUE(index.WriteToDisk(file_path));
+
+  GeometricIndex read;
+  ASSERT_TRUE(read.ReadFromDisk(file_path));
+  std::remove(file_path.c_str());
+  ASSERT_EQ(read.image_count(), 3u);
+  ASSERT_EQ(read.feature_count(), 20u);
+  size_t count = 0;
+  read.ImageFeatures(1, count);
+  ASSERT_EQ(count, 0u);
+  const GeometricFeature *third = read.ImageFeatures(2, count);
+  ASSERT_EQ(count, 10u);
+  ASSERT_EQ(third[9].word, 9);
+}
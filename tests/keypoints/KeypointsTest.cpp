@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "Keypoints.hpp"
+
+TEST(CapKeepsStrongestResponses, KeypointsTest) {
+  cv::Mat image(480, 640, CV_8UC1);
+  cv::RNG rng(11);
+  rng.fill(image, cv::RNG::UNIFORM, 0, 255);
+  cv::GaussianBlur(image, image, cv::Size(5, 5), 0);
+
+  cv::Ptr<cv::xfeatures2d::SURF> surf;
+  KeypointPolicy uncapped;
+  std::vector<cv::KeyPoint> all = DetectKeyPoints(image, uncapped, surf);
+  ASSERT_GT(all.size(), 50u);
+
+  KeypointPolicy capped;
+  capped.max_keypoints = 50;
+  KeypointDetection detection;
+  std::vector<cv::KeyPoint> kept = DetectKeyPoints(image, capped, surf, &detection);
+  ASSERT_EQ(kept.size(), 50u);
+  ASSERT_EQ(detection.detected, (int) all.size());
+
+  std::vector<float> responses;
+  for (const cv::KeyPoint &key_point : all) {
+    responses.push_back(key_point.response);
+  }
+  std::sort(responses.rbegin(), responses.rend());
+  for (const cv::KeyPoint &key_point : kept) {
+    ASSERT_GE(key_point.response, responses[49]);
+  }
+}
+
+TEST(ThresholdIsLoweredToTheFloor, KeypointsTest) {
+  // Faint, heavily blurred noise has too little texture for the default threshold
+  cv::Mat image(480, 640, CV_8UC1);
+  cv::RNG rng(13);
+  rng.fill(image, cv::RNG::UNIFORM, 0, 255);
+  cv::GaussianBlur(image, image, cv::Size(0, 0), 8);
+  image.convertTo(image, CV_8U, 0.1, 115);
+
+  cv::Ptr<cv::xfeatures2d::SURF> surf;
+  KeypointDetection first_pass;
+  DetectKeyPoints(image, KeypointPolicy(), surf, &first_pass);
+  ASSERT_EQ(first_pass.passes, 1);
+
+  // More key points than any threshold finds, so the threshold halves from 400 until it reaches the floor
+  KeypointPolicy policy;
+  policy.min_keypoints = 100000;
+  policy.min_hessian_floor = 100;
+  KeypointDetection detection;
+  std::vector<cv::KeyPoint> key_points = DetectKeyPoints(image, policy, surf, &detection);
+  ASSERT_EQ(detection.passes, 3);
+  ASSERT_EQ(detection.hessian_threshold, 100);
+  ASSERT_EQ(detection.detected, (int) key_points.size());
+  ASSERT_GE(detection.detected, first_pass.detected);
+
+  // A floor which halving never reaches stops after the last pass instead
+  policy.min_hessian_floor = 10;
+  DetectKeyPoints(image, policy, surf, &detection);
+  ASSERT_EQ(detection.passes, 4);
+  ASSERT_EQ(detection.hessian_threshold, 50);
+
+  // A floor which is not a halving of the threshold is used as it is
+  policy.min_hessian_floor = 150;
+  DetectKeyPoints(image, policy, surf, &detection);
+  ASSERT_EQ(detection.passes, 3);
+  ASSERT_EQ(detection.hessian_threshold, 150);
+
+  KeypointStats stats;
+  stats.Record(first_pass, 0);
+  stats.Record(detection, 0);
+  ASSERT_EQ(stats.lowered_images, 1u);
+}
+
+TEST(EnoughKeyPointsKeepTheThreshold, KeypointsTest) {
+  cv::Mat image(480, 640, CV_8UC1);
+  cv::RNG rng(11);
+  rng.fill(image, cv::RNG::UNIFORM, 0, 255);
+  cv::GaussianBlur(image, image, cv::Size(5, 5), 0);
+
+  cv::Ptr<cv::xfeatures2d::SURF> surf;
+  KeypointPolicy policy;
+  policy.min_keypoints = 10;
+  KeypointDetection detection;
+  std::vector<cv::KeyPoint> key_points = DetectKeyPoints(image, policy, surf, &detection);
+  ASSERT_GE(key_points.size(), 10u);
+  ASSERT_EQ(detection.passes, 1);
+  ASSERT_EQ(detection.hessian_threshold, 400);
+
+  KeypointStats stats;
+  stats.Record(detection, 0);
+  ASSERT_EQ(stats.lowered_images, 0u);
+}
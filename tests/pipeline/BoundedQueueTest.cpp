@@ -0,0 +1,50 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+#include "BoundedQueue.hpp"
+
+TEST(PopsInOrder, BoundedQueueTest) {
+  BoundedQueue<int> queue(4);
+  ASSERT_TRUE(queue.Push(1));
+  ASSERT_TRUE(queue.Push(2));
+  int item = 0;
+  ASSERT_TRUE(queue.Pop(item));
+  ASSERT_EQ(item, 1);
+  ASSERT_TRUE(queue.TryPop(item));
+  ASSERT_EQ(item, 2);
+  ASSERT_FALSE(queue.TryPop(item));
+}
+
+TEST(DrainsAfterClose, BoundedQueueTest) {
+  BoundedQueue<int> queue(4);
+  queue.Push(7);
+  queue.Close();
+  ASSERT_FALSE(queue.Push(8));
+  int item = 0;
+  ASSERT_TRUE(queue.Pop(item));
+  ASSERT_EQ(item, 7);
+  ASSERT_FALSE(queue.Pop(item));
+}
+
+TEST(AppliesBackpressure, BoundedQueueTest) {
+  BoundedQueue<int> queue(2);
+  std::thread producer([&queue]() {
+    for (int i = 0; i < 100; i++) {
+      queue.Push(i);
+    }
+    queue.Close();
+  });
+
+  std::vector<int> items;
+  int item = 0;
+  while (queue.Pop(item)) {
+    items.push_back(item);
+  }
+  producer.join();
+
+  ASSERT_EQ(items.size(), 100);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(items[i], i);
+  }
+}
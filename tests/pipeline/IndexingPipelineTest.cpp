@@ -0,0 +1,69 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <boost/filesystem.hpp>
+
+#include "DescriptorArena.hpp"
+#include "IndexingPipeline.hpp"
+#include "Keypoints.hpp"
+
+namespace {
+const std::string kTestDir = "indexing_pipeline_test/";
+}
+
+TEST(ExtractsIntoArenaInOrder, IndexingPipelineTest) {
+  boost::filesystem::remove_all(kTestDir);
+  boost::filesystem::create_directories(kTestDir);
+
+  // Images of random discs, with an unreadable file, a missing file and a blank image without key points among them
+  cv::RNG rng(5);
+  std::vector<std::string> images;
+  std::vector<std::string> expected_images;
+  for (int i = 0; i < 12; i++) {
+    std::string image_path = kTestDir + std::to_string(i) + ".png";
+    images.push_back(image_path);
+    if (i == 3) {
+      std::ofstream(image_path.c_str()) << "not an image";
+      continue;
+    }
+    if (i == 7) {
+      continue;
+    }
+    cv::Mat image(120, 120, CV_8UC3, cv::Scalar(128, 128, 128));
+    if (i != 10) {
+      for (int disc = 0; disc < 30; disc++) {
+        cv::circle(image, cv::Point(rng.uniform(0, 120), rng.uniform(0, 120)), rng.uniform(3, 12),
+                   cv::Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)), -1);
+      }
+      expected_images.push_back(image_path);
+    }
+    cv::imwrite(image_path, image);
+  }
+
+  // Small queues and batches and several extract threads, so images finish out of order
+  IndexingPipelineConfig config;
+  config.extract_threads = 3;
+  config.queue_capacity = 2;
+  config.write_batch_size = 3;
+  KeypointPolicy policy;
+  DescriptorArena arena;
+  IndexingPipelineStats stats;
+  ExtractDescriptorsPipelined(images, policy, config, arena, stats);
+
+  ASSERT_EQ(stats.failed_images, 3u);
+  ASSERT_EQ(arena.image_count(), expected_images.size());
+  ASSERT_TRUE(arena.has_features());
+  cv::Ptr<cv::xfeatures2d::SURF> surf;
+  for (size_t i = 0; i < expected_images.size(); i++) {
+    ASSERT_EQ(arena.ImagePath(i), expected_images[i]);
+    std::vector<cv::KeyPoint> key_points;
+    cv::Mat descriptors;
+    ExtractDescriptors(cv::imread(expected_images[i]), policy, surf, key_points, descriptors);
+    ASSERT_EQ(cv::norm(arena.ImageDescriptors(i), descriptors, cv::NORM_INF), 0);
+  }
+  boost::filesystem::remove_all(kTestDir);
+}
@@ -0,0 +1,232 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/ml.hpp>
+#include <boost/filesystem.hpp>
+
+#include "Histogram.hpp"
+#include "QueryEngine.hpp"
+#include "utils.hpp"
+
+namespace {
+const std::string kTestDir = "query_engine_test/";
+
+/**
+ * Writes a small trained index to kTestDir: a random vocabulary, class_count classes of noisy histograms around a
+ * centre each, the SVM trained on them, and the image index and histogram directories the engine reads the classes from
+ */
+QueryEngineConfig WriteTestIndex(int class_count, int rows_per_class) {
+  boost::filesystem::remove_all(kTestDir);
+  boost::filesystem::create_directories(kTestDir + "histograms");
+  std::vector<std::string> names;
+  for (int c = 0; c < class_count; c++) {
+    names.push_back("class" + std::to_string(c));
+    boost::filesystem::create_directory(kTestDir + "histograms/" + names.back());
+  }
+  // The SVM labels are positions in the directory listing, which is not necessarily in name order
+  std::vector<std::string> listed = utils::Utility::get_classes(kTestDir + "histograms/");
+
+  cv::RNG rng(11);
+  const int words = 24;
+  cv::Mat vocabulary(words, 64, CV_32F);
+  rng.fill(vocabulary, cv::RNG::UNIFORM, -0.2, 0.2);
+  cv::Mat centres(class_count, words, CV_32F);
+  rng.fill(centres, cv::RNG::UNIFORM, 0, 1);
+
+  cv::Mat histograms(class_count * rows_per_class, words, CV_32F);
+  cv::Mat labels(histograms.rows, 1, CV_32S);
+  std::vector<std::string> images;
+  for (int i = 0; i < histograms.rows; i++) {
+    int c = i % class_count;
+    cv::Mat noise(1, words, CV_32F);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 1.5);
+    histograms.row(i) = centres.row(c) + noise;
+    cv::Mat row = histograms.row(i);
+    row /= cv::sum(row)[0];
+    labels.at<int>(i, 0) = (int) (std::find(listed.begin(), listed.end(), names[c]) - listed.begin());
+    images.push_back("images/00" + std::to_string(c) + "." + names[c] + "/" + std::to_string(i) + ".jpg");
+  }
+
+  cv::Ptr<cv::ml::SVM> svm = cv::ml::SVM::create();
+  svm->setType(cv::ml::SVM::C_SVC);
+  svm->setKernel(cv::ml::SVM::RBF);
+  svm->setGamma(20);
+  svm->setC(10);
+  svm->train(histograms, cv::ml::ROW_SAMPLE, labels);
+
+  QueryEngineConfig config;
+  config.vocabulary_path = kTestDir + "vocabulary.yml";
+  config.predictor_path = kTestDir + "predictor.yml";
+  config.training_data_path = kTestDir + "svm_training.yml";
+  config.image_index_path = kTestDir + "image_index.yml";
+  config.histograms_dir = kTestDir + "histograms/";
+  svm->save(config.predictor_path);
+  cv::FileStorage vocabulary_file(config.vocabulary_path, cv::FileStorage::WRITE);
+  vocabulary_file << "vocabulary" << vocabulary;
+  vocabulary_file.release();
+  cv::FileStorage training_file(config.training_data_path, cv::FileStorage::WRITE);
+  training_file << "svm_training" << histograms;
+  training_file.release();
+  WriteImageIndexToDisk(config.image_index_path, images);
+  return config;
+}
+
+/**
+ * Random discs on a grey background, each of which SURF detects as a blob
+ */
+std::vector<cv::Mat> MakeQueryImages(int count) {
+  cv::RNG rng(17);
+  std::vector<cv::Mat> images;
+  for (int i = 0; i < count; i++) {
+    cv::Mat image(160, 160, CV_8UC3, cv::Scalar(128, 128, 128));
+    for (int disc = 0; disc < 40; disc++) {
+      cv::circle(image, cv::Point(rng.uniform(0, 160), rng.uniform(0, 160)), rng.uniform(3, 15),
+                 cv::Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256)), -1);
+    }
+    images.push_back(image);
+  }
+  return images;
+}
+}
+
+TEST(ConcurrentQueriesMatchSerial, QueryEngineTest) {
+  QueryEngineConfig config = WriteTestIndex(5, 12);
+  // Every class is ranked and three are probed. Time budgets are left off, as they depend on scheduling
+  config.probe_classes = 3;
+  std::string error;
+  cv::Ptr<QueryEngine> engine = QueryEngine::Create(config, &error);
+  ASSERT_FALSE(engine.empty());
+  ASSERT_EQ(engine->image_count(), 60u);
+
+  std::vector<cv::Mat> images = MakeQueryImages(12);
+  std::vector<QueryResult> expected(images.size());
+  QueryScratch scratch;
+  for (size_t i = 0; i < images.size(); i++) {
+    engine->Query(images[i], scratch, expected[i]);
+    ASSERT_FALSE(expected[i].match.empty());
+  }
+
+  const int thread_count = 4;
+  std::vector<std::vector<QueryResult> > results(thread_count, std::vector<QueryResult>(images.size()));
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; t++) {
+    threads.push_back(std::thread([t, &engine, &images, &results]() {
+      // Each thread starts at a different image, so the threads query different images at the same time. Odd
+      // threads use their own scratch, even ones the engine's thread local one
+      QueryScratch thread_scratch;
+      for (size_t n = 0; n < images.size(); n++) {
+        size_t i = (n + t * 3) % images.size();
+        if (t % 2 == 1) {
+          engine->Query(images[i], thread_scratch, results[t][i]);
+        } else {
+          results[t][i] = engine->Query(images[i]);
+        }
+      }
+    }));
+  }
+  for (std::thread &worker : threads) {
+    worker.join();
+  }
+
+  for (int t = 0; t < thread_count; t++) {
+    for (size_t i = 0; i < images.size(); i++) {
+      ASSERT_EQ(results[t][i].match, expected[i].match);
+      ASSERT_EQ(results[t][i].score, expected[i].score);
+      ASSERT_EQ(results[t][i].predicted_class, expected[i].predicted_class);
+      ASSERT_EQ(results[t][i].classes_probed, expected[i].classes_probed);
+      ASSERT_EQ(results[t][i].rows_scored, expected[i].rows_scored);
+    }
+  }
+  boost::filesystem::remove_all(kTestDir);
+}
+
+TEST(MissingArtifactIsAnError, QueryEngineTest) {
+  QueryEngineConfig config = WriteTestIndex(2, 4);
+  config.predictor_path = kTestDir + "missing.yml";
+  std::string error;
+  ASSERT_TRUE(QueryEngine::Create(config, &error).empty());
+  ASSERT_EQ(error, config.predictor_path + " does not exist");
+  boost::filesystem::remove_all(kTestDir);
+}
+
+TEST(RankingStartsWithPrediction, QueryEngineTest) {
+  // Many classes, so classes tied on votes are common
+  QueryEngineConfig config = WriteTestIndex(7, 10);
+  config.probe_classes = 7;
+  cv::Ptr<QueryEngine> engine = QueryEngine::Create(config);
+  ASSERT_FALSE(engine.empty());
+  cv::Ptr<cv::ml::SVM> svm = cv::Algorithm::load<cv::ml::SVM>(config.predictor_path);
+
+  cv::RNG rng(23);
+  QueryScratch scratch;
+  for (int i = 0; i < 500; i++) {
+    cv::Mat histogram(1, 24, CV_32F);
+    rng.fill(histogram, cv::RNG::UNIFORM, 0, 1);
+    histogram /= cv::sum(histogram)[0];
+
+    engine->RankClasses(histogram, scratch);
+    ASSERT_EQ(scratch.class_order.size(), 7u);
+    ASSERT_EQ(scratch.class_order[0], (int) svm->predict(histogram));
+    std::vector<int> classes = scratch.class_order;
+    std::sort(classes.begin(), classes.end());
+    for (int c = 0; c < 7; c++) {
+      ASSERT_EQ(classes[c], c);
+    }
+  }
+  boost::filesystem::remove_all(kTestDir);
+}
+
+TEST(ProbeBudgetsLimitTheSearch, QueryEngineTest) {
+  QueryEngineConfig config = WriteTestIndex(5, 12);
+  std::vector<cv::Mat> images = MakeQueryImages(8);
+  // Runs every image through an engine with the given probe settings
+  auto query_all = [&config, &images](int probe_classes, int probe_rows, double probe_safe_score)
+      -> std::vector<QueryResult> {
+    QueryEngineConfig probe_config = config;
+    probe_config.probe_classes = probe_classes;
+    probe_config.probe_rows = probe_rows;
+    probe_config.probe_safe_score = probe_safe_score;
+    cv::Ptr<QueryEngine> engine = QueryEngine::Create(probe_config);
+    std::vector<QueryResult> results(images.size());
+    QueryScratch scratch;
+    for (size_t i = 0; i < images.size(); i++) {
+      engine->Query(images[i], scratch, results[i]);
+    }
+    return results;
+  };
+
+  std::vector<QueryResult> predicted = query_all(1, 0, 0);
+  std::vector<QueryResult> exhaustive = query_all(5, 0, 0);
+  std::vector<QueryResult> row_capped = query_all(5, 30, 0);
+  std::vector<QueryResult> safe = query_all(5, 0, 1e-6);
+  // No class can score more than 4 above any match, so every class after the first is skipped
+  std::vector<QueryResult> loose = query_all(5, 0, 4);
+  for (size_t i = 0; i < images.size(); i++) {
+    ASSERT_FALSE(exhaustive[i].match.empty());
+    ASSERT_EQ(predicted[i].classes_probed, 1);
+    ASSERT_EQ(predicted[i].rows_scored, 12);
+    ASSERT_EQ(exhaustive[i].classes_probed, 5);
+    ASSERT_EQ(exhaustive[i].rows_scored, 60);
+    // Probing more classes keeps the predicted class first, and can only find a better match
+    ASSERT_EQ(exhaustive[i].predicted_class, predicted[i].predicted_class);
+    ASSERT_GE(exhaustive[i].score, predicted[i].score);
+
+    // A third class would take the scored rows past 30
+    ASSERT_EQ(row_capped[i].classes_probed, 2);
+    ASSERT_EQ(row_capped[i].rows_scored, 24);
+
+    // Only classes which cannot beat the match are skipped, so the match is the exhaustive one
+    ASSERT_EQ(safe[i].match, exhaustive[i].match);
+    ASSERT_EQ(safe[i].score, exhaustive[i].score);
+    ASSERT_EQ(safe[i].classes_probed + safe[i].classes_skipped, 5);
+
+    ASSERT_EQ(loose[i].classes_probed, 1);
+    ASSERT_EQ(loose[i].classes_skipped, 4);
+    ASSERT_EQ(loose[i].match, predicted[i].match);
+  }
+  boost::filesystem::remove_all(kTestDir);
+}
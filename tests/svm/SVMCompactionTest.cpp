@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <opencv2/core.hpp>
+#include <opencv2/ml.hpp>
+
+#include "SVMCompaction.hpp"
+
+TEST(ReducedModelLoadsInPlace, SVMCompactionTest) {
+  // Three overlapping clusters, so the trained SVM keeps many support vectors
+  cv::RNG rng(3);
+  cv::Mat centers(3, 16, CV_32F);
+  rng.fill(centers, cv::RNG::UNIFORM, 0, 1);
+  cv::Mat samples(300, 16, CV_32F);
+  cv::Mat labels(300, 1, CV_32S);
+  for (int i = 0; i < samples.rows; i++) {
+    cv::Mat noise(1, 16, CV_32F);
+    rng.fill(noise, cv::RNG::NORMAL, 0, 0.3);
+    labels.at<int>(i, 0) = i % 3;
+    samples.row(i) = centers.row(i % 3) + noise;
+  }
+
+  cv::Ptr<cv::ml::SVM> svm = cv::ml::SVM::create();
+  svm->setType(cv::ml::SVM::C_SVC);
+  svm->setKernel(cv::ml::SVM::RBF);
+  svm->setGamma(1);
+  svm->setC(10);
+  svm->train(samples, cv::ml::ROW_SAMPLE, labels);
+  svm->save("svm_compaction_test.yml");
+
+  SVMCompactionParams params;
+  params.max_support_vectors = 12;
+  params.max_accuracy_loss = 0;
+  params.latency_rows = 10;
+  SVMCompactionReport report;
+  ASSERT_TRUE(CompactSVM("svm_compaction_test.yml", samples, labels, params, "svm_compaction_test_reduced.yml",
+                         report));
+
+  cv::Ptr<cv::ml::SVM> reduced = cv::Algorithm::load<cv::ml::SVM>("svm_compaction_test_reduced.yml");
+  ASSERT_TRUE(reduced->isTrained());
+  ASSERT_LE(reduced->getSupportVectors().rows, 12);
+  ASSERT_GT(report.original_support_vectors, 12);
+  ASSERT_EQ(report.validation_rows, samples.rows);
+  ASSERT_GE(report.agreement, 0.9);
+  ASSERT_FALSE(report.copied);
+
+  std::remove("svm_compaction_test.yml");
+  std::remove("svm_compaction_test_reduced.yml");
+}
+
+TEST(UnsupportedModelIsCopied, SVMCompactionTest) {
+  cv::RNG rng(7);
+  cv::Mat samples(60, 8, CV_32F);
+  rng.fill(samples, cv::RNG::UNIFORM, 0, 1);
+  cv::Mat labels(60, 1, CV_32S);
+  for (int i = 0; i < samples.rows; i++) {
+    labels.at<int>(i, 0) = i % 2;
+  }
+  cv::Ptr<cv::ml::SVM> svm = cv::ml::SVM::create();
+  svm->setType(cv::ml::SVM::C_SVC);
+  svm->setKernel(cv::ml::SVM::LINEAR);
+  svm->train(samples, cv::ml::ROW_SAMPLE, labels);
+  svm->save("svm_compaction_test.yml");
+
+  SVMCompactionParams params;
+  params.max_support_vectors = 2;
+  params.latency_rows = 10;
+  SVMCompactionReport report;
+  ASSERT_TRUE(CompactSVM("svm_compaction_test.yml", samples, labels, params, "svm_compaction_test_reduced.yml",
+                         report));
+  ASSERT_TRUE(report.copied);
+  ASSERT_EQ(report.reduced_support_vectors, report.original_support_vectors);
+  cv::Ptr<cv::ml::SVM> copy = cv::Algorithm::load<cv::ml::SVM>("svm_compaction_test_reduced.yml");
+  ASSERT_EQ(copy->getKernelType(), (int) cv::ml::SVM::LINEAR);
+
+  std::remove("svm_compaction_test.yml");
+  std::remove("svm_compaction_test_reduced.yml");
+}
+
+TEST(MissingModelWritesNothing, SVMCompactionTest) {
+  cv::Mat samples(4, 8, CV_32F, cv::Scalar(0));
+  cv::Mat labels(4, 1, CV_32S, cv::Scalar(0));
+  SVMCompactionParams params;
+  SVMCompactionReport report;
+  std::string error;
+  ASSERT_FALSE(CompactSVM("missing_svm_compaction_test.yml", samples, labels, params,
+                          "svm_compaction_test_reduced.yml", report, &error));
+  ASSERT_EQ(error, "missing_svm_compaction_test.yml could not be loaded as a trained SVM");
+  ASSERT_FALSE(std::ifstream("svm_compaction_test_reduced.yml").good());
+}
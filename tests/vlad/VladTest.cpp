@@ -0,0 +1,77 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <opencv2/core.hpp>
+
+#include "Assignment.hpp"
+#include "DescriptorArena.hpp"
+#include "Vlad.hpp"
+
+TEST(SignedSqrtThenL2Normalized, VladTest) {
+  cv::Mat vocabulary = (cv::Mat_<float>(2, 2) << 0, 0, 10, 10);
+  // Residuals sum to (1, 4) on the first word and (-1, 0) on the second
+  cv::Mat descriptors = (cv::Mat_<float>(4, 2) << 1, 0, 0, 4, 9, 10, 10, 10);
+  cv::Mat vlad = ComputeVlad(descriptors, vocabulary, ComputeCentroidNorms(vocabulary));
+
+  ASSERT_EQ(vlad.cols, 4);
+  const float expected[] = {1, 2, -1, 0};
+  for (int i = 0; i < 4; i++) {
+    ASSERT_NEAR(vlad.at<float>(0, i), expected[i] / std::sqrt(6.0f), 1e-6);
+  }
+  ASSERT_TRUE(ComputeVlad(cv::Mat(0, 2, CV_32F), vocabulary, ComputeCentroidNorms(vocabulary)).empty());
+}
+
+TEST(DiskRoundTrip, VladTest) {
+  cv::RNG rng(17);
+  VladIndex index;
+  index.vocabulary.create(4, 8, CV_32F);
+  rng.fill(index.vocabulary, cv::RNG::UNIFORM, -1, 1);
+  index.centroid_norms = ComputeCentroidNorms(index.vocabulary);
+  cv::Mat sample(20, 32, CV_32F);
+  rng.fill(sample, cv::RNG::UNIFORM, -1, 1);
+  index.pca = cv::PCA(sample, cv::noArray(), cv::PCA::DATA_AS_ROW, 3);
+  index.vectors.create(2, 3, CV_32F);
+  rng.fill(index.vectors, cv::RNG::UNIFORM, -1, 1);
+  index.images.push_back("data/images/001.ak47/001_0001.jpg");
+  index.images.push_back("data/images/002.american-flag/002_0001.jpg");
+
+  WriteVladIndexToDisk("vlad_index_test.yml", index);
+  VladIndex read;
+  ASSERT_TRUE(ReadVladIndexFromDisk("vlad_index_test.yml", read));
+  std::remove("vlad_index_test.yml");
+
+  ASSERT_EQ(read.images, index.images);
+  ASSERT_EQ(cv::norm(read.vocabulary, index.vocabulary, cv::NORM_INF), 0.0);
+  ASSERT_EQ(cv::norm(read.vectors, index.vectors, cv::NORM_INF), 0.0);
+  ASSERT_EQ(cv::norm(read.centroid_norms, index.centroid_norms, cv::NORM_INF), 0.0);
+
+  // The read projection encodes an image the same as the original
+  cv::Mat descriptors(30, 8, CV_32F);
+  rng.fill(descriptors, cv::RNG::UNIFORM, -1, 1);
+  cv::Mat encoded = EncodeVlad(descriptors, index);
+  ASSERT_EQ(encoded.cols, 3);
+  ASSERT_NEAR(cv::norm(encoded), 1, 1e-5);
+  ASSERT_LT(cv::norm(EncodeVlad(descriptors, read), encoded, cv::NORM_INF), 1e-5);
+}
+
+TEST(IndexMatchesEncodedArena, VladTest) {
+  cv::RNG rng(29);
+  DescriptorArena arena;
+  for (int i = 0; i < 6; i++) {
+    cv::Mat descriptors(40 + i, 64, CV_32F);
+    rng.fill(descriptors, cv::RNG::UNIFORM, -1, 1);
+    arena.Append(descriptors, "data/images/00" + std::to_string(i) + ".class/" + std::to_string(i) + ".jpg");
+  }
+
+  VladIndex index;
+  BuildVladIndex(arena, 8, 4, index);
+  ASSERT_EQ(index.vocabulary.rows, 8);
+  ASSERT_EQ(index.vectors.rows, 6);
+  ASSERT_EQ(index.vectors.cols, 4);
+  // Each image is indexed under its own path, with the vector a query of the same descriptors would be encoded to
+  for (int i = 0; i < 6; i++) {
+    ASSERT_EQ(index.images[i], arena.ImagePath(i));
+    ASSERT_LT(cv::norm(index.vectors.row(i), EncodeVlad(arena.ImageDescriptors(i), index), cv::NORM_INF), 1e-5);
+  }
+}
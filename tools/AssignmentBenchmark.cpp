@@ -0,0 +1,128 @@
+/**
+ * AssignmentBenchmark.cpp
+ *
+ * Compares the blocked nearest centroid search in Assignment.cpp against cv::BFMatcher, which is what
+ * cv::BOWImgDescriptorExtractor uses to assign descriptors to vocabulary words, and against the int8 assignment of
+ * QuantizedVocabulary.cpp with each kernel the CPU supports. Reports the time taken by each, the throughput in
+ * descriptors per second, and how often each agrees with the floating point nearest word.
+ *
+ * usage: ./assignment-benchmark [vocabulary.yml] [descriptor_count] [data/descriptors.bin]
+ *
+ * Descriptors are sampled from the descriptor file written by the extract stage if it exists, otherwise they are
+ * generated at random.
+ */
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <boost/filesystem.hpp>
+
+#include "Assignment.hpp"
+#include "QuantizedVocabulary.hpp"
+#include "Surf.hpp"
+#include "Vocabulary.hpp"
+
+using namespace std;
+
+namespace {
+double ElapsedMs(chrono::steady_clock::time_point start) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Picks descriptor_count descriptors to benchmark with
+ * @param descriptors_path std::string the descriptor file written by the extract stage
+ * @param descriptor_count int the number of descriptors to use
+ * @param dims int the number of dimensions of a descriptor
+ * @return cv::Mat the CV_32F descriptors
+ */
+cv::Mat LoadDescriptors(const string &descriptors_path, int descriptor_count, int dims) {
+  if (boost::filesystem::exists(descriptors_path)) {
+    cv::Mat all = ReadDescriptorsFromDisk(descriptors_path);
+    if (all.rows > 0 && all.cols == dims) {
+      cv::Mat sample(descriptor_count, dims, CV_32F);
+      cv::RNG rng(42);
+      for (int i = 0; i < descriptor_count; i++) {
+        all.row(rng.uniform(0, all.rows)).copyTo(sample.row(i));
+      }
+      return sample;
+    }
+  }
+
+  cout << "No descriptors found at " << descriptors_path << ", using random descriptors" << endl;
+  cv::Mat random(descriptor_count, dims, CV_32F);
+  cv::randu(random, -0.5, 0.5);
+  return random;
+}
+}
+
+int main(int argc, char** argv) {
+  string vocabulary_path = argc > 1 ? argv[1] : "vocabulary.yml";
+  int descriptor_count = argc > 2 ? atoi(argv[2]) : 100000;
+  string descriptors_path = argc > 3 ? argv[3] : "data/descriptors.bin";
+
+  cv::Mat vocabulary;
+  if (VocabularyExists(vocabulary_path)) {
+    vocabulary = ReadVocabularyFromDisk(vocabulary_path);
+  } else {
+    cout << "No vocabulary found at " << vocabulary_path << ", using a random 2500 word vocabulary" << endl;
+    vocabulary.create(2500, 64, CV_32F);
+    cv::randu(vocabulary, -0.5, 0.5);
+  }
+  cv::Mat descriptors = LoadDescriptors(descriptors_path, descriptor_count, vocabulary.cols);
+
+  // cv::BFMatcher, as used by cv::BOWImgDescriptorExtractor
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  cv::BFMatcher matcher(cv::NORM_L2);
+  vector<cv::DMatch> matches;
+  matcher.match(descriptors, vocabulary, matches);
+  double bf_ms = ElapsedMs(start);
+
+  // Blocked GEMM assignment. Includes computing the centroid norms, which is normally done once per vocabulary
+  start = chrono::steady_clock::now();
+  vector<int> labels;
+  AssignToNearestCentroids(descriptors, vocabulary, ComputeCentroidNorms(vocabulary), labels);
+  double gemm_ms = ElapsedMs(start);
+
+  int agreed = 0;
+  for (size_t i = 0; i < matches.size(); i++) {
+    if (matches[i].trainIdx == labels[matches[i].queryIdx]) {
+      agreed++;
+    }
+  }
+
+  cout << descriptors.rows << " descriptors x " << vocabulary.rows << " words x " << vocabulary.cols << " dims" << endl;
+  cout << "BFMatcher:      " << bf_ms << " ms (" << descriptors.rows / bf_ms * 1000 << " descriptors/s)" << endl;
+  cout << "blocked GEMM:   " << gemm_ms << " ms (" << descriptors.rows / gemm_ms * 1000 << " descriptors/s)" << endl;
+  cout << "speedup:        " << bf_ms / gemm_ms << "x" << endl;
+  cout << "agreement:      " << 100.0 * agreed / max<size_t>(1, matches.size()) << "%" << endl;
+
+  // int8 assignment, against the blocked GEMM labels. Quantizing the vocabulary is done once per vocabulary so is not
+  // timed
+  const Int8Kernel kernels[] = {Int8Kernel::kScalar, Int8Kernel::kAvx2, Int8Kernel::kVnni};
+  for (Int8Kernel kernel : kernels) {
+    if (!Int8KernelSupported(kernel)) {
+      cout << "int8 " << Int8KernelName(kernel) << ": not supported by this CPU or compiler" << endl;
+      continue;
+    }
+    QuantizedVocabulary quantized(vocabulary, kernel);
+    start = chrono::steady_clock::now();
+    vector<int> int8_labels;
+    quantized.Assign(descriptors, int8_labels);
+    double int8_ms = ElapsedMs(start);
+
+    int int8_agreed = 0;
+    for (size_t i = 0; i < labels.size(); i++) {
+      if (int8_labels[i] == labels[i]) {
+        int8_agreed++;
+      }
+    }
+    cout << "int8 " << Int8KernelName(kernel) << ": " << int8_ms << " ms (" << descriptors.rows / int8_ms * 1000
+         << " descriptors/s), " << gemm_ms / int8_ms << "x blocked GEMM, agreement "
+         << 100.0 * int8_agreed / max<size_t>(1, labels.size()) << "%" << endl;
+  }
+  return 0;
+}
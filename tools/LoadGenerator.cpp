@@ -0,0 +1,247 @@
+/**
+ * LoadGenerator.cpp
+ *
+ * Measures how many queries per second a single machine can sustain, and at what latency. Replays a list of query
+ * images through the query path (decode, Bag of Visual Words histogram, SVM classification, correlation scoring within
+ * the class and resolving the match's file path) from N threads sharing one QueryEngine inside one process, then
+ * reports the throughput and the latency distribution.
+ *
+ * usage: ./load-generator queries.txt [--threads=4] [--mode=closed|open] [--rate=50] [--requests=1000]
+ *                         [--min-hessian=400] [--min-keypoints=0] [--max-keypoints=0] [--assignment=float|int8]
+ *                         [--probe-classes=1] [--probe-time-ms=0] [--probe-rows=0] [--probe-safe-score=0]
+ *                         [--rerank-top-n=0] [--rerank-time-ms=5] [--rerank-min-inliers=6]
+ *                         [--predictor=predictor.yml]
+ *
+ * closed  every thread issues its next query as soon as the previous one is answered. Measures the maximum throughput
+ * open    queries arrive at a fixed --rate per second regardless of how fast they are answered. Each latency is
+ *         measured from when the query was due to be sent, so the time a query spends waiting for a free thread is
+ *         counted and an overloaded engine shows up in the tail instead of as a silently lower arrival rate
+ *
+ * The artifacts of the train stage in the working directory are used (see QueryEngineConfig). The key point, probe and
+ * re-rank options set the engine's key point policy, multi-class probing budget and geometric re-ranking, so their
+ * effect on latency can be measured. --predictor=predictor_reduced.yml classifies with the SVM written by the compact
+ * stage instead. The distribution of key points per query is reported alongside the latency.
+ * Query images are read into memory up front so that disk reads are not part of the measured latency.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <boost/filesystem.hpp>
+
+#include "QueryEngine.hpp"
+
+using namespace std;
+
+namespace {
+struct LoadOptions {
+  string query_list_path;
+  int threads = 4;
+  bool open_loop = false;
+  double rate = 50;
+  int requests = 1000;
+  QueryEngineConfig engine_config;
+};
+
+struct QueryWorkload {
+  vector<vector<uchar> > encoded_images;
+  cv::Ptr<QueryEngine> engine;
+};
+
+bool ParseOption(const string &option, LoadOptions &out_options) {
+  size_t separator = option.find('=');
+  if (option.compare(0, 2, "--") != 0 || separator == string::npos) {
+    return false;
+  }
+  string name = option.substr(2, separator - 2);
+  string value = option.substr(separator + 1);
+
+  if (name == "threads") {
+    out_options.threads = max(1, atoi(value.c_str()));
+  } else if (name == "mode" && (value == "open" || value == "closed")) {
+    out_options.open_loop = value == "open";
+  } else if (name == "rate") {
+    out_options.rate = atof(value.c_str());
+  } else if (name == "requests") {
+    out_options.requests = atoi(value.c_str());
+  } else if (name == "min-hessian") {
+    out_options.engine_config.keypoint_policy.min_hessian = atoi(value.c_str());
+  } else if (name == "min-keypoints") {
+    out_options.engine_config.keypoint_policy.min_keypoints = atoi(value.c_str());
+  } else if (name == "max-keypoints") {
+    out_options.engine_config.keypoint_policy.max_keypoints = atoi(value.c_str());
+  } else if (name == "assignment" && (value == "float" || value == "int8")) {
+    out_options.engine_config.quantized_assignment = value == "int8";
+  } else if (name == "probe-classes") {
+    out_options.engine_config.probe_classes = atoi(value.c_str());
+  } else if (name == "probe-time-ms") {
+    out_options.engine_config.probe_time_ms = atof(value.c_str());
+  } else if (name == "probe-rows") {
+    out_options.engine_config.probe_rows = atoi(value.c_str());
+  } else if (name == "probe-safe-score") {
+    out_options.engine_config.probe_safe_score = atof(value.c_str());
+  } else if (name == "rerank-top-n") {
+    out_options.engine_config.rerank_top_n = atoi(value.c_str());
+  } else if (name == "rerank-time-ms") {
+    out_options.engine_config.rerank_time_ms = atof(value.c_str());
+  } else if (name == "rerank-min-inliers") {
+    out_options.engine_config.rerank_min_inliers = atoi(value.c_str());
+  } else if (name == "predictor") {
+    out_options.engine_config.predictor_path = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Reads every query image listed in a file into memory, still encoded
+ * @param query_list_path std::string the relative path to a file holding one query image path per line
+ * @param out_images vector<vector<uchar>> the contents of each readable image file
+ */
+void LoadQueryImages(const string &query_list_path, vector<vector<uchar> > &out_images) {
+  ifstream query_list(query_list_path.c_str());
+  string line;
+  while (getline(query_list, line)) {
+    if (line.empty() || !boost::filesystem::exists(line)) {
+      continue;
+    }
+    ifstream file(line.c_str(), ios::binary);
+    out_images.push_back(vector<uchar>((istreambuf_iterator<char>(file)), istreambuf_iterator<char>()));
+  }
+}
+
+/**
+ * Answers a single query the same way the query command does
+ * @param encoded_image vector<uchar> the contents of the query image file
+ * @param engine QueryEngine the engine shared by every thread
+ * @param scratch QueryScratch the calling thread's working memory
+ * @param stats KeypointStats the calling thread's key point stats, the query's key points are recorded in them
+ */
+void RunOneQuery(const vector<uchar> &encoded_image, const QueryEngine &engine, QueryScratch &scratch,
+                 KeypointStats &stats) {
+  cv::Mat image = cv::imdecode(encoded_image, cv::IMREAD_COLOR);
+  QueryResult result;
+  engine.Query(image, scratch, result);
+  stats.Record(result.keypoints, result.descriptor_seconds);
+}
+
+double Percentile(const vector<double> &sorted_latencies, double percentile) {
+  size_t index = (size_t) (percentile / 100 * (sorted_latencies.size() - 1) + 0.5);
+  return sorted_latencies[min(index, sorted_latencies.size() - 1)];
+}
+
+/**
+ * Prints the throughput, latency percentiles and a histogram of the latencies in power of two millisecond buckets
+ * @param latencies vector<double> the latency of every query in milliseconds
+ * @param wall_seconds double the time taken to answer every query
+ */
+void PrintReport(vector<double> &latencies, double wall_seconds) {
+  sort(latencies.begin(), latencies.end());
+  cout << "queries: " << latencies.size() << " in " << wall_seconds << "s, " << latencies.size() / wall_seconds
+       << " QPS" << endl;
+  cout << "latency ms: p50 " << Percentile(latencies, 50) << "  p90 " << Percentile(latencies, 90) << "  p99 "
+       << Percentile(latencies, 99) << "  p99.9 " << Percentile(latencies, 99.9) << "  max " << latencies.back()
+       << endl;
+
+  size_t next = 0;
+  for (double bucket = 1; next < latencies.size(); bucket *= 2) {
+    size_t count = 0;
+    while (next < latencies.size() && latencies[next] < bucket) {
+      count++;
+      next++;
+    }
+    if (count > 0) {
+      cout << "  < " << bucket << " ms\t" << count << "\t" << string((size_t) (60.0 * count / latencies.size()), '#')
+           << endl;
+    }
+  }
+}
+}
+
+int main(int argc, char** argv) {
+  LoadOptions options;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (options.query_list_path.empty() && arg.compare(0, 2, "--") != 0) {
+      options.query_list_path = arg;
+    } else if (!ParseOption(arg, options)) {
+      cout << "Unknown option " << arg << endl;
+      return -1;
+    }
+  }
+  if (options.query_list_path.empty()) {
+    cout << "usage: ./load-generator queries.txt [--threads=4] [--mode=closed|open] [--rate=50] [--requests=1000]"
+         << " [--min-hessian=400] [--min-keypoints=0] [--max-keypoints=0] [--assignment=float|int8]"
+         << " [--probe-classes=1] [--probe-time-ms=0] [--probe-rows=0] [--probe-safe-score=0] [--rerank-top-n=0]"
+         << " [--rerank-time-ms=5] [--rerank-min-inliers=6] [--predictor=predictor.yml]" << endl;
+    return -1;
+  }
+
+  QueryWorkload workload;
+  LoadQueryImages(options.query_list_path, workload.encoded_images);
+  if (workload.encoded_images.empty()) {
+    cout << "No readable query images in " << options.query_list_path << endl;
+    return -1;
+  }
+  string error;
+  workload.engine = QueryEngine::Create(options.engine_config, &error);
+  if (workload.engine.empty()) {
+    cout << "Could not load the query engine: " << error << endl << "Run the train stage first" << endl;
+    return -1;
+  }
+
+  cout << "Replaying " << workload.encoded_images.size() << " query images, " << options.requests << " requests from "
+       << options.threads << " threads, "
+       << (options.open_loop ? "open loop at " + to_string(options.rate) + " QPS" : string("closed loop")) << endl;
+
+  // Threads claim request numbers from a shared counter. In open loop mode request i is due at start + i / rate
+  atomic<int> next_request(0);
+  vector<vector<double> > thread_latencies(options.threads);
+  vector<KeypointStats> thread_keypoints(options.threads);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<thread> threads;
+  for (int t = 0; t < options.threads; t++) {
+    threads.push_back(thread([&options, &workload, &next_request, &thread_latencies, &thread_keypoints, start, t]() {
+      QueryScratch scratch;
+      for (int request = next_request++; request < options.requests; request = next_request++) {
+        chrono::steady_clock::time_point sent = chrono::steady_clock::now();
+        if (options.open_loop) {
+          sent = start + chrono::duration_cast<chrono::steady_clock::duration>(
+              chrono::duration<double>(request / options.rate));
+          this_thread::sleep_until(sent);
+        }
+
+        RunOneQuery(workload.encoded_images[request % workload.encoded_images.size()], *workload.engine, scratch,
+                    thread_keypoints[t]);
+        thread_latencies[t].push_back(
+            chrono::duration<double, milli>(chrono::steady_clock::now() - sent).count());
+      }
+    }));
+  }
+  for (thread &worker : threads) {
+    worker.join();
+  }
+  double wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  vector<double> latencies;
+  KeypointStats keypoints;
+  for (int t = 0; t < options.threads; t++) {
+    latencies.insert(latencies.end(), thread_latencies[t].begin(), thread_latencies[t].end());
+    keypoints.Merge(thread_keypoints[t]);
+  }
+  if (latencies.empty()) {
+    return 0;
+  }
+  PrintReport(latencies, wall_seconds);
+  PrintKeypointStats(keypoints);
+  return 0;
+}